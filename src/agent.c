@@ -0,0 +1,296 @@
+#include "agent.h"
+#include "ring.h"
+
+#include <assert.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Shared-memory channel when started with -t shm, stdin is then the memfd
+ * holding it and stdout an eventfd to wake the server with.
+ */
+static struct agent_channel *channel;
+
+/* The server that spawned us. A -t shm agent never sees EOF, so it watches
+ * for being reparented instead.
+ */
+static pid_t parent;
+
+static int coordinate_valid(struct coordinate coord, int width, int height)
+{
+    return coord.x >= 0 && coord.x < height && coord.y >= 0 && coord.y < width;
+}
+
+/* Tries up, right, down and left in that order and takes the first free
+ * cell that gets closer to (approach) or farther from (!approach) the
+ * adversary. Stays put if none does.
+ */
+static struct coordinate decide(const struct server_message *message,
+        int width, int height, int approach)
+{
+    struct coordinate location = message->pos;
+    struct coordinate request;
+    enum { UP, RIGHT, DOWN, LEFT, CURR, DONE } state = UP;
+    /* The server sees the obstacles between us, follow it when it can */
+    if (coordinate_valid(message->best_step, width, height)) {
+        return message->best_step;
+    }
+    for (;;) {
+        switch (state) {
+            case UP:
+                request.x = location.x - 1;
+                request.y = location.y;
+                state = RIGHT;
+                break;
+            case RIGHT:
+                request.x = location.x;
+                request.y = location.y + 1;
+                state = DOWN;
+                break;
+            case DOWN:
+                request.x = location.x + 1;
+                request.y = location.y;
+                state = LEFT;
+                break;
+            case LEFT:
+                request.x = location.x;
+                request.y = location.y - 1;
+                state = CURR;
+                break;
+            case CURR:
+                request = location;
+                state = DONE;
+                break;
+            case DONE:
+                assert(0);
+                break;
+        }
+        if (state == DONE) {
+            break;
+        }
+
+        int request_dist = abs(request.x - message->adv_pos.x) +
+            abs(request.y - message->adv_pos.y);
+        int location_dist = abs(location.x - message->adv_pos.x) +
+            abs(location.y - message->adv_pos.y);
+        int move_possible = coordinate_valid(request, width, height) &&
+            (approach ? request_dist < location_dist : request_dist > location_dist);
+        if (move_possible) {
+            int i;
+            for (i = 0; i < message->object_count && move_possible; i++) {
+                move_possible = !(request.x == message->object_pos[i].x &&
+                        request.y == message->object_pos[i].y);
+            }
+        }
+
+        if (move_possible) {
+            break;
+        }
+    }
+    return request;
+}
+
+struct coordinate hunter_decide(const struct server_message *message, int width, int height)
+{
+    return decide(message, width, height, 1);
+}
+
+struct coordinate prey_decide(const struct server_message *message, int width, int height)
+{
+    return decide(message, width, height, 0);
+}
+
+static int receive_state(struct server_message *message)
+{
+    if (channel == NULL) {
+        return read(STDIN_FILENO, message, sizeof *message) == sizeof *message;
+    }
+    while (!ring_pop(&channel->to_agent, message, sizeof *message)) {
+        if (getppid() != parent) {
+            return 0;
+        }
+        ring_wait(&channel->to_agent);
+    }
+    return 1;
+}
+
+static int send_move(const struct ph_message *message)
+{
+    if (channel == NULL) {
+        return write(STDOUT_FILENO, message, sizeof *message) == sizeof *message;
+    }
+    int wake = ring_push(&channel->to_server, message, sizeof *message);
+    if (wake == -1) {
+        return 0;
+    }
+    if (wake) {
+        uint64_t one = 1;
+        return write(STDOUT_FILENO, &one, sizeof one) == sizeof one;
+    }
+    return 1;
+}
+
+/* Moves are held back by the usual pause, one per agent */
+struct host_reply {
+    long long due;
+    struct host_move move;
+};
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Writes all of buf, returns 0 if the server went away */
+static int write_all(const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, p, len);
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Main loop in host mode, over the socket on stdin and stdout */
+static int host_main(agent_decide_fn decide, int width, int height, int paced)
+{
+    static struct host_state states[HOST_MAX_AGENTS];
+    static struct host_reply pending[HOST_MAX_AGENTS];
+    static struct host_move out[HOST_MAX_AGENTS];
+    size_t have = 0;
+    int i, n_pending = 0;
+
+    for (;;) {
+        long long now = now_ms();
+        int n_out = 0, timeout = -1;
+        for (i = 0; i < n_pending; i++) {
+            if (pending[i].due <= now) {
+                out[n_out++] = pending[i].move;
+                pending[i--] = pending[--n_pending];
+            } else if (timeout == -1 || pending[i].due - now < timeout) {
+                timeout = pending[i].due - now;
+            }
+        }
+        if (n_out > 0 && !write_all(out, n_out * sizeof *out)) {
+            return 3;
+        }
+
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        if (timeout != -1 && poll(&pfd, 1, timeout) == 0) {
+            continue;
+        }
+        ssize_t n = read(STDIN_FILENO, (char *)states + have, sizeof states - have);
+        if (n <= 0) {
+            return 2;
+        }
+        have += n;
+        int n_states = have / sizeof *states;
+        now = now_ms();
+        if (n_pending + n_states > HOST_MAX_AGENTS) {
+            /* More states than agents in flight */
+            return 1;
+        }
+        for (i = 0; i < n_states; i++) {
+            struct host_reply *reply = &pending[n_pending++];
+            reply->move.idx = states[i].idx;
+            reply->move.move.move_request = decide(&states[i].state, width, height);
+            reply->due = paced ? now + 10*(1 + rand()%9) : now;
+        }
+        /* Keep the start of a state cut short by the read */
+        have -= n_states * sizeof *states;
+        memmove(states, states + n_states, have);
+    }
+}
+
+int agent_main(int argc, char **argv, agent_decide_fn decide)
+{
+    int width;
+    int height;
+    int opt;
+    unsigned seed = time(NULL);
+    int paced = 1;
+    int host = 0;
+
+    parent = getppid();
+    while ((opt = getopt(argc, argv, "t:s:nH")) != -1) {
+        switch (opt) {
+            case 't':
+                if (strcmp(optarg, "shm") == 0) {
+                    channel = mmap(NULL, sizeof *channel, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, STDIN_FILENO, 0);
+                    if (channel == MAP_FAILED) {
+                        return 1;
+                    }
+                } else if (strcmp(optarg, "socket") != 0) {
+                    return 1;
+                }
+                break;
+            case 's':
+                if (sscanf(optarg, "%u", &seed) != 1) {
+                    return 1;
+                }
+                break;
+            case 'n':
+                paced = 0;
+                break;
+            case 'H':
+                host = 1;
+                break;
+            default:
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        return 1;
+    }
+    if (sscanf(argv[optind], "%d", &width) != 1) {
+        return 1;
+    }
+    if (sscanf(argv[optind + 1], "%d", &height) != 1) {
+        return 1;
+    }
+    srand(seed);
+    if (host) {
+        return channel ? 1 : host_main(decide, width, height, paced);
+    }
+
+    for (;;) {
+        struct server_message message;
+        if (!receive_state(&message)) {
+            return 2;
+        }
+
+        struct ph_message req_msg;
+        if (message.object_count == AGENT_RESET) {
+            width = message.pos.x;
+            height = message.pos.y;
+            srand(message.adv_pos.x);
+            paced = message.adv_pos.y;
+            req_msg.move_request.x = -1;
+            req_msg.move_request.y = -1;
+            if (!send_move(&req_msg)) {
+                return 3;
+            }
+            continue;
+        }
+        req_msg.move_request = decide(&message, width, height);
+        if (!send_move(&req_msg)) {
+            return 3;
+        }
+        if (paced) {
+            usleep(10000*(1 + rand()%9));
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef AGENT_H
+#define AGENT_H
+
+#include "globals.h"
+
+typedef struct coordinate (*agent_decide_fn)(const struct server_message *message,
+        int width, int height);
+
+/* Pure decision logic, shared by the agent executables and the server's
+ * in-process engine.
+ */
+struct coordinate hunter_decide(const struct server_message *message, int width, int height);
+struct coordinate prey_decide(const struct server_message *message, int width, int height);
+
+/* Main loop of an agent process:
+ * ./agent [-t socket|shm] [-s seed] [-n] [-H] width height
+ * -n turns off the 10-90 ms pause after each move. -H drives every agent
+ * the server sends states for, see host_state in globals.h. A state with
+ * AGENT_RESET starts the agent over on another map.
+ */
+int agent_main(int argc, char **argv, agent_decide_fn decide);
+
+#endif
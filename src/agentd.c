@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+
+#include "globals.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Keeps hunter and prey processes warm between server runs. ./server -A
+ * socket leases as many agents as its scenario has and re-targets them with
+ * AGENT_RESET, they come back here when the server disconnects. The pool
+ * grows on demand and shrinks to the largest lease among the last
+ * AGENTD_WINDOW ones.
+ */
+
+#define AGENTD_WINDOW 8
+
+struct agent {
+    int fd;
+    pid_t pid;
+};
+
+struct kind_pool {
+    const char *path;
+    struct agent *idle;
+    int n_idle;
+    int cap_idle;
+    int n_leased;
+    int recent[AGENTD_WINDOW];
+};
+
+struct client {
+    int fd;
+    int leased;
+    /* Hunters first */
+    struct agent *agents;
+    int n_agents[2];
+};
+
+static struct {
+    const char *path;
+    int listen_fd;
+    struct kind_pool kinds[2];
+    struct client *clients;
+    int n_clients;
+    int cap_clients;
+    long n_leases;
+    volatile sig_atomic_t stopping;
+} agentd = {
+    .kinds = { { .path = "./hunter" }, { .path = "./prey" } },
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./agentd [-H hunters] [-P preys] socket\n");
+    exit(EXIT_FAILURE);
+}
+
+static void stop(int sig)
+{
+    (void)sig;
+    agentd.stopping = 1;
+}
+
+/* Returns 0 if the agent could not be started */
+static int spawn(struct kind_pool *kind, struct agent *agent)
+{
+    char *args[] = { (char *)kind->path, "-t", "socket", "1", "1", NULL };
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    int sv[2], err;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, PF_UNIX, sv) == -1) {
+        perror("spawn()");
+        return 0;
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], STDOUT_FILENO);
+    posix_spawnattr_init(&attr);
+    /* SIGCHLD is ignored here so that nobody has to reap */
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    err = posix_spawn(&agent->pid, kind->path, &actions, &attr, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(sv[1]);
+    if (err != 0) {
+        errno = err;
+        perror("spawn()");
+        close(sv[0]);
+        return 0;
+    }
+    agent->fd = sv[0];
+    return 1;
+}
+
+static void retire(struct agent *agent)
+{
+    close(agent->fd);
+    kill(agent->pid, SIGTERM);
+}
+
+/* Drops idle agents that have died since they came back. They were reaped
+ * by the kernel and their pid may be someone else's by now, so only their
+ * fd is closed.
+ */
+static void prune(struct kind_pool *kind)
+{
+    struct pollfd *fds;
+    int i, n = 0;
+    if (kind->n_idle == 0) {
+        return;
+    }
+    fds = malloc(kind->n_idle * sizeof *fds);
+    for (i = 0; i < kind->n_idle; i++) {
+        /* Replies left over from the last lease are fine */
+        fds[i] = (struct pollfd){ .fd = kind->idle[i].fd, .events = 0 };
+    }
+    if (poll(fds, kind->n_idle, 0) == -1) {
+        perror("prune()");
+        free(fds);
+        return;
+    }
+    for (i = 0; i < kind->n_idle; i++) {
+        if (fds[i].revents & (POLLHUP | POLLERR)) {
+            close(kind->idle[i].fd);
+        } else {
+            kind->idle[n++] = kind->idle[i];
+        }
+    }
+    kind->n_idle = n;
+    free(fds);
+}
+
+static void give_back(struct kind_pool *kind, const struct agent *agents, int n)
+{
+    if (n == 0) {
+        return;
+    }
+    if (kind->n_idle + n > kind->cap_idle) {
+        kind->cap_idle = 2 * (kind->n_idle + n);
+        kind->idle = realloc(kind->idle, kind->cap_idle * sizeof *kind->idle);
+    }
+    memcpy(kind->idle + kind->n_idle, agents, n * sizeof *agents);
+    kind->n_idle += n;
+    kind->n_leased -= n;
+}
+
+/* Idle agents beyond the largest recent lease */
+static void shrink(struct kind_pool *kind)
+{
+    int i, keep = 0;
+    for (i = 0; i < AGENTD_WINDOW; i++) {
+        if (kind->recent[i] > keep) {
+            keep = kind->recent[i];
+        }
+    }
+    while (kind->n_idle > 0 && kind->n_idle + kind->n_leased > keep) {
+        retire(&kind->idle[--kind->n_idle]);
+    }
+}
+
+/* Takes n live agents of a kind, starting more if needed */
+static int take(struct kind_pool *kind, struct agent *agents, int n)
+{
+    int i;
+    prune(kind);
+    for (i = 0; i < n; i++) {
+        if (kind->n_idle > 0) {
+            agents[i] = kind->idle[--kind->n_idle];
+        } else if (!spawn(kind, &agents[i])) {
+            kind->n_leased += i;
+            give_back(kind, agents, i);
+            return 0;
+        }
+    }
+    kind->n_leased += n;
+    return 1;
+}
+
+static int send_fds(int fd, const struct agent *agents, int n)
+{
+    int i, sent;
+    for (sent = 0; sent < n; sent += AGENTD_FDS_PER_MSG) {
+        int n_fds = n - sent < AGENTD_FDS_PER_MSG ? n - sent : AGENTD_FDS_PER_MSG;
+        char control[CMSG_SPACE(AGENTD_FDS_PER_MSG * sizeof(int))];
+        char byte = 0;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = CMSG_SPACE(n_fds * sizeof(int)),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+        for (i = 0; i < n_fds; i++) {
+            ((int *)CMSG_DATA(cmsg))[i] = agents[sent + i].fd;
+        }
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns 0 if the client is to be dropped */
+static int lease(struct client *client)
+{
+    struct agentd_request request;
+    int k, n;
+    if (read(client->fd, &request, sizeof request) != sizeof request ||
+            client->leased || request.n_hunters < 0 || request.n_preys < 0) {
+        return 0;
+    }
+    n = request.n_hunters + request.n_preys;
+    client->agents = malloc((n > 0 ? n : 1) * sizeof *client->agents);
+    client->n_agents[0] = request.n_hunters;
+    client->n_agents[1] = request.n_preys;
+    if (!take(&agentd.kinds[0], client->agents, request.n_hunters)) {
+        client->n_agents[0] = client->n_agents[1] = 0;
+        return 0;
+    }
+    if (!take(&agentd.kinds[1], client->agents + request.n_hunters, request.n_preys)) {
+        give_back(&agentd.kinds[0], client->agents, request.n_hunters);
+        client->n_agents[0] = client->n_agents[1] = 0;
+        return 0;
+    }
+    client->leased = 1;
+    for (k = 0; k < 2; k++) {
+        agentd.kinds[k].recent[agentd.n_leases % AGENTD_WINDOW] = client->n_agents[k];
+        shrink(&agentd.kinds[k]);
+    }
+    agentd.n_leases++;
+    return send_fds(client->fd, client->agents, n);
+}
+
+static void drop_client(int c)
+{
+    struct client *client = &agentd.clients[c];
+    int k;
+    give_back(&agentd.kinds[0], client->agents, client->n_agents[0]);
+    give_back(&agentd.kinds[1], client->agents + client->n_agents[0], client->n_agents[1]);
+    for (k = 0; k < 2; k++) {
+        shrink(&agentd.kinds[k]);
+    }
+    close(client->fd);
+    free(client->agents);
+    agentd.clients[c] = agentd.clients[--agentd.n_clients];
+}
+
+static void add_client(void)
+{
+    int fd = accept4(agentd.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+        perror("accept()");
+        return;
+    }
+    if (agentd.n_clients == agentd.cap_clients) {
+        agentd.cap_clients = agentd.cap_clients ? 2 * agentd.cap_clients : 8;
+        agentd.clients = realloc(agentd.clients, agentd.cap_clients * sizeof *agentd.clients);
+    }
+    agentd.clients[agentd.n_clients++] = (struct client){ .fd = fd };
+}
+
+static void listen_on(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path) {
+        usage();
+    }
+    strcpy(addr.sun_path, path);
+    agentd.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    /* A socket left behind by an earlier run */
+    unlink(path);
+    if (agentd.listen_fd == -1 ||
+            bind(agentd.listen_fd, (struct sockaddr *)&addr, sizeof addr) == -1 ||
+            listen(agentd.listen_fd, 64) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    agentd.path = path;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, c, k, warm[2] = { 0, 0 };
+    struct pollfd *fds = NULL;
+    struct sigaction sa = { .sa_handler = stop };
+    while ((opt = getopt(argc, argv, "H:P:")) != -1) {
+        switch (opt) {
+            case 'H':
+                if (sscanf(optarg, "%d", &warm[0]) != 1 || warm[0] < 0) {
+                    usage();
+                }
+                break;
+            case 'P':
+                if (sscanf(optarg, "%d", &warm[1]) != 1 || warm[1] < 0) {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind != 1) {
+        usage();
+    }
+    signal(SIGCHLD, SIG_IGN);
+    /* No SA_RESTART, poll() returns to check stopping */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    listen_on(argv[optind]);
+    for (k = 0; k < 2; k++) {
+        struct agent *agents = malloc((warm[k] > 0 ? warm[k] : 1) * sizeof *agents);
+        if (!take(&agentd.kinds[k], agents, warm[k])) {
+            exit(EXIT_FAILURE);
+        }
+        give_back(&agentd.kinds[k], agents, warm[k]);
+        agentd.kinds[k].recent[0] = warm[k];
+        free(agents);
+    }
+
+    while (!agentd.stopping) {
+        fds = realloc(fds, (agentd.n_clients + 1) * sizeof *fds);
+        fds[0] = (struct pollfd){ .fd = agentd.listen_fd, .events = POLLIN };
+        for (c = 0; c < agentd.n_clients; c++) {
+            fds[c + 1] = (struct pollfd){ .fd = agentd.clients[c].fd, .events = POLLIN };
+        }
+        if (poll(fds, agentd.n_clients + 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll()");
+            break;
+        }
+        /* Backwards, dropping a client moves the last one into its slot */
+        for (c = agentd.n_clients - 1; c >= 0; c--) {
+            if (fds[c + 1].revents && !lease(&agentd.clients[c])) {
+                drop_client(c);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            add_client();
+        }
+    }
+
+    while (agentd.n_clients > 0) {
+        drop_client(agentd.n_clients - 1);
+    }
+    for (k = 0; k < 2; k++) {
+        while (agentd.kinds[k].n_idle > 0) {
+            retire(&agentd.kinds[k].idle[--agentd.kinds[k].n_idle]);
+        }
+        free(agentd.kinds[k].idle);
+    }
+    close(agentd.listen_fd);
+    unlink(agentd.path);
+    free(fds);
+    free(agentd.clients);
+    return 0;
+}
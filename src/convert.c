@@ -0,0 +1,34 @@
+#include "scenario.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Converts a scenario from the server's text format on stdin to the binary
+ * format on stdout.
+ */
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./convert < text > binary\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct scenario scenario;
+    (void)argv;
+    if (argc != 1) {
+        usage();
+    }
+    if (scenario_parse(stdin, &scenario) == -1) {
+        fprintf(stderr, "Input error\n");
+        return EXIT_FAILURE;
+    }
+    if (fwrite(scenario.base, 1, scenario.size, stdout) != scenario.size ||
+            fflush(stdout) != 0) {
+        perror("convert");
+        return EXIT_FAILURE;
+    }
+    scenario_close(&scenario);
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include "field.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* States of field.mark while a source is being removed */
+enum {
+    MARK_NONE,
+    MARK_QUEUED,
+    MARK_AFFECTED,
+    MARK_KEPT,
+};
+
+void field_init(struct field *field, int width, int height, const unsigned char *blocked)
+{
+    size_t n_cells = (size_t)width * height;
+    field->width = width;
+    field->height = height;
+    field->blocked = blocked;
+    field->dist = malloc(n_cells * sizeof *field->dist);
+    field->sources = calloc(n_cells, sizeof *field->sources);
+    field->mark = calloc(n_cells, sizeof *field->mark);
+    field->queue = malloc(n_cells * sizeof *field->queue);
+    /* Pairs of distance and cell */
+    field->seeds = malloc(2 * n_cells * sizeof *field->seeds);
+    field_build(field);
+}
+
+void field_free(struct field *field)
+{
+    free(field->dist);
+    free(field->sources);
+    free(field->mark);
+    free(field->queue);
+    free(field->seeds);
+}
+
+/* Open cells next to cell, up, right, down and left. */
+static int neighbours(const struct field *field, int cell, int *out)
+{
+    int x = cell / field->width, y = cell % field->width;
+    int candidates[4], i, n = 0, n_out = 0;
+    if (x > 0) {
+        candidates[n++] = cell - field->width;
+    }
+    if (y + 1 < field->width) {
+        candidates[n++] = cell + 1;
+    }
+    if (x + 1 < field->height) {
+        candidates[n++] = cell + field->width;
+    }
+    if (y > 0) {
+        candidates[n++] = cell - 1;
+    }
+    for (i = 0; i < n; i++) {
+        if (!field->blocked[candidates[i]]) {
+            out[n_out++] = candidates[i];
+        }
+    }
+    return n_out;
+}
+
+/* Plain BFS over field.queue[head..tail), lowering distances only. */
+static void propagate(struct field *field, int head, int tail)
+{
+    while (head < tail) {
+        int u = field->queue[head++];
+        int next[4], i, n = neighbours(field, u, next);
+        for (i = 0; i < n; i++) {
+            if (field->dist[next[i]] > field->dist[u] + 1) {
+                field->dist[next[i]] = field->dist[u] + 1;
+                field->queue[tail++] = next[i];
+            }
+        }
+    }
+}
+
+void field_build(struct field *field)
+{
+    int cell, tail = 0, n_cells = field->width * field->height;
+    for (cell = 0; cell < n_cells; cell++) {
+        if (field->sources[cell] && !field->blocked[cell]) {
+            field->dist[cell] = 0;
+            field->queue[tail++] = cell;
+        } else {
+            field->dist[cell] = FIELD_INF;
+        }
+    }
+    propagate(field, 0, tail);
+}
+
+void field_add(struct field *field, int cell)
+{
+    if (field->sources[cell]++ || field->blocked[cell]) {
+        return;
+    }
+    field->dist[cell] = 0;
+    field->queue[0] = cell;
+    propagate(field, 0, 1);
+}
+
+static int compare_seed(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Walks the BFS levels away from the removed source and collects the cells
+ * left without a neighbour one step closer, the only ones whose distance
+ * can grow. Levels are visited in order, so every candidate one step closer
+ * has been decided by the time a cell is looked at. Returns how many cells
+ * were visited, the affected ones are marked in field.queue[0..returned).
+ */
+static int collect_affected(struct field *field, int cell)
+{
+    int head = 0, tail = 0;
+    field->mark[cell] = MARK_AFFECTED;
+    field->queue[tail++] = cell;
+    while (head < tail) {
+        int u = field->queue[head++];
+        int next[4], i, n = neighbours(field, u, next);
+        if (u != cell) {
+            int supported = 0;
+            for (i = 0; i < n && !supported; i++) {
+                supported = field->dist[next[i]] == field->dist[u] - 1 &&
+                    field->mark[next[i]] != MARK_AFFECTED;
+            }
+            if (supported) {
+                field->mark[u] = MARK_KEPT;
+                continue;
+            }
+            field->mark[u] = MARK_AFFECTED;
+        }
+        for (i = 0; i < n; i++) {
+            if (field->mark[next[i]] == MARK_NONE &&
+                    field->dist[next[i]] == field->dist[u] + 1) {
+                field->mark[next[i]] = MARK_QUEUED;
+                field->queue[tail++] = next[i];
+            }
+        }
+    }
+    return tail;
+}
+
+void field_remove(struct field *field, int cell)
+{
+    if (--field->sources[cell] || field->blocked[cell]) {
+        return;
+    }
+    int i, j, n_visited = collect_affected(field, cell), n_seeds = 0;
+    for (i = 0; i < n_visited; i++) {
+        if (field->mark[field->queue[i]] == MARK_AFFECTED) {
+            field->dist[field->queue[i]] = FIELD_INF;
+        }
+    }
+    /* Affected cells next to the rest of the field restart from there */
+    for (i = 0; i < n_visited; i++) {
+        int u = field->queue[i];
+        int next[4], n, best = FIELD_INF;
+        if (field->mark[u] != MARK_AFFECTED) {
+            continue;
+        }
+        n = neighbours(field, u, next);
+        for (j = 0; j < n; j++) {
+            if (field->mark[next[j]] != MARK_AFFECTED && field->dist[next[j]] < best) {
+                best = field->dist[next[j]];
+            }
+        }
+        if (best != FIELD_INF) {
+            field->seeds[2*n_seeds] = best + 1;
+            field->seeds[2*n_seeds + 1] = u;
+            n_seeds++;
+        }
+    }
+    for (i = 0; i < n_visited; i++) {
+        field->mark[field->queue[i]] = MARK_NONE;
+    }
+    qsort(field->seeds, n_seeds, 2 * sizeof *field->seeds, compare_seed);
+
+    /* Seeds come in sorted and the FIFO only ever grows by one, merging the
+     * two hands out cells in distance order like Dijkstra would.
+     */
+    int head = 0, tail = 0, seed = 0;
+    while (seed < n_seeds || head < tail) {
+        int u, d;
+        if (seed < n_seeds && (head == tail ||
+                    field->seeds[2*seed] <= field->dist[field->queue[head]])) {
+            d = field->seeds[2*seed];
+            u = field->seeds[2*seed + 1];
+            seed++;
+            if (d > field->dist[u]) {
+                /* Reached sooner through the FIFO */
+                continue;
+            }
+            field->dist[u] = d;
+        } else {
+            u = field->queue[head++];
+            d = field->dist[u];
+        }
+        int next[4], n = neighbours(field, u, next);
+        for (i = 0; i < n; i++) {
+            if (field->dist[next[i]] > d + 1) {
+                field->dist[next[i]] = d + 1;
+                field->queue[tail++] = next[i];
+            }
+        }
+    }
+}
+
+int field_check(struct field *field)
+{
+    size_t size = (size_t)field->width * field->height * sizeof *field->dist;
+    int *saved = malloc(size);
+    memcpy(saved, field->dist, size);
+    field_build(field);
+    int same = memcmp(saved, field->dist, size) == 0;
+    free(saved);
+    return same;
+}
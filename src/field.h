@@ -0,0 +1,40 @@
+#ifndef FIELD_H
+#define FIELD_H
+
+#include <limits.h>
+
+/* Multi-source BFS distance field over a grid with fixed obstacles. Sources
+ * come and go one at a time and only the cells whose distance changes are
+ * touched. Cells are numbered x*width + y like the server's grid.
+ */
+
+#define FIELD_INF INT_MAX
+
+struct field {
+    int width;
+    int height;
+    /* Shared, never changes after field_init() */
+    const unsigned char *blocked;
+    /* Distance to the closest source, FIELD_INF if none is reachable */
+    int *dist;
+    /* Number of sources on each cell */
+    unsigned char *sources;
+    /* Scratch space for the updates, one slot per cell */
+    unsigned char *mark;
+    int *queue;
+    int *seeds;
+};
+
+void field_init(struct field *field, int width, int height, const unsigned char *blocked);
+void field_free(struct field *field);
+
+/* Recomputes everything from the sources currently set */
+void field_build(struct field *field);
+
+void field_add(struct field *field, int cell);
+void field_remove(struct field *field, int cell);
+
+/* Returns whether the distances match a full rebuild, for debugging */
+int field_check(struct field *field);
+
+#endif
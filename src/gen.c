@@ -0,0 +1,305 @@
+#include "rng.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Scenario generator, writes a map in the server's input format to stdout.
+ */
+
+enum pattern {
+    PATTERN_RANDOM,
+    PATTERN_CLUSTER,
+    PATTERN_WALLS,
+};
+
+enum energy_kind {
+    ENERGY_UNIFORM,
+    ENERGY_EXP,
+};
+
+struct energy {
+    enum energy_kind kind;
+    int lo;
+    int hi;
+    double mean;
+};
+
+static struct {
+    int width;
+    int height;
+    double density;
+    enum pattern pattern;
+    long n_hunters;
+    long n_preys;
+    struct energy hunter_energy;
+    struct energy prey_energy;
+    struct rng rng;
+    /* One bit per cell, set for obstacles and agents */
+    uint64_t *taken;
+    uint64_t *obstacle;
+    long n_obstacles;
+} gen = {
+    .width = 0,
+    .height = 0,
+    .density = 0.1,
+    .pattern = PATTERN_RANDOM,
+    .n_hunters = 1,
+    .n_preys = 1,
+    .hunter_energy = { .kind = ENERGY_UNIFORM, .lo = 10, .hi = 40 },
+    .prey_energy = { .kind = ENERGY_UNIFORM, .lo = 1, .hi = 10 },
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./gen [-s seed] [-o density] [-p random|cluster|walls]\n"
+            "             [-H hunters] [-P preys] [-e energy] [-E energy] width height\n"
+            "energy is either lo-hi (uniform) or exp:mean, -e is for hunters and -E\n"
+            "for preys\n");
+    exit(EXIT_FAILURE);
+}
+
+static long cell(int x, int y)
+{
+    return (long)x*gen.width + y;
+}
+
+static int bit_get(const uint64_t *bits, long i)
+{
+    return bits[i >> 6] >> (i & 63) & 1;
+}
+
+static void bit_set(uint64_t *bits, long i)
+{
+    bits[i >> 6] |= 1ULL << (i & 63);
+}
+
+static void put_obstacle(int x, int y)
+{
+    long i = cell(x, y);
+    if (!bit_get(gen.obstacle, i)) {
+        bit_set(gen.obstacle, i);
+        bit_set(gen.taken, i);
+        gen.n_obstacles++;
+    }
+}
+
+static int parse_energy(const char *arg, struct energy *energy)
+{
+    if (sscanf(arg, "exp:%lf", &energy->mean) == 1 && energy->mean > 0) {
+        energy->kind = ENERGY_EXP;
+        return 1;
+    }
+    if (sscanf(arg, "%d-%d", &energy->lo, &energy->hi) == 2 &&
+            energy->lo >= 0 && energy->lo <= energy->hi) {
+        energy->kind = ENERGY_UNIFORM;
+        return 1;
+    }
+    return 0;
+}
+
+static int draw_energy(const struct energy *energy)
+{
+    switch (energy->kind) {
+        case ENERGY_UNIFORM:
+            return energy->lo + rng_below(&gen.rng, energy->hi - energy->lo + 1);
+        case ENERGY_EXP:
+            /* At least one, a hunter with no energy dies right away */
+            return 1 + (int)(-energy->mean * log(1.0 - rng_double(&gen.rng)));
+    }
+    return 0;
+}
+
+static void obstacles_random(long target)
+{
+    /* Rejection sampling gets slow on dense maps, sweep the cells instead */
+    if (target > (long)gen.width * gen.height / 4) {
+        int x, y;
+        for (x = 0; x < gen.height; x++) {
+            for (y = 0; y < gen.width; y++) {
+                if (rng_double(&gen.rng) < gen.density) {
+                    put_obstacle(x, y);
+                }
+            }
+        }
+        return;
+    }
+    while (gen.n_obstacles < target) {
+        put_obstacle(rng_below(&gen.rng, gen.height), rng_below(&gen.rng, gen.width));
+    }
+}
+
+/* Random walks from random seeds, each walk grows one blob.
+ */
+static void obstacles_cluster(long target)
+{
+    long blob = 1 + (long)sqrt((double)target);
+    while (gen.n_obstacles < target) {
+        int x = rng_below(&gen.rng, gen.height), y = rng_below(&gen.rng, gen.width);
+        long i;
+        for (i = 0; i < blob && gen.n_obstacles < target; i++) {
+            put_obstacle(x, y);
+            switch (rng_below(&gen.rng, 4)) {
+                case 0:
+                    x = x > 0 ? x - 1 : x;
+                    break;
+                case 1:
+                    y = y + 1 < gen.width ? y + 1 : y;
+                    break;
+                case 2:
+                    x = x + 1 < gen.height ? x + 1 : x;
+                    break;
+                case 3:
+                    y = y > 0 ? y - 1 : y;
+                    break;
+            }
+        }
+    }
+}
+
+/* Horizontal and vertical segments with a gap every few cells so that the
+ * map does not fall apart into sealed rooms.
+ */
+static void obstacles_walls(long target)
+{
+    while (gen.n_obstacles < target) {
+        int x = rng_below(&gen.rng, gen.height), y = rng_below(&gen.rng, gen.width);
+        int vertical = rng_below(&gen.rng, 2);
+        int length = 4 + rng_below(&gen.rng, 1 + (vertical ? gen.height : gen.width) / 4);
+        int i;
+        for (i = 0; i < length && gen.n_obstacles < target; i++) {
+            if (x >= gen.height || y >= gen.width) {
+                break;
+            }
+            if (i % 8 != 7) {
+                put_obstacle(x, y);
+            }
+            if (vertical) {
+                x++;
+            } else {
+                y++;
+            }
+        }
+    }
+}
+
+static void print_agents(long n, const struct energy *energy)
+{
+    long i;
+    printf("%ld\n", n);
+    for (i = 0; i < n; i++) {
+        int x, y;
+        do {
+            x = rng_below(&gen.rng, gen.height);
+            y = rng_below(&gen.rng, gen.width);
+        } while (bit_get(gen.taken, cell(x, y)));
+        bit_set(gen.taken, cell(x, y));
+        printf("%d %d %d\n", x, y, draw_energy(energy));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long seed = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:o:p:H:P:e:E:")) != -1) {
+        switch (opt) {
+            case 's':
+                if (sscanf(optarg, "%llu", &seed) != 1) {
+                    usage();
+                }
+                break;
+            case 'o':
+                if (sscanf(optarg, "%lf", &gen.density) != 1 ||
+                        gen.density < 0 || gen.density >= 1) {
+                    usage();
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "random") == 0) {
+                    gen.pattern = PATTERN_RANDOM;
+                } else if (strcmp(optarg, "cluster") == 0) {
+                    gen.pattern = PATTERN_CLUSTER;
+                } else if (strcmp(optarg, "walls") == 0) {
+                    gen.pattern = PATTERN_WALLS;
+                } else {
+                    usage();
+                }
+                break;
+            case 'H':
+                if (sscanf(optarg, "%ld", &gen.n_hunters) != 1 || gen.n_hunters < 0) {
+                    usage();
+                }
+                break;
+            case 'P':
+                if (sscanf(optarg, "%ld", &gen.n_preys) != 1 || gen.n_preys < 0) {
+                    usage();
+                }
+                break;
+            case 'e':
+                if (!parse_energy(optarg, &gen.hunter_energy)) {
+                    usage();
+                }
+                break;
+            case 'E':
+                if (!parse_energy(optarg, &gen.prey_energy)) {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind != 2 ||
+            sscanf(argv[optind], "%d", &gen.width) != 1 ||
+            sscanf(argv[optind + 1], "%d", &gen.height) != 1 ||
+            gen.width < 1 || gen.height < 1) {
+        usage();
+    }
+
+    long n_cells = (long)gen.width * gen.height;
+    long target = (long)(gen.density * n_cells);
+    if (target + gen.n_hunters + gen.n_preys > n_cells) {
+        fprintf(stderr, "Not enough cells for %ld obstacles and %ld agents\n",
+                target, gen.n_hunters + gen.n_preys);
+        return EXIT_FAILURE;
+    }
+    rng_seed(&gen.rng, seed);
+    gen.taken = calloc((n_cells + 63) / 64, sizeof *gen.taken);
+    gen.obstacle = calloc((n_cells + 63) / 64, sizeof *gen.obstacle);
+
+    switch (gen.pattern) {
+        case PATTERN_RANDOM:
+            obstacles_random(target);
+            break;
+        case PATTERN_CLUSTER:
+            obstacles_cluster(target);
+            break;
+        case PATTERN_WALLS:
+            obstacles_walls(target);
+            break;
+    }
+    if (gen.n_obstacles + gen.n_hunters + gen.n_preys > n_cells) {
+        fprintf(stderr, "Not enough free cells left for %ld agents\n",
+                gen.n_hunters + gen.n_preys);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d %d\n", gen.width, gen.height);
+    printf("%ld\n", gen.n_obstacles);
+    long i;
+    for (i = 0; i < n_cells; i++) {
+        if (bit_get(gen.obstacle, i)) {
+            printf("%ld %ld\n", i / gen.width, i % gen.width);
+        }
+    }
+    print_agents(gen.n_hunters, &gen.hunter_energy);
+    print_agents(gen.n_preys, &gen.prey_energy);
+
+    free(gen.taken);
+    free(gen.obstacle);
+    return 0;
+}
@@ -1,3 +1,6 @@
+#ifndef GLOBALS_H
+#define GLOBALS_H
+
 typedef struct coordinate {
     int x;
     int y;
@@ -8,8 +11,51 @@ typedef struct server_message {
     coordinate adv_pos;
     int object_count;
     coordinate object_pos[4];
+    /* Suggested move from the server's distance field, -1 if none */
+    coordinate best_step;
 } server_message;
 
 typedef struct ph_message {
     coordinate move_request;
 } ph_message;
+
+/* object_count of a state that re-targets an agent taken from ./agentd for
+ * a new run: pos is the new width and height, adv_pos.x the seed and
+ * adv_pos.y whether to pause after each move. The agent answers with a
+ * move to (-1, -1), anything it sends before that is left over from the
+ * previous run.
+ */
+#define AGENT_RESET -1
+
+/* Sent to ./agentd to lease agents. The socket of every agent comes back
+ * through SCM_RIGHTS, hunters first, in messages of one byte carrying at
+ * most AGENTD_FDS_PER_MSG fds. The agents go back to the pool when the
+ * connection is closed.
+ */
+#define AGENTD_FDS_PER_MSG 250
+
+typedef struct agentd_request {
+    int n_hunters;
+    int n_preys;
+} agentd_request;
+
+/* Agent host protocol, one ./hunter -H or ./prey -H process drives many
+ * agents over one socket. The same messages go both ways, tagged with the
+ * agent they are for, and as many as are ready are read and written at
+ * once. Every agent of a host has at most one state and one move in
+ * flight, at HOST_MAX_AGENTS both fit in the socket buffers and neither
+ * side waits on a write while the other is writing too.
+ */
+#define HOST_MAX_AGENTS 1024
+
+typedef struct host_state {
+    int idx;
+    server_message state;
+} host_state;
+
+typedef struct host_move {
+    int idx;
+    ph_message move;
+} host_move;
+
+#endif
@@ -0,0 +1,49 @@
+#include "movelog.h"
+
+#include <stdlib.h>
+
+void movelog_reserve(struct movelog_buf *buf, size_t extra)
+{
+    if (buf->len + extra > buf->cap) {
+        while (buf->len + extra > buf->cap) {
+            buf->cap = buf->cap ? 2 * buf->cap : 4096;
+        }
+        buf->data = realloc(buf->data, buf->cap);
+    }
+}
+
+static uint64_t agent_delta(struct movelog_buf *buf, int idx)
+{
+    uint64_t delta = movelog_zigzag((int64_t)idx - buf->last_idx);
+    buf->last_idx = idx;
+    return delta;
+}
+
+void movelog_move(struct movelog_buf *buf, int idx, int dx, int dy)
+{
+    movelog_reserve(buf, 30);
+    buf->moves++;
+    if (dx >= -1 && dx <= 1 && dy >= -1 && dy <= 1) {
+        movelog_put(buf, (agent_delta(buf, idx) * 9 + (dx + 1) * 3 + (dy + 1)) << 2 |
+                MOVELOG_STEP);
+    } else {
+        movelog_put(buf, agent_delta(buf, idx) << 2 | MOVELOG_JUMP);
+        movelog_put(buf, movelog_zigzag(dx));
+        movelog_put(buf, movelog_zigzag(dy));
+    }
+}
+
+void movelog_death(struct movelog_buf *buf, int idx, int kind)
+{
+    movelog_reserve(buf, 10);
+    movelog_put(buf, (agent_delta(buf, idx) * 2 + kind) << 2 | MOVELOG_DEATH);
+}
+
+void movelog_mark(struct movelog_buf *buf, enum movelog_mark mark)
+{
+    movelog_reserve(buf, 10);
+    movelog_put(buf, (uint64_t)mark << 2 | MOVELOG_MARK);
+    if (mark == MOVELOG_KEYFRAME || mark == MOVELOG_SYNC) {
+        buf->last_idx = 0;
+    }
+}
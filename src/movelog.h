@@ -0,0 +1,130 @@
+#ifndef MOVELOG_H
+#define MOVELOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Append-only log of what a run did to the map, replayed by ./replay on
+ * top of the scenario it started from:
+ *
+ *   struct movelog_header
+ *   records, each a varint whose low 2 bits are an enum movelog_type
+ *   padding to 8 bytes after the END mark
+ *   n_keyframes struct movelog_keyframe, from index_offset
+ *   struct movelog_trailer
+ *
+ * A record names its agent by the zigzag difference to the agent of the
+ * record before it, so moves resolved in index order take a byte each.
+ *
+ *   STEP    ((zigzag(d idx) * 9 + (dx + 1) * 3 + (dy + 1)) << 2), a move to
+ *           a neighbouring cell or staying put
+ *   JUMP    (zigzag(d idx) << 2), then zigzag(dx) and zigzag(dy), any other
+ *           move
+ *
+ * Every move the server counted is recorded as requested, also the ones
+ * it turned down because the cell is an obstacle or holds an agent of the
+ * same kind. Replaying them against the same map turns them down again.
+ *   DEATH   ((zigzag(d idx) * 2 + kind) << 2), kind 0 for a capture and 1
+ *           for an exhaustion
+ *   MARK    (enum movelog_mark << 2)
+ *
+ * A KEYFRAME mark is followed by the moves and ticks so far and then every
+ * agent: 0 if it is dead, otherwise x * 2 + shown + 1, where shown tells
+ * whether the grid shows it or another agent on its cell, then y and
+ * energy. Keyframes and SYNC marks restart the agent differences from 0.
+ * The trailer is only there if the run ended cleanly, without it the
+ * records run until the END mark or the end of the file.
+ */
+
+#define MOVELOG_MAGIC "HPMOVES"
+#define MOVELOG_TRAILER_MAGIC "HPMVEND"
+#define MOVELOG_VERSION 1
+
+enum movelog_type {
+    MOVELOG_STEP,
+    MOVELOG_JUMP,
+    MOVELOG_DEATH,
+    MOVELOG_MARK,
+};
+
+enum movelog_mark {
+    MOVELOG_TICK,
+    MOVELOG_KEYFRAME,
+    MOVELOG_SYNC,
+    MOVELOG_END,
+};
+
+struct movelog_header {
+    char magic[8];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t n_hunters;
+    int32_t n_preys;
+    uint32_t unused;
+};
+
+struct movelog_keyframe {
+    uint64_t offset;
+    uint64_t moves;
+};
+
+struct movelog_trailer {
+    uint64_t index_offset;
+    uint64_t n_keyframes;
+    char magic[8];
+};
+
+struct movelog_buf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    int last_idx;
+    /* Moves recorded, for the caller to reset */
+    long moves;
+};
+
+/* Room for extra more bytes */
+void movelog_reserve(struct movelog_buf *buf, size_t extra);
+
+/* At most 10 bytes, which must have been reserved */
+static inline void movelog_put(struct movelog_buf *buf, uint64_t v)
+{
+    while (v >= 0x80) {
+        buf->data[buf->len++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    buf->data[buf->len++] = (unsigned char)v;
+}
+
+/* Returns 0 if the varint runs past end */
+static inline int movelog_get(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    int shift = 0;
+    *v = 0;
+    while (*p < end && shift < 64) {
+        unsigned char byte = *(*p)++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+static inline uint64_t movelog_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t movelog_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+void movelog_move(struct movelog_buf *buf, int idx, int dx, int dy);
+void movelog_death(struct movelog_buf *buf, int idx, int kind);
+void movelog_mark(struct movelog_buf *buf, enum movelog_mark mark);
+
+#endif
@@ -0,0 +1,165 @@
+#include "nearest.h"
+
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+/* Points are handed to the batch queries in chunks small enough to stay in
+ * L2 while every query walks them.
+ */
+#define BATCH_CHUNK 16384
+
+int nearest_scalar(const int *xs, const int *ys, int n, int x, int y)
+{
+    int i, min_dist = -1, min_idx = -1;
+    for (i = 0; i < n; i++) {
+        int dist = abs(xs[i] - x) + abs(ys[i] - y);
+        if (min_dist == -1 || dist < min_dist) {
+            min_dist = dist;
+            min_idx = i;
+        }
+    }
+    return min_idx;
+}
+
+/* Lane-wise results to a single index, smallest distance and then smallest
+ * index. Every lane was strict about ties, so its index is its first minimum.
+ */
+static int reduce_lanes(const int *dist, const int *idx, int lanes, int *min_dist)
+{
+    int i, best = 0;
+    for (i = 1; i < lanes; i++) {
+        if (dist[i] < dist[best] || (dist[i] == dist[best] && idx[i] < idx[best])) {
+            best = i;
+        }
+    }
+    *min_dist = dist[best];
+    return idx[best];
+}
+
+/* Points past the last full vector */
+static int scan_tail(const int *xs, const int *ys, int from, int n, int x, int y,
+        int min_idx, int min_dist)
+{
+    int i;
+    for (i = from; i < n; i++) {
+        int dist = abs(xs[i] - x) + abs(ys[i] - y);
+        if (min_idx == -1 || dist < min_dist) {
+            min_dist = dist;
+            min_idx = i;
+        }
+    }
+    return min_idx;
+}
+
+__attribute__((target("sse4.1")))
+int nearest_sse4(const int *xs, const int *ys, int n, int x, int y)
+{
+    int i = 0, min_idx = -1, min_dist = 0;
+    if (n >= 4) {
+        __m128i vx = _mm_set1_epi32(x), vy = _mm_set1_epi32(y);
+        __m128i best = _mm_set1_epi32(0x7fffffff), best_idx = _mm_setzero_si128();
+        __m128i idx = _mm_setr_epi32(0, 1, 2, 3), step = _mm_set1_epi32(4);
+        for (; i + 4 <= n; i += 4) {
+            __m128i dx = _mm_abs_epi32(_mm_sub_epi32(_mm_loadu_si128((const __m128i *)(xs + i)), vx));
+            __m128i dy = _mm_abs_epi32(_mm_sub_epi32(_mm_loadu_si128((const __m128i *)(ys + i)), vy));
+            __m128i dist = _mm_add_epi32(dx, dy);
+            __m128i closer = _mm_cmplt_epi32(dist, best);
+            best = _mm_min_epi32(best, dist);
+            best_idx = _mm_blendv_epi8(best_idx, idx, closer);
+            idx = _mm_add_epi32(idx, step);
+        }
+        int lane_dist[4], lane_idx[4];
+        _mm_storeu_si128((__m128i *)lane_dist, best);
+        _mm_storeu_si128((__m128i *)lane_idx, best_idx);
+        min_idx = reduce_lanes(lane_dist, lane_idx, 4, &min_dist);
+    }
+    return scan_tail(xs, ys, i, n, x, y, min_idx, min_dist);
+}
+
+__attribute__((target("avx2")))
+int nearest_avx2(const int *xs, const int *ys, int n, int x, int y)
+{
+    int i = 0, min_idx = -1, min_dist = 0;
+    if (n >= 8) {
+        __m256i vx = _mm256_set1_epi32(x), vy = _mm256_set1_epi32(y);
+        __m256i best = _mm256_set1_epi32(0x7fffffff), best_idx = _mm256_setzero_si256();
+        __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), step = _mm256_set1_epi32(8);
+        for (; i + 8 <= n; i += 8) {
+            __m256i dx = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(xs + i)), vx));
+            __m256i dy = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(ys + i)), vy));
+            __m256i dist = _mm256_add_epi32(dx, dy);
+            __m256i closer = _mm256_cmpgt_epi32(best, dist);
+            best = _mm256_min_epi32(best, dist);
+            best_idx = _mm256_blendv_epi8(best_idx, idx, closer);
+            idx = _mm256_add_epi32(idx, step);
+        }
+        int lane_dist[8], lane_idx[8];
+        _mm256_storeu_si256((__m256i *)lane_dist, best);
+        _mm256_storeu_si256((__m256i *)lane_idx, best_idx);
+        min_idx = reduce_lanes(lane_dist, lane_idx, 8, &min_dist);
+    }
+    return scan_tail(xs, ys, i, n, x, y, min_idx, min_dist);
+}
+
+int nearest_supported(struct nearest_impl *impls)
+{
+    int n = 0;
+    impls[n++] = (struct nearest_impl){ "scalar", nearest_scalar };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        impls[n++] = (struct nearest_impl){ "sse4", nearest_sse4 };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        impls[n++] = (struct nearest_impl){ "avx2", nearest_avx2 };
+    }
+    return n;
+}
+
+static nearest_fn best;
+static pthread_once_t best_once = PTHREAD_ONCE_INIT;
+
+static void nearest_pick(void)
+{
+    struct nearest_impl impls[3];
+    best = impls[nearest_supported(impls) - 1].fn;
+}
+
+/* Batch workers may get here at the same time */
+static nearest_fn nearest_best(void)
+{
+    pthread_once(&best_once, nearest_pick);
+    return best;
+}
+
+int nearest(const int *xs, const int *ys, int n, int x, int y)
+{
+    return nearest_best()(xs, ys, n, x, y);
+}
+
+void nearest_batch(const int *xs, const int *ys, int n,
+        const int *qx, const int *qy, int n_queries, int *out)
+{
+    nearest_fn fn = nearest_best();
+    int i, from;
+    if (n <= BATCH_CHUNK) {
+        for (i = 0; i < n_queries; i++) {
+            out[i] = fn(xs, ys, n, qx[i], qy[i]);
+        }
+        return;
+    }
+    for (i = 0; i < n_queries; i++) {
+        out[i] = -1;
+    }
+    for (from = 0; from < n; from += BATCH_CHUNK) {
+        int len = n - from < BATCH_CHUNK ? n - from : BATCH_CHUNK;
+        for (i = 0; i < n_queries; i++) {
+            int j = from + fn(xs + from, ys + from, len, qx[i], qy[i]);
+            /* Earlier chunks win ties */
+            if (out[i] == -1 || abs(xs[j] - qx[i]) + abs(ys[j] - qy[i]) <
+                    abs(xs[out[i]] - qx[i]) + abs(ys[out[i]] - qy[i])) {
+                out[i] = j;
+            }
+        }
+    }
+}
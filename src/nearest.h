@@ -0,0 +1,42 @@
+#ifndef NEAREST_H
+#define NEAREST_H
+
+/* Nearest point in Manhattan distance over packed coordinate arrays, with
+ * SSE4.1 and AVX2 kernels picked at runtime. Ties go to the lowest index,
+ * same as a plain scan.
+ */
+
+/* Far enough from any map cell that a point parked here never wins, close
+ * enough that distances do not overflow.
+ */
+#define NEAREST_FAR (1 << 29)
+
+typedef int (*nearest_fn)(const int *xs, const int *ys, int n, int x, int y);
+
+struct nearest_impl {
+    const char *name;
+    nearest_fn fn;
+};
+
+/* Returns the index of the point in xs[0..n), ys[0..n) closest to (x, y), -1
+ * if n is 0.
+ */
+int nearest_scalar(const int *xs, const int *ys, int n, int x, int y);
+int nearest_sse4(const int *xs, const int *ys, int n, int x, int y);
+int nearest_avx2(const int *xs, const int *ys, int n, int x, int y);
+
+/* Kernels this CPU can run, scalar first and the preferred one last.
+ * Returns how many were written to impls, at most 3.
+ */
+int nearest_supported(struct nearest_impl *impls);
+
+/* Best kernel for this CPU, chosen on first use */
+int nearest(const int *xs, const int *ys, int n, int x, int y);
+
+/* Answers n_queries queries against the same points, out[i] is the nearest
+ * point to (qx[i], qy[i]).
+ */
+void nearest_batch(const int *xs, const int *ys, int n,
+        const int *qx, const int *qy, int n_queries, int *out);
+
+#endif
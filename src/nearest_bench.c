@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+
+#include "nearest.h"
+#include "rng.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Microbenchmark for the nearest-point kernels. Every kernel and the batch
+ * entry point are checked against the scalar scan before being timed.
+ */
+
+static struct {
+    int n_points;
+    int n_queries;
+    int size;
+    struct rng rng;
+    int *xs;
+    int *ys;
+    int *qx;
+    int *qy;
+    int *expect;
+    int *out;
+} bench = {
+    .n_points = 40000,
+    .n_queries = 10000,
+    .size = 1000,
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./nearest_bench [-s seed] [-n points] [-q queries] [-S map size]\n");
+    exit(EXIT_FAILURE);
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void fill_points(int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        if (rng_below(&bench.rng, 16) == 0) {
+            /* Dead agents are parked far away */
+            bench.xs[i] = NEAREST_FAR;
+            bench.ys[i] = NEAREST_FAR;
+        } else {
+            bench.xs[i] = rng_below(&bench.rng, bench.size);
+            bench.ys[i] = rng_below(&bench.rng, bench.size);
+        }
+    }
+    for (i = 0; i < bench.n_queries; i++) {
+        bench.qx[i] = rng_below(&bench.rng, bench.size);
+        bench.qy[i] = rng_below(&bench.rng, bench.size);
+    }
+}
+
+static int verify_size(const struct nearest_impl *impls, int n_impls, int n)
+{
+    int i, k;
+    fill_points(n);
+    for (i = 0; i < bench.n_queries; i++) {
+        bench.expect[i] = nearest_scalar(bench.xs, bench.ys, n, bench.qx[i], bench.qy[i]);
+    }
+    for (k = 0; k < n_impls; k++) {
+        for (i = 0; i < bench.n_queries; i++) {
+            int got = impls[k].fn(bench.xs, bench.ys, n, bench.qx[i], bench.qy[i]);
+            if (got != bench.expect[i]) {
+                fprintf(stderr, "%s: %d points, query %d: got %d, expected %d\n",
+                        impls[k].name, n, i, got, bench.expect[i]);
+                return 0;
+            }
+        }
+    }
+    nearest_batch(bench.xs, bench.ys, n, bench.qx, bench.qy, bench.n_queries, bench.out);
+    for (i = 0; i < bench.n_queries; i++) {
+        if (bench.out[i] != bench.expect[i]) {
+            fprintf(stderr, "batch: %d points, query %d: got %d, expected %d\n",
+                    n, i, bench.out[i], bench.expect[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Small sizes hit every tail length. The full size only hits the batch
+ * chunks above 16384 points, the default spans two whole chunks and a part.
+ */
+static int verify(const struct nearest_impl *impls, int n_impls)
+{
+    int n;
+    for (n = 0; n < 70 && n < bench.n_points; n++) {
+        if (!verify_size(impls, n_impls, n)) {
+            return 0;
+        }
+    }
+    return verify_size(impls, n_impls, bench.n_points);
+}
+
+static void report(const char *name, long long elapsed)
+{
+    double per_query = (double)elapsed / bench.n_queries;
+    printf("%-8s %10.1f ns/query %8.2f points/ns\n", name, per_query,
+            bench.n_points / per_query);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long seed = 1;
+    struct nearest_impl impls[3];
+    int opt, i, k, n_impls;
+    while ((opt = getopt(argc, argv, "s:n:q:S:")) != -1) {
+        switch (opt) {
+            case 's':
+                if (sscanf(optarg, "%llu", &seed) != 1) {
+                    usage();
+                }
+                break;
+            case 'n':
+                if (sscanf(optarg, "%d", &bench.n_points) != 1 || bench.n_points < 1) {
+                    usage();
+                }
+                break;
+            case 'q':
+                if (sscanf(optarg, "%d", &bench.n_queries) != 1 || bench.n_queries < 1) {
+                    usage();
+                }
+                break;
+            case 'S':
+                if (sscanf(optarg, "%d", &bench.size) != 1 || bench.size < 1) {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc) {
+        usage();
+    }
+    rng_seed(&bench.rng, seed);
+    bench.xs = malloc(bench.n_points * sizeof *bench.xs);
+    bench.ys = malloc(bench.n_points * sizeof *bench.ys);
+    bench.qx = malloc(bench.n_queries * sizeof *bench.qx);
+    bench.qy = malloc(bench.n_queries * sizeof *bench.qy);
+    bench.expect = malloc(bench.n_queries * sizeof *bench.expect);
+    bench.out = malloc(bench.n_queries * sizeof *bench.out);
+
+    n_impls = nearest_supported(impls);
+    if (!verify(impls, n_impls)) {
+        return EXIT_FAILURE;
+    }
+    printf("%d points, %d queries, all kernels agree with scalar\n",
+            bench.n_points, bench.n_queries);
+
+    fill_points(bench.n_points);
+    for (k = 0; k < n_impls; k++) {
+        long long start = now_ns();
+        int sink = 0;
+        for (i = 0; i < bench.n_queries; i++) {
+            sink += impls[k].fn(bench.xs, bench.ys, bench.n_points, bench.qx[i], bench.qy[i]);
+        }
+        report(impls[k].name, now_ns() - start);
+        bench.expect[0] = sink;
+    }
+    long long start = now_ns();
+    nearest_batch(bench.xs, bench.ys, bench.n_points, bench.qx, bench.qy,
+            bench.n_queries, bench.out);
+    report("batch", now_ns() - start);
+
+    free(bench.xs);
+    free(bench.ys);
+    free(bench.qx);
+    free(bench.qy);
+    free(bench.expect);
+    free(bench.out);
+    return 0;
+}
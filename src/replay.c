@@ -0,0 +1,446 @@
+#define _GNU_SOURCE
+
+#include "movelog.h"
+#include "scenario.h"
+#include "tiles.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Replays a move log written by ./server -l on top of the scenario the run
+ * started from, with no agents. The map is rebuilt from the keyframe
+ * closest to where the replay is to stop.
+ */
+
+static struct {
+    struct scenario scenario;
+    struct tiles grid;
+    int n_hunters;
+    int n_objects;
+    int *x;
+    int *y;
+    int *energy;
+    unsigned char *alive;
+    /* The log, records run from data + sizeof header to end */
+    const unsigned char *data;
+    size_t size;
+    const unsigned char *end;
+    const struct movelog_keyframe *keyframes;
+    long n_keyframes;
+    int last_idx;
+    long moves;
+    long ticks;
+    long checked;
+    int ended;
+    /* Set when a log without an index stops inside a record */
+    int truncated;
+} replay;
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./replay [-m moves] [-c] [-p] scenario log\n"
+            "-m stops after that many moves, -c checks the log against its keyframes\n"
+            "and -p prints the map at the end\n");
+    exit(EXIT_FAILURE);
+}
+
+static void corrupt(const unsigned char *p)
+{
+    fprintf(stderr, "Corrupt log at offset %zu\n", (size_t)(p - replay.data));
+    exit(EXIT_FAILURE);
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void load_scenario(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (scenario_open(in, &replay.scenario) == -1) {
+        fprintf(stderr, "%s: input error\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(in);
+    replay.n_hunters = replay.scenario.header->n_hunters;
+    replay.n_objects = replay.n_hunters + replay.scenario.header->n_preys;
+    replay.x = malloc(replay.n_objects * sizeof *replay.x);
+    replay.y = malloc(replay.n_objects * sizeof *replay.y);
+    replay.energy = malloc(replay.n_objects * sizeof *replay.energy);
+    replay.alive = malloc(replay.n_objects * sizeof *replay.alive);
+}
+
+static void load_log(const char *path)
+{
+    const struct movelog_header *header;
+    const struct movelog_trailer *trailer;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    replay.size = st.st_size;
+    if (replay.size < sizeof *header) {
+        fprintf(stderr, "%s: not a move log\n", path);
+        exit(EXIT_FAILURE);
+    }
+    replay.data = mmap(NULL, replay.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (replay.data == MAP_FAILED) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    /* One pass front to back, unless we seek */
+    madvise((void *)replay.data, replay.size, MADV_SEQUENTIAL);
+    header = (const struct movelog_header *)replay.data;
+    if (memcmp(header->magic, MOVELOG_MAGIC, sizeof header->magic) != 0 ||
+            header->version != MOVELOG_VERSION) {
+        fprintf(stderr, "%s: not a move log\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (header->width != replay.scenario.header->width ||
+            header->height != replay.scenario.header->height ||
+            header->n_hunters != replay.scenario.header->n_hunters ||
+            header->n_preys != replay.scenario.header->n_preys) {
+        fprintf(stderr, "%s: recorded from another scenario\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    replay.end = replay.data + replay.size;
+    trailer = (const struct movelog_trailer *)(replay.end - sizeof *trailer);
+    if (replay.size >= sizeof *header + sizeof *trailer && replay.size % 8 == 0 &&
+            memcmp(trailer->magic, MOVELOG_TRAILER_MAGIC, sizeof trailer->magic) == 0 &&
+            trailer->index_offset >= sizeof *header &&
+            trailer->index_offset + trailer->n_keyframes * sizeof *replay.keyframes ==
+                replay.size - sizeof *trailer) {
+        replay.keyframes = (const struct movelog_keyframe *)(replay.data + trailer->index_offset);
+        replay.n_keyframes = trailer->n_keyframes;
+        replay.end = replay.data + trailer->index_offset;
+    } else {
+        fprintf(stderr, "%s: no keyframe index, the run did not finish\n", path);
+    }
+}
+
+/* A run that did not finish may have stopped writing halfway through a
+ * record, which then ends the replay.
+ */
+static uint64_t get(const unsigned char **p)
+{
+    uint64_t v;
+    if (!movelog_get(p, replay.end, &v)) {
+        if (replay.keyframes || *p < replay.end) {
+            corrupt(*p);
+        }
+        replay.truncated = 1;
+        return 0;
+    }
+    return v;
+}
+
+static int shown(int idx)
+{
+    return tiles_get(&replay.grid, replay.x[idx], replay.y[idx]) == idx;
+}
+
+enum keyframe_use {
+    KEYFRAME_LOAD,
+    KEYFRAME_CHECK,
+    KEYFRAME_SKIP,
+};
+
+/* Installs the keyframe at p, compares it with the replayed map or just
+ * steps over it. Returns the first byte after it.
+ */
+static const unsigned char *read_keyframe(const unsigned char *p, enum keyframe_use use)
+{
+    int i, mismatch = 0;
+    long moves = get(&p), ticks = get(&p);
+    if (use == KEYFRAME_LOAD) {
+        if (replay.grid.tiles) {
+            tiles_free(&replay.grid);
+        }
+        tiles_init(&replay.grid, replay.scenario.header->height, replay.scenario.header->width);
+        tiles_load_obstacles(&replay.grid, replay.scenario.obstacles,
+                scenario_row_words(replay.scenario.header->width));
+        replay.moves = moves;
+        replay.ticks = ticks;
+    } else if (use == KEYFRAME_CHECK && (moves != replay.moves || ticks != replay.ticks)) {
+        mismatch = 1;
+    }
+    for (i = 0; i < replay.n_objects; i++) {
+        uint64_t v = get(&p);
+        int alive = v != 0, x = 0, y = 0, energy = 0, is_shown = 0;
+        if (alive) {
+            x = (v - 1) / 2;
+            is_shown = (v - 1) % 2;
+            y = get(&p);
+            energy = get(&p);
+            if (replay.truncated) {
+                return p;
+            }
+            if (x >= replay.scenario.header->height || y >= replay.scenario.header->width) {
+                corrupt(p);
+            }
+        }
+        if (use == KEYFRAME_SKIP) {
+            continue;
+        }
+        if (use == KEYFRAME_CHECK) {
+            mismatch |= alive != replay.alive[i] || (alive && (x != replay.x[i] ||
+                        y != replay.y[i] || energy != replay.energy[i] || is_shown != shown(i)));
+            continue;
+        }
+        replay.alive[i] = alive;
+        replay.x[i] = x;
+        replay.y[i] = y;
+        replay.energy[i] = energy;
+        if (is_shown) {
+            tiles_set(&replay.grid, x, y, i);
+        }
+    }
+    if (mismatch) {
+        fprintf(stderr, "Keyframe at offset %zu does not match the replay\n",
+                (size_t)(p - replay.data));
+        exit(EXIT_FAILURE);
+    }
+    replay.checked += use == KEYFRAME_CHECK;
+    replay.last_idx = 0;
+    return p;
+}
+
+static int next_idx(uint64_t delta, const unsigned char *p)
+{
+    int idx = replay.last_idx + (int)movelog_unzigzag(delta);
+    if (idx < 0 || idx >= replay.n_objects || !replay.alive[idx]) {
+        corrupt(p);
+    }
+    replay.last_idx = idx;
+    return idx;
+}
+
+/* Same grid updates as hunter_apply_move() and prey_apply_move(), and the
+ * same move_possible() check
+ */
+static void move(int idx, int dx, int dy, const unsigned char *p)
+{
+    int x = replay.x[idx] + dx, y = replay.y[idx] + dy;
+    if (x < 0 || x >= replay.scenario.header->height ||
+            y < 0 || y >= replay.scenario.header->width) {
+        corrupt(p);
+    }
+    int target = tiles_get(&replay.grid, x, y);
+    if (target == TILES_OBSTACLE || (target != TILES_EMPTY &&
+                (target < replay.n_hunters) == (idx < replay.n_hunters))) {
+        /* Turned down, the agent stays where it is */
+        replay.moves++;
+        return;
+    }
+    if (idx < replay.n_hunters) {
+        if (shown(idx)) {
+            tiles_set(&replay.grid, replay.x[idx], replay.y[idx], TILES_EMPTY);
+        }
+        tiles_set(&replay.grid, x, y, idx);
+        replay.energy[idx]--;
+    } else {
+        tiles_set(&replay.grid, x, y, idx);
+        if (shown(idx)) {
+            tiles_set(&replay.grid, replay.x[idx], replay.y[idx], TILES_EMPTY);
+        }
+    }
+    replay.x[idx] = x;
+    replay.y[idx] = y;
+    replay.moves++;
+}
+
+/* Same as settle_death() */
+static void death(int idx, int kind)
+{
+    if (kind == 0) {
+        replay.energy[tiles_get(&replay.grid, replay.x[idx], replay.y[idx])] += replay.energy[idx];
+    } else if (shown(idx)) {
+        tiles_set(&replay.grid, replay.x[idx], replay.y[idx], TILES_EMPTY);
+    }
+    replay.alive[idx] = 0;
+    replay.energy[idx] = 0;
+}
+
+/* Replays records from p until the log ends or limit moves were made */
+static void run(const unsigned char *p, long limit, int check)
+{
+    while (p < replay.end && replay.moves < limit) {
+        uint64_t v = get(&p);
+        int idx;
+        if (replay.truncated) {
+            return;
+        }
+        switch (v & 3) {
+            case MOVELOG_STEP:
+                v >>= 2;
+                idx = next_idx(v / 9, p);
+                move(idx, (int)(v % 9 / 3) - 1, (int)(v % 3) - 1, p);
+                break;
+            case MOVELOG_JUMP: {
+                idx = next_idx(v >> 2, p);
+                int dx = movelog_unzigzag(get(&p)), dy = movelog_unzigzag(get(&p));
+                if (replay.truncated) {
+                    return;
+                }
+                move(idx, dx, dy, p);
+                break;
+            }
+            case MOVELOG_DEATH:
+                v >>= 2;
+                death(next_idx(v / 2, p), v % 2);
+                break;
+            case MOVELOG_MARK:
+                switch (v >> 2) {
+                    case MOVELOG_TICK:
+                        replay.ticks++;
+                        break;
+                    case MOVELOG_KEYFRAME:
+                        p = read_keyframe(p, check ? KEYFRAME_CHECK : KEYFRAME_SKIP);
+                        break;
+                    case MOVELOG_SYNC:
+                        replay.last_idx = 0;
+                        break;
+                    case MOVELOG_END:
+                        replay.ended = 1;
+                        return;
+                    default:
+                        corrupt(p);
+                }
+                break;
+        }
+    }
+}
+
+/* Last keyframe at or before limit moves, the first one without an index */
+static const unsigned char *seek(long limit)
+{
+    long lo = 0, hi = replay.n_keyframes;
+    if (hi == 0) {
+        return replay.data + sizeof(struct movelog_header);
+    }
+    while (hi - lo > 1) {
+        long mid = (lo + hi) / 2;
+        if ((long)replay.keyframes[mid].moves <= limit) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return replay.data + replay.keyframes[lo].offset;
+}
+
+static void print_map(void)
+{
+    int x, y, width = replay.scenario.header->width;
+    char *line = malloc(width + 3);
+    line[0] = line[width + 1] = '+';
+    memset(line + 1, '-', width);
+    line[width + 2] = '\0';
+    puts(line);
+    for (x = 0; x < replay.scenario.header->height; x++) {
+        char *row = line + 1;
+        for (y = 0; y < width; y++) {
+            int idx = tiles_get(&replay.grid, x, y);
+            row[y] = idx == TILES_OBSTACLE ? 'X' : idx == TILES_EMPTY ? ' ' :
+                idx < replay.n_hunters ? 'H' : 'P';
+        }
+        line[0] = line[width + 1] = '|';
+        puts(line);
+    }
+    line[0] = line[width + 1] = '+';
+    memset(line + 1, '-', width);
+    puts(line);
+    free(line);
+}
+
+int main(int argc, char **argv)
+{
+    long limit = -1;
+    int opt, check = 0, print = 0, i, hunters = 0, preys = 0;
+    while ((opt = getopt(argc, argv, "m:cp")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (sscanf(optarg, "%ld", &limit) != 1 || limit < 0) {
+                    usage();
+                }
+                break;
+            case 'c':
+                check = 1;
+                break;
+            case 'p':
+                print = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+    }
+    load_scenario(argv[optind]);
+    load_log(argv[optind + 1]);
+
+    long long start = now_ns();
+    const unsigned char *p = replay.data + sizeof(struct movelog_header);
+    if (!check && limit >= 0) {
+        p = seek(limit);
+    }
+    uint64_t first;
+    if (!movelog_get(&p, replay.end, &first) ||
+            first != ((uint64_t)MOVELOG_KEYFRAME << 2 | MOVELOG_MARK)) {
+        corrupt(p);
+    }
+    p = read_keyframe(p, KEYFRAME_LOAD);
+    if (replay.truncated) {
+        corrupt(p);
+    }
+    long from = replay.moves;
+    run(p, limit < 0 ? LONG_MAX : limit, check);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    for (i = 0; i < replay.n_objects; i++) {
+        if (replay.alive[i]) {
+            hunters += i < replay.n_hunters;
+            preys += i >= replay.n_hunters;
+        }
+    }
+    if (print) {
+        print_map();
+    }
+    printf("moves: %ld, ticks: %ld\n", replay.moves, replay.ticks);
+    printf("alive: %d hunters, %d preys\n", hunters, preys);
+    printf("replayed in %.3f s, %.0f moves/s\n", elapsed,
+            elapsed > 0 ? (replay.moves - from) / elapsed : 0.0);
+    if (check) {
+        printf("%ld keyframes match\n", replay.checked);
+    }
+    if (replay.truncated || (!replay.ended && replay.moves != limit)) {
+        fprintf(stderr, "Log ends without an end mark\n");
+    }
+    munmap((void *)replay.data, replay.size);
+    tiles_free(&replay.grid);
+    scenario_close(&replay.scenario);
+    free(replay.x);
+    free(replay.y);
+    free(replay.energy);
+    free(replay.alive);
+    return 0;
+}
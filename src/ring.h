@@ -0,0 +1,84 @@
+#ifndef RING_H
+#define RING_H
+
+#include "globals.h"
+
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Single-producer/single-consumer rings shared between the server and an
+ * agent through an mmap'd memfd. The server wakes the agent with a futex on
+ * the tail of the state ring, the agent wakes the server with an eventfd
+ * that the server's event loop watches. Wakeups are only needed when a ring
+ * goes from empty to non-empty.
+ */
+
+#define RING_SLOTS 4
+#define RING_SLOT_SIZE sizeof(struct server_message)
+
+struct ring {
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    _Alignas(64) unsigned char slots[RING_SLOTS][RING_SLOT_SIZE];
+};
+
+struct agent_channel {
+    struct ring to_agent;
+    struct ring to_server;
+};
+
+/* Returns -1 if the ring is full, 1 if the consumer may be waiting for this
+ * message and needs a wakeup, 0 otherwise.
+ */
+static inline int ring_push(struct ring *ring, const void *message, size_t size)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == RING_SLOTS) {
+        return -1;
+    }
+    memcpy(ring->slots[tail % RING_SLOTS], message, size);
+    /* Pairs with the consumer's store to head in ring_pop() */
+    atomic_store(&ring->tail, tail + 1);
+    return atomic_load(&ring->head) == tail;
+}
+
+/* Returns 0 if the ring is empty.
+ */
+static inline int ring_pop(struct ring *ring, void *message, size_t size)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+    memcpy(message, ring->slots[head % RING_SLOTS], size);
+    atomic_store(&ring->head, head + 1);
+    return 1;
+}
+
+/* Sleeps while the ring is empty, for at most RING_WAIT_NS so that the
+ * consumer can check that its peer is still alive. May return early or with
+ * the ring still empty.
+ */
+#define RING_WAIT_NS 100000000
+
+static inline void ring_wait(struct ring *ring)
+{
+    const struct timespec timeout = { 0, RING_WAIT_NS };
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load(&ring->tail) == head) {
+        syscall(SYS_futex, &ring->tail, FUTEX_WAIT, head, &timeout, NULL, 0);
+    }
+}
+
+static inline void ring_wake(struct ring *ring)
+{
+    syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+#endif
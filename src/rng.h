@@ -0,0 +1,37 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* Small seedable PRNG (splitmix64) so runs are reproducible across libcs.
+ */
+struct rng {
+    uint64_t state;
+};
+
+static inline void rng_seed(struct rng *rng, uint64_t seed)
+{
+    rng->state = seed;
+}
+
+static inline uint64_t rng_next(struct rng *rng)
+{
+    uint64_t z = (rng->state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, n), n > 0 */
+static inline uint64_t rng_below(struct rng *rng, uint64_t n)
+{
+    return rng_next(rng) % n;
+}
+
+/* Uniform in [0, 1) */
+static inline double rng_double(struct rng *rng)
+{
+    return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif
@@ -0,0 +1,182 @@
+#include "scenario.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int scenario_read(FILE *in, struct scenario *scenario)
+{
+    size_t capacity = 1 << 16, n;
+    scenario->base = malloc(capacity);
+    scenario->size = 0;
+    while ((n = fread((char *)scenario->base + scenario->size, 1,
+                    capacity - scenario->size, in)) > 0) {
+        scenario->size += n;
+        if (scenario->size == capacity) {
+            capacity *= 2;
+            scenario->base = realloc(scenario->base, capacity);
+        }
+    }
+    if (ferror(in)) {
+        perror("scenario_read()");
+        return -1;
+    }
+    return 0;
+}
+
+int scenario_load(FILE *in, struct scenario *scenario)
+{
+    const struct scenario_header *header;
+    struct stat st;
+    size_t i;
+    memset(scenario, 0, sizeof *scenario);
+    if (fstat(fileno(in), &st) == -1) {
+        perror("scenario_load()");
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        scenario->size = st.st_size;
+        scenario->base = mmap(NULL, scenario->size, PROT_READ, MAP_PRIVATE,
+                fileno(in), 0);
+        if (scenario->base == MAP_FAILED) {
+            perror("scenario_load()");
+            scenario->base = NULL;
+            return -1;
+        }
+        scenario->mapped = 1;
+        /* Read front to back once */
+        madvise(scenario->base, scenario->size, MADV_SEQUENTIAL);
+    } else if (scenario_read(in, scenario) == -1) {
+        return -1;
+    }
+
+    header = scenario->base;
+    if (scenario->size < sizeof *header ||
+            memcmp(header->magic, SCENARIO_MAGIC, sizeof header->magic) != 0 ||
+            header->version != SCENARIO_VERSION ||
+            header->width < 1 || header->height < 1 ||
+            header->n_hunters < 0 || header->n_preys < 0) {
+        return -1;
+    }
+    if (header->flags & SCENARIO_SNAPSHOT) {
+        const struct scenario_state *state;
+        size_t n_objects = (size_t)header->n_hunters + header->n_preys;
+        if (scenario->size < scenario_state_offset(header) + sizeof *state) {
+            return -1;
+        }
+        state = (const void *)((const char *)scenario->base + scenario_state_offset(header));
+        if (state->n_events < 0 || state->n_events > (int64_t)n_objects ||
+                scenario_snapshot_size(header, state) != scenario->size) {
+            return -1;
+        }
+        scenario->state = state;
+        scenario->events = (const struct scenario_event *)(state + 1);
+        scenario->sent = (const struct server_message *)(scenario->events + state->n_events);
+        scenario->alive = (const unsigned char *)(scenario->sent + n_objects);
+    } else if (scenario_size(header) != scenario->size) {
+        return -1;
+    }
+    scenario->header = header;
+    scenario->obstacles = (const uint64_t *)(header + 1);
+    scenario->agents = (const struct scenario_agent *)(scenario->obstacles +
+            (size_t)header->height * scenario_row_words(header->width));
+    for (i = 0; i < (size_t)header->n_hunters + header->n_preys; i++) {
+        /* The dead of a snapshot are parked anywhere */
+        if ((!scenario->alive || scenario->alive[i]) &&
+                !scenario_agent_valid(header, &scenario->agents[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void text_error(struct scenario *scenario)
+{
+    free(scenario->base);
+    scenario->base = NULL;
+}
+
+int scenario_parse(FILE *in, struct scenario *scenario)
+{
+    struct scenario_header header = { .version = SCENARIO_VERSION };
+    struct scenario_agent *agents;
+    uint64_t *obstacles;
+    size_t row_words, n_words;
+    long i, n_obstacles;
+    int n, kind;
+    memset(scenario, 0, sizeof *scenario);
+    memcpy(header.magic, SCENARIO_MAGIC, sizeof header.magic);
+    if (fscanf(in, "%d %d", &header.width, &header.height) != 2 ||
+            header.width < 1 || header.height < 1 ||
+            fscanf(in, "%ld", &n_obstacles) != 1 || n_obstacles < 0) {
+        return -1;
+    }
+    row_words = scenario_row_words(header.width);
+    n_words = (size_t)header.height * row_words;
+    /* Grown once the agent counts are known */
+    scenario->size = sizeof header + n_words * sizeof *obstacles;
+    scenario->base = calloc(1, scenario->size);
+    obstacles = (uint64_t *)((struct scenario_header *)scenario->base + 1);
+    for (i = 0; i < n_obstacles; i++) {
+        int x, y;
+        uint64_t *word, bit;
+        if (fscanf(in, "%d %d", &x, &y) != 2 || x < 0 || x >= header.height ||
+                y < 0 || y >= header.width) {
+            text_error(scenario);
+            return -1;
+        }
+        word = &obstacles[x * row_words + y / 64];
+        bit = 1ULL << (y % 64);
+        /* Listed twice is one obstacle */
+        header.n_obstacles += !(*word & bit);
+        *word |= bit;
+    }
+    for (kind = 0; kind < 2; kind++) {
+        size_t first = scenario->size;
+        if (fscanf(in, "%d", &n) != 1 || n < 0) {
+            text_error(scenario);
+            return -1;
+        }
+        scenario->size += n * sizeof *agents;
+        scenario->base = realloc(scenario->base, scenario->size);
+        agents = (struct scenario_agent *)((char *)scenario->base + first);
+        for (i = 0; i < n; i++) {
+            if (fscanf(in, "%d %d %d", &agents[i].x, &agents[i].y, &agents[i].energy) != 3 ||
+                    !scenario_agent_valid(&header, &agents[i])) {
+                text_error(scenario);
+                return -1;
+            }
+        }
+        if (kind == 0) {
+            header.n_hunters = n;
+        } else {
+            header.n_preys = n;
+        }
+    }
+    memcpy(scenario->base, &header, sizeof header);
+    scenario->header = scenario->base;
+    scenario->obstacles = (const uint64_t *)(scenario->header + 1);
+    scenario->agents = (const struct scenario_agent *)(scenario->obstacles + n_words);
+    return 0;
+}
+
+int scenario_open(FILE *in, struct scenario *scenario)
+{
+    int c = getc(in);
+    ungetc(c, in);
+    if (c == SCENARIO_MAGIC[0]) {
+        return scenario_load(in, scenario);
+    }
+    return scenario_parse(in, scenario);
+}
+
+void scenario_close(struct scenario *scenario)
+{
+    if (scenario->mapped) {
+        munmap(scenario->base, scenario->size);
+    } else {
+        free(scenario->base);
+    }
+    memset(scenario, 0, sizeof *scenario);
+}
@@ -0,0 +1,137 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "globals.h"
+
+/* Binary scenario, in native byte order:
+ *
+ *   struct scenario_header
+ *   obstacle bitmap, height rows of scenario_row_words(width) words, bit
+ *       y % 64 of word y / 64 of row x is set for an obstacle on (x, y)
+ *   n_hunters and then n_preys struct scenario_agent
+ *
+ * Everything is where the server wants it, so loading is an mmap and a
+ * copy. ./convert writes it from the text format.
+ *
+ * A snapshot of a running simulation has SCENARIO_SNAPSHOT in flags, its
+ * dead agents are parked anywhere, and it goes on with, from the next
+ * multiple of 8 bytes:
+ *
+ *   struct scenario_state
+ *   n_events struct scenario_event, the virtual clock's heap
+ *   n_hunters + n_preys struct server_message, the last state each agent
+ *       was sent
+ *   n_hunters + n_preys alive bytes
+ */
+
+#define SCENARIO_MAGIC "HPSCENE"
+#define SCENARIO_VERSION 1
+
+#define SCENARIO_SNAPSHOT 1
+
+struct scenario_header {
+    char magic[8];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t n_hunters;
+    int32_t n_preys;
+    uint32_t flags;
+    uint64_t n_obstacles;
+};
+
+struct scenario_agent {
+    int32_t x;
+    int32_t y;
+    int32_t energy;
+};
+
+struct scenario_state {
+    uint64_t rng;
+    int64_t moves;
+    int64_t ticks;
+    int64_t now;
+    int64_t seq;
+    int32_t preys_caught;
+    int32_t hunters_exhausted;
+    int32_t n_events;
+    uint32_t unused;
+};
+
+struct scenario_event {
+    int64_t time;
+    int64_t seq;
+    int32_t idx;
+    uint32_t unused;
+};
+
+struct scenario {
+    const struct scenario_header *header;
+    const uint64_t *obstacles;
+    const struct scenario_agent *agents;
+    /* Snapshots only, NULL otherwise */
+    const struct scenario_state *state;
+    const struct scenario_event *events;
+    const struct server_message *sent;
+    const unsigned char *alive;
+    void *base;
+    size_t size;
+    int mapped;
+};
+
+static inline size_t scenario_row_words(int width)
+{
+    return ((size_t)width + 63) / 64;
+}
+
+static inline size_t scenario_size(const struct scenario_header *header)
+{
+    return sizeof *header +
+        (size_t)header->height * scenario_row_words(header->width) * sizeof(uint64_t) +
+        ((size_t)header->n_hunters + header->n_preys) * sizeof(struct scenario_agent);
+}
+
+/* On the map and with energy left to lose */
+static inline int scenario_agent_valid(const struct scenario_header *header,
+        const struct scenario_agent *agent)
+{
+    return agent->x >= 0 && agent->x < header->height &&
+        agent->y >= 0 && agent->y < header->width && agent->energy >= 0;
+}
+
+/* Offset of the snapshot sections */
+static inline size_t scenario_state_offset(const struct scenario_header *header)
+{
+    return (scenario_size(header) + 7) & ~(size_t)7;
+}
+
+static inline size_t scenario_snapshot_size(const struct scenario_header *header,
+        const struct scenario_state *state)
+{
+    size_t n_objects = (size_t)header->n_hunters + header->n_preys;
+    return scenario_state_offset(header) + sizeof *state +
+        (size_t)state->n_events * sizeof(struct scenario_event) +
+        n_objects * (sizeof(struct server_message) + 1);
+}
+
+/* Maps the scenario in from the start of in if it is a regular file, reads
+ * the rest of in otherwise. Returns 0 on success, -1 if it is malformed,
+ * has a live agent off the map or with negative energy, or cannot be read.
+ */
+int scenario_load(FILE *in, struct scenario *scenario);
+/* Reads a scenario in the text format into memory, laid out as above.
+ * Returns 0 on success, -1 on malformed input, the same agent checks
+ * included.
+ */
+int scenario_parse(FILE *in, struct scenario *scenario);
+
+/* Either of the two, binary if in starts with the magic */
+int scenario_open(FILE *in, struct scenario *scenario);
+
+void scenario_close(struct scenario *scenario);
+
+#endif
@@ -1,23 +1,49 @@
-#include "globals.h"
+#define _GNU_SOURCE
+#include "agent.h"
+#include "field.h"
+#include "movelog.h"
+#include "nearest.h"
+#include "ring.h"
+#include "rng.h"
+#include "scenario.h"
+#include "tiles.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define IDX_OBSTACLE -1
-#define IDX_EMPTY -2
+#define IDX_OBSTACLE TILES_OBSTACLE
+#define IDX_EMPTY TILES_EMPTY
 
 /* TODO: Add more error checking, e.g. to close() calls.
  */
 
+enum object_kind {
+    KIND_HUNTER,
+    KIND_PREY,
+};
+
 enum die_reason {
     ERR_INPUT,
     ERR_FORK,
@@ -27,83 +53,549 @@ enum die_reason {
     ERR_WAIT,
     ERR_READ,
     ERR_WRITE,
+    ERR_POLL,
+    ERR_USAGE,
+    ERR_INDEX,
+    ERR_THREAD,
+    ERR_SNAPSHOT,
+};
+
+struct agent_move {
+    int idx;
+    struct ph_message message;
+};
+
+struct sim_event {
+    long long time;
+    long seq;
+    int idx;
+};
+
+enum death_kind {
+    DEATH_CAPTURE,
+    DEATH_EXHAUSTION,
+};
+
+struct death_event {
+    enum death_kind kind;
+    int idx;
+};
+
+struct death_queue {
+    struct death_event *events;
+    int count;
+};
+
+/* Rows of the grid owned by one band worker during a lockstep tick. Bands
+ * of one parity run at the same time, and bands b and b + 2 both clear
+ * cells on the edge rows of band b + 1 for the moves that leave it. Its top
+ * and bottom rows must then be in different tiles, so a band spans at least
+ * two rows of tiles.
+ */
+#define BAND_ROWS 32
+_Static_assert(BAND_ROWS % TILES_SIDE == 0, "bands must cover whole tiles");
+_Static_assert(BAND_ROWS >= 2 * TILES_SIDE, "band edge rows must not share a tile");
+
+enum band_task {
+    BAND_RESOLVE,
+    BAND_STATES,
+    BAND_QUIT,
+};
+
+struct band {
+    /* Moves handed off by other bands, linked through bands.handoff_next */
+    _Atomic int incoming;
+    struct death_queue deaths;
+    struct death_event death_slots[2];
+    long moves;
+    int updated;
+    /* Log records of the local and the incoming moves, merged into the
+     * main log after the tick
+     */
+    struct movelog_buf log[2];
 };
 
-struct map_object {
-    char (*represent)(void);
-    void (*fayrap)(struct map_object *);
-    int (*handle_move)(struct map_object *, int, int);
+/* An agent as it goes between the processes of a sharded world, idx is
+ * its index in the scenario
+ */
+struct shard_record {
+    int idx;
     int x;
     int y;
-    int idx;
-    int fd;
-    pid_t pid;
     int energy;
 };
 
-struct hunter {
-    struct map_object base;
+/* A move across the edge between two shards, idx is the record of the
+ * mover in the same package
+ */
+struct shard_move {
+    int idx;
+    int x;
+    int y;
+};
+
+/* Sent ahead of the records and moves of a package */
+struct shard_header {
+    int n_records;
+    int n_moves;
 };
 
-struct prey {
-    struct map_object base;
+/* What a shard tells the coordinator after each tick, see shard_index()
+ * for reach
+ */
+struct shard_report {
+    long moves;
+    int preys_caught;
+    int hunters_exhausted;
+    int alive[2];
+    int reach[2];
+    int held;
+    size_t grid_bytes;
+    /* Agent processes started since the last report, and how long it took */
+    int spawned;
+    long long startup;
 };
 
-struct obstacle {
-    struct map_object base;
+struct agent_job {
+    int idx;
+    struct server_message state;
 };
 
-struct empty {
-    struct map_object base;
+/* Connects a spawned agent to the server. open() sets up the server's end
+ * in the object's fd, which the event backend watches, and returns the fds
+ * the child gets as stdin and stdout. receive() is called once that fd is
+ * readable and returns the number of moves it drained into moves[].
+ */
+struct agent_transport {
+    const char *name;
+    void (*open)(int idx, int child_fds[2]);
+    void (*send)(int idx, const struct server_message *state);
+    int (*receive)(int idx, struct agent_move *moves, int max);
+    void (*close)(int idx);
 };
 
-static char obstacle_represent(void);
-static char empty_represent(void);
+/* Carries states to agents and their move requests back. wait() blocks
+ * until at least one agent has replied, fills moves[] and returns their
+ * count. receive() blocks until the given agent has replied. remove() drops
+ * a dead agent so that nothing more is read from it.
+ */
+struct event_backend {
+    void (*init)(void);
+    void (*send)(int idx, const struct server_message *state);
+    int (*wait)(struct agent_move *moves, int max);
+    void (*receive)(int idx, struct agent_move *move);
+    void (*remove)(int idx);
+    void (*clean)(void);
+};
 
-static struct {
-    int *grid;
+/* Everything one simulation works on. The server runs one, the batch
+ * runner one per job at a time on each worker.
+ */
+struct sim {
+    struct tiles grid;
+    /* Where the scenario is read from, stdin unless this is a batch job */
+    FILE *input;
+    /* Binary input, open until the grid has been built from it */
+    struct scenario scenario;
     int width;
     int height;
+    /* Rows held in grid, all of them unless this is a shard */
+    int row_base;
+    int rows;
     int n_hunters;
     int n_preys;
-    struct obstacle the_obstacle;
-    struct empty the_empty;
-    struct hunter *hunters;
-    struct prey *preys;
-    struct map_object **objects;
+    struct {
+        /* Indexed by agent, hunters first and then preys */
+        int *x;
+        int *y;
+        int *energy;
+        unsigned char *kind;
+        unsigned char *alive;
+        int *fd;
+        pid_t *pid;
+    } agents;
     struct pollfd *fds;
-} map = {
-    .the_obstacle = { .base.represent = obstacle_represent },
-    .the_empty = { .base.represent = empty_represent }
+    int epfd;
+    struct epoll_event *events;
+    const struct event_backend *backend;
+    const struct agent_transport *transport;
+    struct agent_channel **channels;
+    int in_process;
+    int hunters_alive;
+    int preys_alive;
+    /* Captures and exhaustions recorded by the move handlers */
+    struct death_queue deaths;
+    struct {
+        /* Killed agents are reaped when SIGCHLD shows up on sfd */
+        int sfd;
+        int pending;
+        sigset_t old_mask;
+    } reap;
+    int quiet;
+    int paced;
+    int seeded;
+    unsigned seed;
+    struct {
+        /* Frames are built in buf and written at once. In delta mode
+         * shown holds what the terminal displays and grid_set() collects
+         * changed cells in dirty_list.
+         */
+        int delta;
+        int fps;
+        char *buf;
+        size_t len;
+        size_t cap;
+        char *shown;
+        int shown_valid;
+        char *dirty;
+        size_t *dirty_list;
+        size_t n_dirty;
+        long long last_frame;
+        int pending;
+    } render;
+    struct {
+        /* Benchmark bookkeeping, latency is from state sent to move read */
+        int enabled;
+        long max_moves;
+        double deadline;
+        long moves;
+        long long start;
+        long long *sent_at;
+        long long *latencies;
+        long n_latencies;
+        long cap_latencies;
+        int preys_caught;
+        int hunters_exhausted;
+        /* Agent or host processes started or attached and how long that
+         * took
+         */
+        int spawned;
+        long long startup;
+    } bench;
+    struct {
+        /* In-process engine, agents are run by worker threads */
+        int n_workers;
+        pthread_t *workers;
+        pthread_mutex_t job_lock;
+        pthread_cond_t job_ready;
+        struct agent_job *jobs;
+        int job_head;
+        int job_count;
+        pthread_mutex_t move_lock;
+        pthread_cond_t move_ready;
+        struct agent_move *moves;
+        int move_head;
+        int move_count;
+        int stopping;
+        /* Replies pulled off the queue while looking for another agent's */
+        struct agent_move *mailbox;
+        char *has_mail;
+    } pool;
+    struct {
+        /* Agents leased from ./agentd listening on path, over fd */
+        const char *path;
+        int fd;
+    } agentd;
+    struct {
+        /* Agents driven by host processes, per_host of one kind to each.
+         * Host h runs the agents from first[h] and talks over fd[h].
+         */
+        int per_host;
+        int n_hosts;
+        int epfd;
+        struct epoll_event *events;
+        int *first;
+        /* Live agents left on each host, it is stopped at 0 */
+        int *alive;
+        int *fd;
+        pid_t *pid;
+        /* States waiting to go out, per_host slots per host */
+        struct host_state *out;
+        int *n_out;
+        /* Moves read so far, a record may be cut short */
+        struct host_move *in;
+        size_t *in_len;
+        struct agent_move *mailbox;
+        char *has_mail;
+    } host;
+    struct {
+        /* Batch jobs decide each move as its state is sent */
+        struct agent_move *moves;
+        int n_moves;
+    } direct;
+    struct {
+        /* io_uring driven through the raw syscalls, see uring_init(). The
+         * rings are shared with the kernel, sq_tail is only published
+         * right before io_uring_enter().
+         */
+        int fd;
+        void *sq_ring;
+        void *cq_ring;
+        size_t sq_ring_size;
+        size_t cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        struct io_uring_cqe *cqes;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned sq_mask;
+        unsigned sq_entries;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        /* Queued SQEs not handed to the kernel yet */
+        unsigned tail;
+        unsigned to_submit;
+        /* Requests the kernel still owns a buffer or a file for */
+        int in_flight;
+        /* One receive per agent is kept posted into in[idx], states go
+         * out from out[idx]
+         */
+        struct ph_message *in;
+        struct server_message *out;
+        unsigned char *receiving;
+        unsigned char *removed;
+        /* Receives to post again and states to send, turned into SQEs
+         * right before the next io_uring_enter() so that no SQE ever
+         * names the fd of an agent removed in the meantime
+         */
+        int *rearm;
+        int n_rearm;
+        int *outbox;
+        int n_outbox;
+        int reap_armed;
+        /* io_uring_enter() takes a timeout */
+        int ext_arg;
+        long enters;
+        long submitted;
+        struct agent_move *mailbox;
+        char *has_mail;
+    } uring;
+    struct {
+        /* Virtual clock, a min-heap of each agent's next move time */
+        int enabled;
+        struct rng rng;
+        struct sim_event *events;
+        int n_events;
+        long seq;
+        long long now;
+    } clock;
+    struct {
+        /* Uniform bucket grid over live agents, one list per kind */
+        int shift;
+        int rows;
+        int cols;
+        int *head[2];
+        int *next;
+        int *prev;
+        int count[2];
+        int enabled;
+        int check;
+        /* Vector scan over the adversary run instead of the buckets */
+        int simd;
+    } index;
+    struct {
+        int enabled;
+        long ticks;
+        /* In-process runs only depend on the map, which is compared with
+         * the one saved span ticks ago to find a run going in circles
+         */
+        int *seen;
+        unsigned char *seen_alive;
+        long span;
+        long power;
+    } lockstep;
+    struct {
+        /* One process per slice of rows, see run_sharded() */
+        int n_shards;
+        int id;
+        /* Rows [lo, hi) are owned, the grid also holds a halo row on
+         * either side
+         */
+        int lo;
+        int hi;
+        int coord_fd;
+        int up_fd;
+        int down_fd;
+        /* Every shard's reach by kind as the tick starts */
+        int (*reach)[2];
+        /* Coordinator only, relay holds the records on their way to each
+         * shard
+         */
+        int *fds;
+        pid_t *pids;
+        struct shard_record **relay;
+        int *n_relay;
+        int *relay_cap;
+        int max_held;
+        size_t max_grid_bytes;
+        /* Shard only. The agent table holds our agents, and the ones lent
+         * to us for an edge, in slots, gid is the index in the scenario.
+         * Slots 0 and 1 stand for the neighbours' hunters and preys in
+         * the halo rows.
+         */
+        int *gid;
+        unsigned char *owned;
+        int n_slots;
+        int *spare;
+        int n_spare;
+        int held;
+        /* Owned slots in scenario order as the tick starts, and our agents
+         * of each kind in that order
+         */
+        int *order;
+        int n_order;
+        int *own_x[2];
+        int *own_y[2];
+        int *own_slot[2];
+        int n_own[2];
+        /* Closest adversary by slot, -1 as the distance if none yet */
+        struct coordinate *adv;
+        int *adv_dist;
+        int *adv_gid;
+        struct coordinate *decided;
+        /* Adversaries from the other shards, by kind */
+        int *cand_x[2];
+        int *cand_y[2];
+        int *cand_gid[2];
+        int cand_cap[2];
+        /* Scratch for the packages */
+        struct shard_record *records;
+        int records_cap;
+        struct shard_move *moves;
+        int moves_cap;
+        int *lent;
+        int lent_cap;
+        int n_lent;
+        int *rec_of;
+        int *slot_of;
+        int slot_of_cap;
+        int *handoff;
+        int handoff_cap;
+        int *near;
+        int *row;
+    } shard;
+    struct {
+        /* Lockstep ticks resolved by worker threads over bands of rows */
+        int n_workers;
+        int n_bands;
+        int active;
+        enum band_task task;
+        pthread_t *threads;
+        pthread_barrier_t barrier;
+        struct band *bands;
+        /* Agents with a move this tick, grouped by starting band */
+        int *order;
+        int *band_start;
+        int *handoff_next;
+        /* One slice of n_objects per worker */
+        int *scratch;
+        int *old_x;
+        int *old_y;
+        unsigned char *died;
+        struct agent_move *pending;
+        unsigned char *has_move;
+        struct server_message *states;
+    } bands;
+    struct {
+        /* Every move and death, see movelog.h. Records go to buf on the
+         * hot path and a writer thread writes out the full buffer while
+         * buf fills up again.
+         */
+        const char *path;
+        int fd;
+        struct movelog_buf buf;
+        struct movelog_buf spare;
+        pthread_t writer;
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+        pthread_cond_t ready;
+        int writing;
+        int stopping;
+        /* Bytes handed to the writer so far, header included */
+        uint64_t offset;
+        long long flushed_at;
+        long moves;
+        long since_keyframe;
+        long keyframe_every;
+        struct movelog_keyframe *keyframes;
+        long n_keyframes;
+        long cap_keyframes;
+    } log;
+    struct {
+        /* Written to path by a forked copy of the server on SIGUSR1 and
+         * when the run ends. sent is the last state each agent was sent,
+         * which is what a restored agent is sent again.
+         */
+        const char *path;
+        struct server_message *sent;
+        int restored;
+    } snapshot;
+    struct {
+        /* Obstacle-aware distances to the closest agent of each kind,
+         * handed to agents as best_step
+         */
+        int enabled;
+        unsigned char *blocked;
+        struct field to[2];
+    } field;
 };
 
-static inline int grid_idx_(int x, int y)
+/* The simulation the calling thread works on. Threads started for a
+ * simulation by sim_thread_create() share their creator's.
+ */
+static _Thread_local struct sim *sim;
+
+/* Set from a signal handler, for whichever simulation takes snapshots */
+static volatile sig_atomic_t snapshot_requested;
+
+static inline size_t grid_idx_(int x, int y)
+{
+    return (size_t)(x - sim->row_base)*sim->width + y;
+}
+
+static void grid_touch(size_t cell)
 {
-    return x*map.width + y;
+    if (sim->render.dirty && !sim->render.dirty[cell]) {
+        /* Remembered for the next delta frame */
+        sim->render.dirty[cell] = 1;
+        sim->render.dirty_list[sim->render.n_dirty++] = cell;
+    }
 }
 
 static void grid_set(int x, int y, int idx)
 {
-    map.grid[grid_idx_(x, y)] = idx;
+    tiles_set(&sim->grid, x - sim->row_base, y, idx);
+    if (!sim->bands.active) {
+        /* Band workers leave this to tick_fixup() */
+        grid_touch(grid_idx_(x, y));
+    }
 }
 
 static int grid_get_idx(int x, int y)
 {
-    return map.grid[grid_idx_(x, y)];
+    return tiles_get(&sim->grid, x - sim->row_base, y);
 }
 
-static struct map_object *grid_get_object(int x, int y)
+static long long now_ns(void)
 {
-    int idx = map.grid[grid_idx_(x, y)];
-    if (idx == IDX_OBSTACLE) {
-        /* Obstacle */
-        return (struct map_object *)&map.the_obstacle;
-    } else if (idx == IDX_EMPTY) {
-        /* Empty */
-        return (struct map_object *)&map.the_empty;
-    } else {
-        return map.objects[idx];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Milliseconds until a frame held back by the frame rate cap is due, -1 if
+ * there is none. Backends that block on agents wait no longer than this so
+ * that render_poll() can draw it.
+ */
+static int render_timeout_ms(void)
+{
+    long long due;
+    if (!sim->render.pending) {
+        return -1;
     }
+    due = sim->render.last_frame + 1000000000LL / sim->render.fps - now_ns();
+    return due > 0 ? (int)((due + 999999) / 1000000) : 0;
 }
 
 static void die(enum die_reason reason)
@@ -133,6 +625,26 @@ static void die(enum die_reason reason)
         case ERR_WRITE:
             fprintf(stderr, "write() error\n");
             break;
+        case ERR_POLL:
+            fprintf(stderr, "poll() et al. error\n");
+            break;
+        case ERR_USAGE:
+            fprintf(stderr, "Usage: ./server [-b poll|epoll|uring] [-t socket|shm] [-a process|thread] [-w workers]\n"
+                    "                [-i scan|grid|simd] [-c] [-g] [-s seed] [-B] [-m moves] [-d seconds]\n"
+                    "                [-r full|delta] [-f fps] [-V | -L] [-P workers | -S shards]\n"
+                    "                [-k snapshot] [-l log] [-M agents per host | -A agentd socket]\n"
+                    "                [-R jobs [-j workers]]\n"
+                    "                < scenario\n");
+            break;
+        case ERR_THREAD:
+            fprintf(stderr, "pthread_create() error\n");
+            break;
+        case ERR_INDEX:
+            fprintf(stderr, "Spatial index mismatch\n");
+            break;
+        case ERR_SNAPSHOT:
+            fprintf(stderr, "Snapshot error\n");
+            break;
         default:
             fprintf(stderr, "Unknown error %d\n", reason);
             break;
@@ -140,525 +652,5050 @@ static void die(enum die_reason reason)
     exit(EXIT_FAILURE);
 }
 
-static char obstacle_represent(void)
-{
-    return 'X';
-}
+struct sim_thread {
+    struct sim *sim;
+    void *(*fn)(void *);
+    void *arg;
+};
 
-static char empty_represent(void)
+static void *sim_thread_main(void *arg)
 {
-    return ' ';
+    struct sim_thread thread = *(struct sim_thread *)arg;
+    free(arg);
+    sim = thread.sim;
+    return thread.fn(thread.arg);
 }
 
-static char hunter_represent(void)
+/* pthread_create() for a thread working on the caller's simulation */
+static void sim_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg)
 {
-    return 'H';
+    struct sim_thread *start = malloc(sizeof *start);
+    start->sim = sim;
+    start->fn = fn;
+    start->arg = arg;
+    if (pthread_create(thread, NULL, sim_thread_main, start) != 0) {
+        die(ERR_THREAD);
+    }
 }
 
-static void hunter_fayrap(struct map_object *this)
+static void socket_open(int idx, int child_fds[2])
 {
     int sv[2];
-    if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNIX, sv) == -1) {
-        perror("hunter_fayrap()");
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, PF_UNIX, sv) == -1) {
+        perror("socket_open()");
         die(ERR_SOCKET);
     }
-    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
-    pid_t pid;
-    pid = fork();
-    if (pid == -1) {
-        perror("hunter_fayrap()");
-        die(ERR_FORK);
-    } else if (pid > 0) {
-        close(sv[1]);
-        this->fd = sv[0];
-        this->pid = pid;
-    } else {
-        /* Child */
-        // close(sv[0]); FD_CLOEXEC
-        dup2(sv[1], STDIN_FILENO);
-        dup2(sv[1], STDOUT_FILENO);
-        close(sv[1]);
-
-        /* args */
-        int size;
-        char *arg1, *arg2;
-
-        size = snprintf(NULL, 0, "%d", map.width);
-        size++;
-        arg1 = malloc(size);
-        snprintf(arg1, size, "%d", map.width);
-
-        size = snprintf(NULL, 0, "%d", map.height);
-        size++;
-        arg2 = malloc(size);
-        snprintf(arg2, size, "%d", map.height);
+    sim->agents.fd[idx] = sv[0];
+    child_fds[0] = sv[1];
+    child_fds[1] = sv[1];
+}
 
-        /* exec() it */
-        execl("./hunter", "./hunter", arg1, arg2, NULL);
-        /* Error */
-        perror("hunter_fayrap()");
-        die(ERR_EXEC);
+static void socket_send(int idx, const struct server_message *state)
+{
+    if (write(sim->agents.fd[idx], state, sizeof *state) != sizeof *state) {
+        die(ERR_WRITE);
     }
 }
 
-static int move_possible(struct map_object *this, struct map_object *target)
+static int socket_receive(int idx, struct agent_move *moves, int max)
 {
-    return target->represent() == map.the_empty.base.represent() || (
-            this->represent() != target->represent() && target->represent() != map.the_obstacle.base.represent());
+    (void)max;
+    moves->idx = idx;
+    if (read(sim->agents.fd[idx], &moves->message, sizeof moves->message) !=
+            sizeof moves->message) {
+        die(ERR_READ);
+    }
+    return 1;
 }
 
-static void send_new_state(struct map_object *this)
+static void socket_close(int idx)
 {
-    struct server_message state;
-    memset(&state, 0xff, sizeof state);
-    state.pos.x = this->x;
-    state.pos.y = this->y;
+    close(sim->agents.fd[idx]);
+}
 
-    /* Closest adversary */
-    int i, min_dist, min_idx;
-    for (i = 0; map.objects[i]->idx == -1 ||
-            map.objects[i]->represent() == this->represent(); i++) {
-        /* Skip dead objects, there will always be at least one alive here */
-        assert(i < map.n_hunters + map.n_preys);
-    }
-    struct map_object *adv = map.objects[i];
-    min_dist = abs(adv->x - this->x) + abs(adv->y - this->y);
-    min_idx = i;
-    for (; i < map.n_hunters + map.n_preys; i++) {
-        adv = map.objects[i];
-        if (adv->idx == -1 || adv->represent() == this->represent()) {
-            /* Dead or not an adversary */
-            continue;
-        }
-        int dist;
-        dist = abs(adv->x - this->x) + abs(adv->y - this->y);
-        if (dist < min_dist) {
-            min_dist = dist;
-            min_idx = i;
-        }
-    }
-    adv = map.objects[min_idx];
-    state.adv_pos.x = adv->x;
-    state.adv_pos.y = adv->y;
+static const struct agent_transport socket_transport = {
+    .name = "socket",
+    .open = socket_open,
+    .send = socket_send,
+    .receive = socket_receive,
+    .close = socket_close,
+};
 
-    /* Neighbouring objects */
-    state.object_count = 0;
-    if (this->x - 1 > 0) {
-        struct map_object *neighbour = grid_get_object(this->x - 1, this->y);
-        if (!move_possible(this, neighbour)) {
-            struct coordinate coord = { this->x - 1, this->y };
-            state.object_pos[state.object_count++]  = coord;
-        }
-    }
-    if (this->y + 1 < map.width) {
-        struct map_object *neighbour = grid_get_object(this->x, this->y + 1);
-        if (!move_possible(this, neighbour)) {
-            struct coordinate coord = { this->x, this->y + 1 };
-            state.object_pos[state.object_count++]  = coord;
-        }
+static void shm_open_channel(int idx, int child_fds[2])
+{
+    int memfd = memfd_create("agent_channel", MFD_CLOEXEC);
+    if (memfd == -1 || ftruncate(memfd, sizeof **sim->channels) == -1) {
+        perror("shm_open_channel()");
+        die(ERR_SOCKET);
     }
-    if (this->x + 1 < map.height) {
-        struct map_object *neighbour = grid_get_object(this->x + 1, this->y);
-        if (!move_possible(this, neighbour)) {
-            struct coordinate coord = { this->x + 1, this->y };
-            state.object_pos[state.object_count++]  = coord;
-        }
+    sim->channels[idx] = mmap(NULL, sizeof **sim->channels, PROT_READ | PROT_WRITE,
+            MAP_SHARED, memfd, 0);
+    if (sim->channels[idx] == MAP_FAILED) {
+        perror("shm_open_channel()");
+        die(ERR_SOCKET);
     }
-    if (this->y - 1 > 0) {
-        struct map_object *neighbour = grid_get_object(this->x, this->y - 1);
-        if (!move_possible(this, neighbour)) {
-            struct coordinate coord = { this->x, this->y - 1 };
-            state.object_pos[state.object_count++]  = coord;
-        }
+    /* The agent signals the same eventfd the event backend watches */
+    sim->agents.fd[idx] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (sim->agents.fd[idx] == -1) {
+        perror("shm_open_channel()");
+        die(ERR_SOCKET);
     }
-    if (write(this->fd, &state, sizeof state) != sizeof state) {
+    child_fds[0] = memfd;
+    child_fds[1] = sim->agents.fd[idx];
+}
+
+static void shm_send(int idx, const struct server_message *state)
+{
+    struct ring *ring = &sim->channels[idx]->to_agent;
+    int wake = ring_push(ring, state, sizeof *state);
+    if (wake == -1) {
         die(ERR_WRITE);
+    } else if (wake) {
+        ring_wake(ring);
     }
 }
 
-static int hunter_handle_move(struct map_object *this, int x, int y)
+static int shm_receive(int idx, struct agent_move *moves, int max)
 {
-    struct map_object *target = grid_get_object(x, y);
-    int moved;
-    if (move_possible(this, target)) {
-        grid_set(x, y, this->idx);
-        if (grid_get_idx(this->x, this->y) == this->idx) {
-            grid_set(this->x, this->y, IDX_EMPTY);
-        } else {
-            //assert(grid_get_object(this->x, this->y)->represent() == 'P');
-            /* someone (a prey) stomped over me, leave them */
-        }
-        this->x = x;
-        this->y = y;
-        this->energy--;
-
-        moved = 1;
-    } else {
-        /* Move impossible */
-        moved = 0;
+    uint64_t count;
+    int n_moves = 0;
+    /* Reset the wakeup before draining, a push after this signals again */
+    if (read(sim->agents.fd[idx], &count, sizeof count) == -1 && errno != EAGAIN) {
+        die(ERR_READ);
     }
-    send_new_state(this);
-    return moved;
+    while (n_moves < max && ring_pop(&sim->channels[idx]->to_server,
+                &moves[n_moves].message, sizeof moves[n_moves].message)) {
+        moves[n_moves++].idx = idx;
+    }
+    return n_moves;
 }
 
-static char prey_represent(void)
+static void shm_close(int idx)
 {
-    return 'P';
+    munmap(sim->channels[idx], sizeof **sim->channels);
+    close(sim->agents.fd[idx]);
 }
 
-static void prey_fayrap(struct map_object *this)
+static const struct agent_transport shm_transport = {
+    .name = "shm",
+    .open = shm_open_channel,
+    .send = shm_send,
+    .receive = shm_receive,
+    .close = shm_close,
+};
+
+/* Starts path with mode, the seed if there is one and the map size, with
+ * child_fds as its stdin and stdout. posix_spawn() runs the child on the
+ * server's memory until exec() instead of copying the page tables, so the
+ * cost does not grow with the grid, and it is safe to call from several
+ * threads at once.
+ */
+static pid_t agent_exec(const char *path, char *const mode[2], unsigned seed,
+        int child_fds[2])
 {
-    int sv[2];
-    if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNIX, sv) == -1) {
-        perror("prey_fayrap()");
-        die(ERR_SOCKET);
-    }
-    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    char width[16], height[16], seed_arg[16];
+    char *args[9];
+    int n_args = 0, err;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
     pid_t pid;
-    pid = fork();
-    if (pid == -1) {
-        perror("prey_fayrap()");
-        die(ERR_FORK);
-    } else if (pid > 0) {
-        close(sv[1]);
-        this->fd = sv[0];
-        this->pid = pid;
-    } else {
-        /* Child */
-        // close(sv[0]); FD_CLOEXEC
-        dup2(sv[1], STDIN_FILENO);
-        dup2(sv[1], STDOUT_FILENO);
-        close(sv[1]);
-
-        /* args */
-        int size;
-        char *arg1, *arg2;
 
-        size = snprintf(NULL, 0, "%d", map.width);
-        size++;
-        arg1 = malloc(size);
-        snprintf(arg1, size, "%d", map.width);
-
-        size = snprintf(NULL, 0, "%d", map.height);
-        size++;
-        arg2 = malloc(size);
-        snprintf(arg2, size, "%d", map.height);
+    snprintf(width, sizeof width, "%d", sim->width);
+    snprintf(height, sizeof height, "%d", sim->height);
+    args[n_args++] = (char *)path;
+    args[n_args++] = mode[0];
+    if (mode[1]) {
+        args[n_args++] = mode[1];
+    }
+    if (sim->seeded) {
+        snprintf(seed_arg, sizeof seed_arg, "%u", seed);
+        args[n_args++] = "-s";
+        args[n_args++] = seed_arg;
+    }
+    if (!sim->paced) {
+        args[n_args++] = "-n";
+    }
+    args[n_args++] = width;
+    args[n_args++] = height;
+    args[n_args] = NULL;
 
-        /* exec() it */
-        execl("./prey", "./prey", arg1, arg2, NULL);
-        /* Error */
-        perror("prey_fayrap()");
+    /* Everything else is FD_CLOEXEC */
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, child_fds[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, child_fds[1], STDOUT_FILENO);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setsigmask(&attr, &sim->reap.old_mask);
+    err = posix_spawn(&pid, path, &actions, &attr, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        perror("agent_exec()");
         die(ERR_EXEC);
     }
+    return pid;
 }
 
-static int prey_handle_move(struct map_object *this, int x, int y)
+static void agent_spawn(int idx)
 {
-    struct map_object *target = grid_get_object(x, y);
-    int moved;
-    if (move_possible(this, target)) {
-        grid_set(x, y, this->idx);
-        if (grid_get_idx(this->x, this->y) == this->idx) {
-            grid_set(this->x, this->y, IDX_EMPTY);
-        } else {
-            assert(grid_get_object(this->x, this->y)->represent() == 'H');
-            /* someone (a hunter) stomped over me, leave them */
-        }
-        this->x = x;
-        this->y = y;
-
-        moved = 1;
-    } else {
-        /* Move impossible */
-        moved = 0;
+    const char *path = sim->agents.kind[idx] == KIND_HUNTER ? "./hunter" : "./prey";
+    char *const mode[2] = { "-t", (char *)sim->transport->name };
+    int child_fds[2];
+    sim->transport->open(idx, child_fds);
+    sim->agents.pid[idx] = agent_exec(path, mode, sim->seed + idx, child_fds);
+    close(child_fds[0]);
+    if (child_fds[1] != child_fds[0] && child_fds[1] != sim->agents.fd[idx]) {
+        close(child_fds[1]);
     }
-    send_new_state(this);
-    return moved;
 }
 
-static void init_grid(void)
+/* Whether an agent of the given kind may step on a cell holding target.
+ */
+static int move_possible(enum object_kind kind, int target)
 {
-    int width, height;
-    int i, j;
-    /* Get map dimensions and create grid */
-    if (scanf("%d %d", &width, &height) != 2) {
-        die(ERR_INPUT);
-    }
-    map.width = width;
-    map.height = height;
-    map.grid = malloc(map.width * map.height * sizeof *map.grid);
-
-    /* Empty spots */
-    for (i = 0; i < map.width; i++) {
-        for (j = 0; j < map.height; j++) {
-            map.grid[grid_idx_(i, j)] = IDX_EMPTY;
-        }
-    }
+    return target == IDX_EMPTY ||
+        (target != IDX_OBSTACLE && sim->agents.kind[target] != kind);
 }
 
-static void init_obstacles(void)
+static int index_bucket(int x, int y)
 {
-    int i;
-    int n_obstacles;
-    if (scanf("%d", &n_obstacles) != 1) {
-        die(ERR_INPUT);
-    }
-    for (i = 0; i < n_obstacles; i++) {
-        int x, y;
-        if (scanf("%d %d", &x, &y) != 2) {
-            die(ERR_INPUT);
-        }
-        map.grid[grid_idx_(x, y)] = IDX_OBSTACLE;
-    }
+    return (x >> sim->index.shift)*sim->index.cols + (y >> sim->index.shift);
 }
 
-static void init_hunters(void)
+static void index_insert(int idx, int x, int y)
 {
-    int i;
-    if (scanf("%d", &map.n_hunters) != 1) {
-        die(ERR_INPUT);
-    }
-    map.hunters = malloc(map.n_hunters * sizeof *map.hunters);
-    for (i = 0; i < map.n_hunters; i++) {
-        int x, y, energy;
-        if (scanf("%d %d %d", &x, &y, &energy) != 3) {
-            die(ERR_INPUT);
-        }
-        map.hunters[i].base.represent = hunter_represent;
-        map.hunters[i].base.fayrap = hunter_fayrap;
-        map.hunters[i].base.handle_move = hunter_handle_move;
-        map.hunters[i].base.x = x;
-        map.hunters[i].base.y = y;
-        map.hunters[i].base.energy = energy;
+    enum object_kind kind = sim->agents.kind[idx];
+    int bucket = index_bucket(x, y);
+    int head = sim->index.head[kind][bucket];
+    sim->index.prev[idx] = -1;
+    sim->index.next[idx] = head;
+    if (head != -1) {
+        sim->index.prev[head] = idx;
     }
+    sim->index.head[kind][bucket] = idx;
+    sim->index.count[kind]++;
 }
 
-static void init_preys(void)
+static void index_remove(int idx)
 {
-    int i;
-    if (scanf("%d", &map.n_preys) != 1) {
-        die(ERR_INPUT);
+    enum object_kind kind = sim->agents.kind[idx];
+    int prev = sim->index.prev[idx];
+    int next = sim->index.next[idx];
+    if (prev != -1) {
+        sim->index.next[prev] = next;
+    } else {
+        sim->index.head[kind][index_bucket(sim->agents.x[idx], sim->agents.y[idx])] = next;
     }
-    map.preys = malloc(map.n_preys * sizeof *map.preys);
-    for (i = 0; i < map.n_preys; i++) {
-        int x, y, energy;
-        if (scanf("%d %d %d", &x, &y, &energy) != 3) {
-            die(ERR_INPUT);
-        }
-        map.preys[i].base.represent = prey_represent;
-        map.preys[i].base.fayrap = prey_fayrap;
-        map.preys[i].base.handle_move = prey_handle_move;
-        map.preys[i].base.x = x;
-        map.preys[i].base.y = y;
-        map.preys[i].base.energy = energy;
+    if (next != -1) {
+        sim->index.prev[next] = prev;
     }
+    sim->index.count[kind]--;
 }
 
-static void init_objects(void)
+/* Must be called before the agent's position is updated.
+ */
+static void index_move(int idx, int x, int y)
 {
-    int i;
-    map.objects = malloc((map.n_hunters + map.n_preys) * sizeof *map.objects);
-    for (i = 0; i < map.n_hunters; i++) {
-        map.objects[i] = (struct map_object *)&map.hunters[i];
-        map.objects[i]->idx = i;
-        map.grid[grid_idx_(map.objects[i]->x, map.objects[i]->y)] = i;
-    }
-    for (; i < map.n_hunters + map.n_preys; i++) {
-        map.objects[i] = (struct map_object *)&map.preys[i - map.n_hunters];
-        map.objects[i]->idx = i;
-        map.grid[grid_idx_(map.objects[i]->x, map.objects[i]->y)] = i;
+    if (!sim->index.enabled || sim->bands.active ||
+            index_bucket(sim->agents.x[idx], sim->agents.y[idx]) == index_bucket(x, y)) {
+        return;
     }
+    index_remove(idx);
+    index_insert(idx, x, y);
 }
 
-static void fayrapla(void)
+/* Adversaries are the other contiguous run of agents */
+static void adversary_run(enum object_kind kind, int *lo, int *hi)
 {
-    int i;
-    map.fds = malloc((map.n_hunters + map.n_preys) * sizeof *map.fds);
-    for (i = 0; i < map.n_hunters + map.n_preys; i++) {
-        struct map_object *object = map.objects[i];
-        object->fayrap(object);
-        map.fds[i].fd = object->fd;
-        map.fds[i].events = POLLIN;
+    if (kind == KIND_HUNTER) {
+        *lo = sim->n_hunters;
+        *hi = sim->n_hunters + sim->n_preys;
+    } else {
+        *lo = 0;
+        *hi = sim->n_hunters;
     }
 }
 
-static void send_initial_states(void)
+/* Reference implementation, lowest index wins on ties.
+ */
+static int closest_adversary_scan(int idx)
 {
-    int i;
-    for (i = 0; i < map.n_hunters + map.n_preys; i++) {
-        struct map_object *object = map.objects[i];
-        object->handle_move(object, object->x, object->y);
+    int x = sim->agents.x[idx], y = sim->agents.y[idx];
+    int i, lo, hi, min_dist = -1, min_idx = -1;
+    adversary_run(sim->agents.kind[idx], &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        int dist;
+        if (!sim->agents.alive[i]) {
+            continue;
+        }
+        dist = abs(sim->agents.x[i] - x) + abs(sim->agents.y[i] - y);
+        if (min_dist == -1 || dist < min_dist) {
+            min_dist = dist;
+            min_idx = i;
+        }
     }
+    /* There will always be at least one alive here */
+    assert(min_idx != -1);
+    return min_idx;
 }
 
-static void print_map(void)
+/* Searches buckets in growing square rings around this. Anything in ring
+ * r is at least (r - 1)*bucket_size + 1 away, so the search stops as soon
+ * as the best candidate is closer than that.
+ */
+static int closest_adversary_grid(int idx)
 {
-    int i, j;
-    putchar('+');
-    for (i = 0; i < map.width; i++) {
-        putchar('-');
-    }
-    putchar('+');
-    putchar('\n');
+    enum object_kind kind = sim->agents.kind[idx] == KIND_HUNTER ? KIND_PREY : KIND_HUNTER;
+    int this_x = sim->agents.x[idx], this_y = sim->agents.y[idx];
+    int bx = this_x >> sim->index.shift, by = this_y >> sim->index.shift;
+    int max_r = sim->index.rows > sim->index.cols ? sim->index.rows : sim->index.cols;
+    int min_dist = -1, min_idx = -1;
+    int r;
 
-    for (i = 0; i < map.width; i++) {
-        putchar('|');
-        for (j = 0; j < map.height; j++) {
-            printf("%c", grid_get_object(i, j)->represent());
+    assert(sim->index.count[kind] > 0);
+    for (r = 0; r < max_r; r++) {
+        int dx;
+        if (min_dist != -1 && min_dist <= (r - 1) << sim->index.shift) {
+            break;
+        }
+        for (dx = -r; dx <= r; dx++) {
+            int x = bx + dx;
+            int dy, step;
+            if (x < 0 || x >= sim->index.rows) {
+                continue;
+            }
+            /* Whole row on the top and bottom edges, two ends otherwise */
+            step = (dx == -r || dx == r) ? 1 : 2*r;
+            for (dy = -r; dy <= r; dy += step) {
+                int y = by + dy;
+                int i;
+                if (y < 0 || y >= sim->index.cols) {
+                    continue;
+                }
+                for (i = sim->index.head[kind][x*sim->index.cols + y]; i != -1;
+                        i = sim->index.next[i]) {
+                    int dist = abs(sim->agents.x[i] - this_x) + abs(sim->agents.y[i] - this_y);
+                    if (min_dist == -1 || dist < min_dist ||
+                            (dist == min_dist && i < min_idx)) {
+                        min_dist = dist;
+                        min_idx = i;
+                    }
+                }
+            }
         }
-        putchar('|');
-        putchar('\n');
     }
+    return min_idx;
+}
+
+/* Dead agents are parked at NEAREST_FAR, so the kernel needs no alive mask.
+ */
+static int closest_adversary_simd(int idx)
+{
+    int lo, hi;
+    adversary_run(sim->agents.kind[idx], &lo, &hi);
+    return lo + nearest(sim->agents.x + lo, sim->agents.y + lo, hi - lo,
+            sim->agents.x[idx], sim->agents.y[idx]);
+}
 
-    putchar('+');
-    for (i = 0; i < map.width; i++) {
-        putchar('-');
+static void check_adversary(int idx, int adv)
+{
+    if (sim->index.check && adv != closest_adversary_scan(idx)) {
+        die(ERR_INDEX);
     }
-    putchar('+');
-    putchar('\n');
 }
 
-void init_map(void)
+static int closest_adversary(int idx)
 {
-    init_grid();
-    init_obstacles();
-    init_hunters();
-    init_preys();
-    init_objects();
-    fayrapla();
-    send_initial_states();
-    print_map();
+    int adv;
+    if (sim->index.simd) {
+        adv = closest_adversary_simd(idx);
+    } else if (sim->index.enabled) {
+        adv = closest_adversary_grid(idx);
+    } else {
+        return closest_adversary_scan(idx);
+    }
+    check_adversary(idx, adv);
+    return adv;
 }
 
-void clean_map(void)
+/* Closest adversaries of agents [from, to), all of the same kind, with a
+ * single batch query.
+ */
+static void closest_adversary_batch(int from, int to, int *out)
 {
-    int i;
-    for (i = 0; i < map.n_hunters + map.n_preys; i++) {
-        struct map_object *object = map.objects[i];
-        if (object->pid > 0) {
-            if (kill(object->pid, SIGTERM) == -1) {
-                perror("run_simulation()");
-                die(ERR_KILL);
-            }
-            if (waitpid(object->pid, NULL, 0) == -1) {
-                perror("run_simulation()");
-                die(ERR_WAIT);
-            }
-            close(map.fds[object->idx].fd);
+    int i, lo, hi;
+    if (from == to) {
+        return;
+    }
+    adversary_run(sim->agents.kind[from], &lo, &hi);
+    nearest_batch(sim->agents.x + lo, sim->agents.y + lo, hi - lo,
+            sim->agents.x + from, sim->agents.y + from, to - from, out + from);
+    for (i = from; i < to; i++) {
+        out[i] += lo;
+        if (sim->agents.alive[i]) {
+            check_adversary(i, out[i]);
         }
     }
-    free(map.grid);
-    free(map.hunters);
-    free(map.preys);
-    free(map.objects);
-    free(map.fds);
 }
 
-void run_simulation(void)
+/* Next step along the distance field, downhill towards the preys for a
+ * hunter and uphill away from the hunters for a prey. Stays put if no
+ * neighbour is better, and leaves best_step unset if no adversary can be
+ * reached.
+ */
+static void field_step(int idx, struct server_message *state)
 {
-    int hunters_alive = map.n_hunters, preys_alive = map.n_preys;
-    int updated = 0;
-    while (hunters_alive && preys_alive) {
-        if (poll(map.fds, map.n_hunters + map.n_preys, -1) > 0) {
-            int i;
-            for (i = 0; i < map.n_hunters + map.n_preys; i++) {
-                int revents = map.fds[i].revents;
-                if (revents & POLLIN) {
-                    /* Data ready from a child */
-                    struct ph_message message;
-                    struct map_object *object;
-                    if (read(map.fds[i].fd, &message, sizeof message) != sizeof message) {
-                        die(ERR_READ);
-                    }
-                    object = map.objects[i];
-                    updated = object->handle_move(object, message.move_request.x,
-                            message.move_request.y);
-                }
-            }
+    enum object_kind kind = sim->agents.kind[idx];
+    struct field *field = &sim->field.to[kind == KIND_HUNTER ? KIND_PREY : KIND_HUNTER];
+    int x = sim->agents.x[idx], y = sim->agents.y[idx];
+    int i, best = field->dist[grid_idx_(x, y)];
+    if (best == FIELD_INF) {
+        return;
+    }
+    struct coordinate options[4] = { { x - 1, y }, { x, y + 1 }, { x + 1, y }, { x, y - 1 } };
+    state->best_step = state->pos;
+    for (i = 0; i < 4; i++) {
+        struct coordinate option = options[i];
+        if (option.x < 0 || option.x >= sim->height || option.y < 0 || option.y >= sim->width) {
+            continue;
         }
-
-        int i;
-        preys_alive = 0;
-        for (i = 0; i < map.n_preys; i++) {
-            struct map_object *prey = (struct map_object *)&map.preys[i];
-            if (prey->idx < 0) {
-                /* Already dead */
-                /* NOTHING */
-            } else if (prey->idx != grid_get_idx(prey->x, prey->y)) {
-                /* Hunter on prey */
-                if (kill(prey->pid, SIGTERM) == -1) {
-                    perror("run_simulation()");
-                    die(ERR_KILL);
-                }
-                if (waitpid(prey->pid, NULL, 0) == -1) {
-                    perror("run_simulation()");
-                    die(ERR_WAIT);
-                }
-                close(map.fds[prey->idx].fd);
-                map.fds[prey->idx].fd = -1;
-                prey->fd = -1;
-                prey->pid = -1;
-                /* Add prey energy to hunter */
-                grid_get_object(prey->x, prey->y)->energy += prey->energy;
-                /* Invalidate remaining attributes */
-                prey->x = -1;
-                prey->y = -1;
-                prey->idx = -1;
-                prey->energy = 0;
-
-                /* Map is updated */
-                updated = 1;
-            } else {
-                /* Alive */
-                preys_alive++;
-            }
-        }
-
-        hunters_alive = 0;
-        for (i = 0; i < map.n_hunters; i++) {
-            struct map_object *hunter = (struct map_object *)&map.hunters[i];
-            if (hunter->idx < 0) {
-                /* Already dead */
-                /* NOTHING */
-            } else if (hunter->energy == 0) {
-                /* Hunter died */
-                if (kill(hunter->pid, SIGTERM) == -1) {
-                    perror("run_simulation()");
-                    die(ERR_KILL);
-                }
-                if (waitpid(hunter->pid, NULL, 0) == -1) {
-                    perror("run_simulation()");
-                    die(ERR_WAIT);
-                }
-                close(map.fds[hunter->idx].fd);
-                map.fds[hunter->idx].fd = -1;
-                hunter->fd = -1;
-                hunter->pid = -1;
-                /* Update the grid */
-                grid_set(hunter->x, hunter->y, IDX_EMPTY);
-                /* Invalidate remaining attributes */
-                hunter->x = -1;
-                hunter->y = -1;
-                hunter->idx = -1;
-                hunter->energy = 0;
-
-                /* Map is updated */
-                updated = 1;
-            } else {
-                /* Alive */
-                hunters_alive++;
-            }
+        int target = grid_get_idx(option.x, option.y);
+        /* Preys do not step on hunters even though they may */
+        if (!move_possible(kind, target) || (kind == KIND_PREY && target != IDX_EMPTY)) {
+            continue;
         }
-
-        if (updated) {
-            print_map();
-            updated = 0;
+        int dist = field->dist[grid_idx_(option.x, option.y)];
+        if (kind == KIND_HUNTER ? dist < best : dist > best) {
+            best = dist;
+            state->best_step = option;
         }
     }
 }
 
-int main(void)
+/* Only reads the map, safe to run from band workers. The adversary is
+ * given by position, a shard may find it in another shard.
+ */
+static void build_state_at(int idx, struct coordinate adv_pos, struct server_message *message)
+{
+    enum object_kind kind = sim->agents.kind[idx];
+    int x = sim->agents.x[idx], y = sim->agents.y[idx];
+    struct server_message state;
+    memset(&state, 0xff, sizeof state);
+    state.pos.x = x;
+    state.pos.y = y;
+
+    /* Closest adversary */
+    state.adv_pos = adv_pos;
+
+    /* Neighbouring objects */
+    state.object_count = 0;
+    if (x - 1 > 0 && !move_possible(kind, grid_get_idx(x - 1, y))) {
+        struct coordinate coord = { x - 1, y };
+        state.object_pos[state.object_count++] = coord;
+    }
+    if (y + 1 < sim->width && !move_possible(kind, grid_get_idx(x, y + 1))) {
+        struct coordinate coord = { x, y + 1 };
+        state.object_pos[state.object_count++] = coord;
+    }
+    if (x + 1 < sim->height && !move_possible(kind, grid_get_idx(x + 1, y))) {
+        struct coordinate coord = { x + 1, y };
+        state.object_pos[state.object_count++] = coord;
+    }
+    if (y - 1 > 0 && !move_possible(kind, grid_get_idx(x, y - 1))) {
+        struct coordinate coord = { x, y - 1 };
+        state.object_pos[state.object_count++] = coord;
+    }
+    if (sim->field.enabled) {
+        field_step(idx, &state);
+    }
+    *message = state;
+}
+
+static void build_state(int idx, int adv, struct server_message *message)
 {
+    struct coordinate adv_pos = { sim->agents.x[adv], sim->agents.y[adv] };
+    build_state_at(idx, adv_pos, message);
+}
+
+static void send_built_state(int idx, const struct server_message *state)
+{
+    if (sim->bench.enabled) {
+        sim->bench.sent_at[idx] = now_ns();
+    }
+    if (sim->snapshot.sent) {
+        sim->snapshot.sent[idx] = *state;
+    }
+    sim->backend->send(idx, state);
+}
+
+static void send_state(int idx, int adv)
+{
+    struct server_message state;
+    build_state(idx, adv, &state);
+    send_built_state(idx, &state);
+}
+
+static void send_new_state(int idx)
+{
+    send_state(idx, closest_adversary(idx));
+}
+
+static void record_death(struct death_queue *deaths, enum death_kind kind, int idx)
+{
+    struct death_event event = { kind, idx };
+    deaths->events[deaths->count++] = event;
+}
+
+/* Must be called before the agent's position is updated.
+ */
+static void field_move(int idx, int x, int y)
+{
+    struct field *field = &sim->field.to[sim->agents.kind[idx]];
+    if (!sim->field.enabled || sim->bands.active ||
+            (sim->agents.x[idx] == x && sim->agents.y[idx] == y)) {
+        return;
+    }
+    /* Adding first keeps the removal from reaching far */
+    field_add(field, grid_idx_(x, y));
+    field_remove(field, grid_idx_(sim->agents.x[idx], sim->agents.y[idx]));
+    if (sim->index.check && !field_check(field)) {
+        die(ERR_INDEX);
+    }
+}
+
+static int hunter_apply_move(int idx, int x, int y, struct death_queue *deaths)
+{
+    int target = grid_get_idx(x, y);
+    int moved;
+    if (move_possible(KIND_HUNTER, target)) {
+        if (target >= 0) {
+            record_death(deaths, DEATH_CAPTURE, target);
+        }
+        /* Clear the old cell first, the hunter may be staying put on a
+         * prey that stomped over it
+         */
+        if (grid_get_idx(sim->agents.x[idx], sim->agents.y[idx]) == idx) {
+            grid_set(sim->agents.x[idx], sim->agents.y[idx], IDX_EMPTY);
+        } else {
+            /* someone (a prey) stomped over me, leave them */
+        }
+        grid_set(x, y, idx);
+        index_move(idx, x, y);
+        field_move(idx, x, y);
+        sim->agents.x[idx] = x;
+        sim->agents.y[idx] = y;
+        sim->agents.energy[idx]--;
+        if (sim->agents.energy[idx] == 0) {
+            record_death(deaths, DEATH_EXHAUSTION, idx);
+        }
+
+        moved = 1;
+    } else {
+        /* Move impossible */
+        moved = 0;
+    }
+    return moved;
+}
+
+static int prey_apply_move(int idx, int x, int y, struct death_queue *deaths)
+{
+    int target = grid_get_idx(x, y);
+    int moved;
+    /* Nobody dies on a prey's move */
+    (void)deaths;
+    if (move_possible(KIND_PREY, target)) {
+        grid_set(x, y, idx);
+        if (grid_get_idx(sim->agents.x[idx], sim->agents.y[idx]) == idx) {
+            grid_set(sim->agents.x[idx], sim->agents.y[idx], IDX_EMPTY);
+        } else {
+            assert(sim->agents.kind[grid_get_idx(sim->agents.x[idx], sim->agents.y[idx])] ==
+                    KIND_HUNTER);
+            /* someone (a hunter) stomped over me, leave them */
+        }
+        index_move(idx, x, y);
+        field_move(idx, x, y);
+        sim->agents.x[idx] = x;
+        sim->agents.y[idx] = y;
+
+        moved = 1;
+    } else {
+        /* Move impossible */
+        moved = 0;
+    }
+    return moved;
+}
+
+/* Updates the map without telling the agent, returns whether it moved.
+ * Deaths are queued on deaths for the caller to settle.
+ */
+static int apply_move(int idx, int x, int y, struct death_queue *deaths)
+{
+    switch (sim->agents.kind[idx]) {
+        case KIND_HUNTER:
+            return hunter_apply_move(idx, x, y, deaths);
+        case KIND_PREY:
+            return prey_apply_move(idx, x, y, deaths);
+    }
+    return 0;
+}
+
+/* apply_move() that also records the move in log, if there is one. Moves
+ * the map turns down are recorded too, ./replay turns them down the same
+ * way, so its move counts are the server's.
+ */
+static int apply_logged(struct movelog_buf *log, int idx, int x, int y,
+        struct death_queue *deaths)
+{
+    if (log) {
+        movelog_move(log, idx, x - sim->agents.x[idx], y - sim->agents.y[idx]);
+    }
+    return apply_move(idx, x, y, deaths);
+}
+
+static struct movelog_buf *main_log(void)
+{
+    return sim->log.fd != -1 ? &sim->log.buf : NULL;
+}
+
+static int handle_move(int idx, int x, int y)
+{
+    int moved = apply_logged(main_log(), idx, x, y, &sim->deaths);
+    send_new_state(idx);
+    return moved;
+}
+
+/* Grid for rows [row_base, row_base + rows) */
+static void grid_alloc(int row_base, int rows)
+{
+    sim->row_base = row_base;
+    sim->rows = rows;
+    /* Empty spots, rows are x in [0, height) and columns y in [0, width) */
+    tiles_init(&sim->grid, rows, sim->width);
+}
+
+static void init_grid(void)
+{
+    int width, height;
+    /* Get map dimensions and create grid */
+    if (fscanf(sim->input, "%d %d", &width, &height) != 2 || width < 1 || height < 1) {
+        die(ERR_INPUT);
+    }
+    sim->width = width;
+    sim->height = height;
+    grid_alloc(0, height);
+}
+
+static void init_obstacles(void)
+{
+    int i;
+    int n_obstacles;
+    if (fscanf(sim->input, "%d", &n_obstacles) != 1) {
+        die(ERR_INPUT);
+    }
+    for (i = 0; i < n_obstacles; i++) {
+        int x, y;
+        if (fscanf(sim->input, "%d %d", &x, &y) != 2) {
+            die(ERR_INPUT);
+        }
+        grid_set(x, y, IDX_OBSTACLE);
+    }
+}
+
+static void agents_resize(int n)
+{
+    sim->agents.x = realloc(sim->agents.x, n * sizeof *sim->agents.x);
+    sim->agents.y = realloc(sim->agents.y, n * sizeof *sim->agents.y);
+    sim->agents.energy = realloc(sim->agents.energy, n * sizeof *sim->agents.energy);
+    sim->agents.kind = realloc(sim->agents.kind, n * sizeof *sim->agents.kind);
+    sim->agents.alive = realloc(sim->agents.alive, n * sizeof *sim->agents.alive);
+    sim->agents.fd = realloc(sim->agents.fd, n * sizeof *sim->agents.fd);
+    sim->agents.pid = realloc(sim->agents.pid, n * sizeof *sim->agents.pid);
+}
+
+static void init_agent(int idx, enum object_kind kind)
+{
+    int x, y, energy;
+    if (fscanf(sim->input, "%d %d %d", &x, &y, &energy) != 3 ||
+            x < 0 || x >= sim->height || y < 0 || y >= sim->width || energy < 0) {
+        die(ERR_INPUT);
+    }
+    sim->agents.x[idx] = x;
+    sim->agents.y[idx] = y;
+    sim->agents.energy[idx] = energy;
+    sim->agents.kind[idx] = kind;
+    sim->agents.alive[idx] = 1;
+    sim->agents.fd[idx] = -1;
+    sim->agents.pid[idx] = -1;
+}
+
+static void init_hunters(void)
+{
+    int i;
+    if (fscanf(sim->input, "%d", &sim->n_hunters) != 1) {
+        die(ERR_INPUT);
+    }
+    agents_resize(sim->n_hunters);
+    for (i = 0; i < sim->n_hunters; i++) {
+        init_agent(i, KIND_HUNTER);
+    }
+}
+
+static void init_preys(void)
+{
+    int i;
+    if (fscanf(sim->input, "%d", &sim->n_preys) != 1) {
+        die(ERR_INPUT);
+    }
+    agents_resize(sim->n_hunters + sim->n_preys);
+    for (i = sim->n_hunters; i < sim->n_hunters + sim->n_preys; i++) {
+        init_agent(i, KIND_PREY);
+    }
+}
+
+/* Picks a snapshot up where it was taken. The virtual clock and the
+ * states to send again are copied, the mapping goes away after loading.
+ */
+static void restore_state(void)
+{
+    const struct scenario_state *state = sim->scenario.state;
+    int i, n_objects = sim->n_hunters + sim->n_preys;
+    for (i = 0; i < n_objects; i++) {
+        if (!sim->scenario.alive[i]) {
+            sim->agents.alive[i] = 0;
+            sim->agents.energy[i] = 0;
+            sim->agents.x[i] = NEAREST_FAR;
+            sim->agents.y[i] = NEAREST_FAR;
+        }
+    }
+    sim->clock.rng.state = state->rng;
+    sim->clock.now = state->now;
+    sim->clock.seq = state->seq;
+    sim->bench.moves = state->moves;
+    sim->bench.preys_caught = state->preys_caught;
+    sim->bench.hunters_exhausted = state->hunters_exhausted;
+    sim->lockstep.ticks = state->ticks;
+    /* Still a heap */
+    sim->clock.events = malloc(n_objects * sizeof *sim->clock.events);
+    sim->clock.n_events = state->n_events;
+    for (i = 0; i < state->n_events; i++) {
+        struct sim_event event = { sim->scenario.events[i].time, sim->scenario.events[i].seq,
+            sim->scenario.events[i].idx };
+        sim->clock.events[i] = event;
+    }
+    sim->snapshot.sent = malloc(n_objects * sizeof *sim->snapshot.sent);
+    memcpy(sim->snapshot.sent, sim->scenario.sent, n_objects * sizeof *sim->snapshot.sent);
+    sim->snapshot.restored = 1;
+}
+
+/* Binary counterpart of init_grid() to init_preys() */
+static void init_scenario(void)
+{
+    const struct scenario_header *header;
+    int i;
+    if (scenario_load(sim->input, &sim->scenario) == -1) {
+        die(ERR_INPUT);
+    }
+    header = sim->scenario.header;
+    sim->width = header->width;
+    sim->height = header->height;
+    grid_alloc(0, sim->height);
+    tiles_load_obstacles(&sim->grid, sim->scenario.obstacles,
+            scenario_row_words(sim->width));
+    sim->n_hunters = header->n_hunters;
+    sim->n_preys = header->n_preys;
+    agents_resize(sim->n_hunters + sim->n_preys);
+    for (i = 0; i < sim->n_hunters + sim->n_preys; i++) {
+        sim->agents.x[i] = sim->scenario.agents[i].x;
+        sim->agents.y[i] = sim->scenario.agents[i].y;
+        sim->agents.energy[i] = sim->scenario.agents[i].energy;
+        sim->agents.kind[i] = i < sim->n_hunters ? KIND_HUNTER : KIND_PREY;
+        sim->agents.alive[i] = 1;
+        sim->agents.fd[i] = -1;
+        sim->agents.pid[i] = -1;
+    }
+    if (sim->scenario.state) {
+        restore_state();
+    }
+}
+
+/* Binary if the input starts with the magic, text otherwise */
+static void read_scenario(void)
+{
+    int c = getc(sim->input);
+    ungetc(c, sim->input);
+    if (c == SCENARIO_MAGIC[0]) {
+        init_scenario();
+        return;
+    }
+    init_grid();
+    init_obstacles();
+    init_hunters();
+    init_preys();
+}
+
+static void init_agents(void)
+{
+    int i;
+    /* A move queues at most a capture and an exhaustion, on top of the
+     * hunters that start out with no energy
+     */
+    sim->deaths.events = malloc((sim->n_hunters + 2) * sizeof *sim->deaths.events);
+    sim->deaths.count = 0;
+    sim->hunters_alive = 0;
+    sim->preys_alive = 0;
+    for (i = 0; i < sim->n_hunters + sim->n_preys; i++) {
+        if (!sim->agents.alive[i]) {
+            /* Died before a snapshot */
+            continue;
+        }
+        if (sim->agents.kind[i] == KIND_HUNTER) {
+            sim->hunters_alive++;
+        } else {
+            sim->preys_alive++;
+        }
+        grid_set(sim->agents.x[i], sim->agents.y[i], i);
+        if (sim->agents.kind[i] == KIND_HUNTER && sim->agents.energy[i] == 0) {
+            record_death(&sim->deaths, DEATH_EXHAUSTION, i);
+        }
+    }
+}
+
+static void init_index(void)
+{
+    int i, n_objects = sim->n_hunters + sim->n_preys;
+    long cells_per_object = (long)sim->width * sim->height / (n_objects ? n_objects : 1);
+    /* Aim for a couple of agents of each kind per bucket */
+    sim->index.shift = 2;
+    while (sim->index.shift < 10 && (1L << 2*sim->index.shift) < 2*cells_per_object) {
+        sim->index.shift++;
+    }
+    sim->index.rows = ((sim->height - 1) >> sim->index.shift) + 1;
+    sim->index.cols = ((sim->width - 1) >> sim->index.shift) + 1;
+    for (i = 0; i < 2; i++) {
+        int j;
+        sim->index.head[i] = malloc(sim->index.rows * sim->index.cols * sizeof *sim->index.head[i]);
+        for (j = 0; j < sim->index.rows * sim->index.cols; j++) {
+            sim->index.head[i][j] = -1;
+        }
+        sim->index.count[i] = 0;
+    }
+    sim->index.next = malloc(n_objects * sizeof *sim->index.next);
+    sim->index.prev = malloc(n_objects * sizeof *sim->index.prev);
+    for (i = 0; i < n_objects; i++) {
+        if (sim->agents.alive[i]) {
+            index_insert(i, sim->agents.x[i], sim->agents.y[i]);
+        }
+    }
+}
+
+static void init_field(void)
+{
+    int i, x, y;
+    sim->field.blocked = malloc((size_t)sim->width * sim->height);
+    for (x = 0; x < sim->height; x++) {
+        for (y = 0; y < sim->width; y++) {
+            sim->field.blocked[grid_idx_(x, y)] = grid_get_idx(x, y) == IDX_OBSTACLE;
+        }
+    }
+    field_init(&sim->field.to[KIND_HUNTER], sim->width, sim->height, sim->field.blocked);
+    field_init(&sim->field.to[KIND_PREY], sim->width, sim->height, sim->field.blocked);
+    for (i = 0; i < sim->n_hunters + sim->n_preys; i++) {
+        if (sim->agents.alive[i]) {
+            sim->field.to[sim->agents.kind[i]].sources[grid_idx_(sim->agents.x[i], sim->agents.y[i])]++;
+        }
+    }
+    field_build(&sim->field.to[KIND_HUNTER]);
+    field_build(&sim->field.to[KIND_PREY]);
+}
+
+/* SIGCHLD is blocked and read from a signalfd that the event backends
+ * watch next to the agents, so killed agents never stall the main loop.
+ */
+static void reap_init(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, &sim->reap.old_mask) == -1) {
+        perror("reap_init()");
+        die(ERR_WAIT);
+    }
+    sim->reap.sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sim->reap.sfd == -1) {
+        perror("reap_init()");
+        die(ERR_WAIT);
+    }
+}
+
+/* Returns 1 for an agent or host that exited without being signalled, its
+ * pid is cleared so that nobody signals it once reaped. Signalled children
+ * already had their pid cleared and are counted in reap.pending instead.
+ */
+static int reap_unsignalled(pid_t pid)
+{
+    int i;
+    for (i = 0; i < sim->n_hunters + sim->n_preys; i++) {
+        if (sim->agents.pid[i] == pid) {
+            sim->agents.pid[i] = -1;
+            return 1;
+        }
+    }
+    for (i = 0; sim->host.per_host && i < sim->host.n_hosts; i++) {
+        if (sim->host.pid[i] == pid) {
+            sim->host.pid[i] = -1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Reaps whatever has exited, never blocks.
+ */
+static void reap_children(void)
+{
+    struct signalfd_siginfo info;
+    pid_t pid;
+    /* SIGCHLDs coalesce, so drain the fd and then wait for everyone */
+    while (read(sim->reap.sfd, &info, sizeof info) == sizeof info) {
+        /* NOTHING */
+    }
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (!reap_unsignalled(pid)) {
+            sim->reap.pending--;
+        }
+    }
+    if (pid == -1 && errno != ECHILD) {
+        perror("reap_children()");
+        die(ERR_WAIT);
+    }
+}
+
+static void reap_clean(void)
+{
+    close(sim->reap.sfd);
+    sigprocmask(SIG_SETMASK, &sim->reap.old_mask, NULL);
+}
+
+/* Leases live agents from ./agentd instead of starting them, and resets
+ * them for this map. Whatever they still had to say to the last server is
+ * read and dropped.
+ */
+static void agentd_attach(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int i, got = 0, n_objects = sim->n_hunters + sim->n_preys;
+    struct agentd_request request = { sim->n_hunters, sim->n_preys };
+    strncpy(addr.sun_path, sim->agentd.path, sizeof addr.sun_path - 1);
+    sim->agentd.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sim->agentd.fd == -1 ||
+            connect(sim->agentd.fd, (struct sockaddr *)&addr, sizeof addr) == -1 ||
+            write(sim->agentd.fd, &request, sizeof request) != sizeof request) {
+        perror("agentd_attach()");
+        die(ERR_SOCKET);
+    }
+    while (got < n_objects) {
+        char control[CMSG_SPACE(AGENTD_FDS_PER_MSG * sizeof(int))];
+        char byte;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof control,
+        };
+        struct cmsghdr *cmsg;
+        if (recvmsg(sim->agentd.fd, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+                (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+            fprintf(stderr, "agentd_attach(): no agents from %s\n", sim->agentd.path);
+            die(ERR_SOCKET);
+        }
+        int n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n_fds && got < n_objects; i++) {
+            sim->agents.fd[got++] = ((int *)CMSG_DATA(cmsg))[i];
+        }
+    }
+
+    for (i = 0; i < n_objects; i++) {
+        struct server_message reset;
+        if (!sim->agents.alive[i]) {
+            /* Died before a snapshot, stays idle */
+            close(sim->agents.fd[i]);
+            sim->agents.fd[i] = -1;
+            continue;
+        }
+        memset(&reset, 0, sizeof reset);
+        reset.object_count = AGENT_RESET;
+        reset.pos.x = sim->width;
+        reset.pos.y = sim->height;
+        reset.adv_pos.x = sim->seeded ? sim->seed + i : (unsigned)time(NULL) + i;
+        reset.adv_pos.y = sim->paced;
+        /* An agent that died in the pool must not take us with it */
+        if (send(sim->agents.fd[i], &reset, sizeof reset, MSG_NOSIGNAL) != sizeof reset) {
+            perror("agentd_attach()");
+            fprintf(stderr, "agentd_attach(): leased agent %d is gone\n", i);
+            die(ERR_SOCKET);
+        }
+    }
+    /* All at once, a paced agent may still be sleeping off its last move */
+    for (i = 0; i < n_objects; i++) {
+        struct ph_message ack;
+        if (sim->agents.fd[i] == -1) {
+            continue;
+        }
+        do {
+            if (read(sim->agents.fd[i], &ack, sizeof ack) != sizeof ack) {
+                fprintf(stderr, "agentd_attach(): leased agent %d is gone\n", i);
+                die(ERR_SOCKET);
+            }
+        } while (ack.move_request.x != -1 || ack.move_request.y != -1);
+    }
+}
+
+/* Agents are spawned by up to SPAWN_THREADS threads, each taking the next
+ * SPAWN_BATCH agents until none are left.
+ */
+#define SPAWN_THREADS 8
+#define SPAWN_BATCH 64
+
+static void *spawn_worker(void *arg)
+{
+    _Atomic int *next = arg;
+    int n_objects = sim->n_hunters + sim->n_preys;
+    for (;;) {
+        int i, from = atomic_fetch_add(next, SPAWN_BATCH);
+        if (from >= n_objects) {
+            return NULL;
+        }
+        for (i = from; i < from + SPAWN_BATCH && i < n_objects; i++) {
+            if (sim->agents.alive[i]) {
+                agent_spawn(i);
+            }
+        }
+    }
+}
+
+static void spawn_all(void)
+{
+    int i, n_threads = (sim->n_hunters + sim->n_preys + SPAWN_BATCH - 1) / SPAWN_BATCH;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t threads[SPAWN_THREADS];
+    _Atomic int next = 0;
+    if (n_threads > SPAWN_THREADS) {
+        n_threads = SPAWN_THREADS;
+    }
+    if (n_threads > n_cpus) {
+        n_threads = n_cpus;
+    }
+    /* The calling thread takes batches too */
+    for (i = 1; i < n_threads; i++) {
+        sim_thread_create(&threads[i], spawn_worker, &next);
+    }
+    spawn_worker(&next);
+    for (i = 1; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void fayrapla(void)
+{
+    int i, n_objects = sim->n_hunters + sim->n_preys;
+    sim->fds = malloc((n_objects + 1) * sizeof *sim->fds);
+    sim->channels = malloc(n_objects * sizeof *sim->channels);
+    reap_init();
+    if (sim->agentd.path) {
+        agentd_attach();
+    } else {
+        spawn_all();
+    }
+    for (i = 0; i < n_objects; i++) {
+        sim->bench.spawned += sim->agents.alive[i];
+        /* poll() skips the negative fds of the dead */
+        sim->fds[i].fd = sim->agents.fd[i];
+        sim->fds[i].events = POLLIN;
+    }
+    sim->fds[i].fd = sim->reap.sfd;
+    sim->fds[i].events = POLLIN;
+}
+
+static void transport_send(int idx, const struct server_message *state)
+{
+    sim->transport->send(idx, state);
+}
+
+static void fd_receive(int idx, struct agent_move *move)
+{
+    struct pollfd pfd = { .fd = sim->agents.fd[idx], .events = POLLIN };
+    for (;;) {
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("fd_receive()");
+            die(ERR_POLL);
+        }
+        if (sim->transport->receive(idx, move, 1) == 1) {
+            return;
+        }
+    }
+}
+
+static void poll_init(void)
+{
+    /* sim->fds is already set up by fayrapla() */
+}
+
+static int poll_wait(struct agent_move *moves, int max)
+{
+    int n_objects = sim->n_hunters + sim->n_preys;
+    int i, n_ready, n_moves = 0;
+    while (n_moves == 0) {
+        /* The signalfd sits right after the agents */
+        n_ready = poll(sim->fds, n_objects + 1, render_timeout_ms());
+        if (n_ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll_wait()");
+            die(ERR_POLL);
+        }
+        if (n_ready == 0) {
+            /* A held back frame is due */
+            break;
+        }
+        if (sim->fds[n_objects].revents & POLLIN) {
+            reap_children();
+        }
+        for (i = 0; i < n_objects && n_moves < max; i++) {
+            if (sim->fds[i].revents & POLLIN) {
+                n_moves += sim->transport->receive(i, &moves[n_moves], max - n_moves);
+            }
+        }
+    }
+    return n_moves;
+}
+
+static void poll_remove(int idx)
+{
+    /* poll() ignores negative fds */
+    sim->fds[idx].fd = -1;
+}
+
+static void poll_clean(void)
+{
+}
+
+static const struct event_backend poll_backend = {
+    .init = poll_init,
+    .send = transport_send,
+    .wait = poll_wait,
+    .receive = fd_receive,
+    .remove = poll_remove,
+    .clean = poll_clean,
+};
+
+static void epoll_init(void)
+{
+    int i;
+    sim->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sim->epfd == -1) {
+        perror("epoll_init()");
+        die(ERR_POLL);
+    }
+    sim->events = malloc((sim->n_hunters + sim->n_preys + 1) * sizeof *sim->events);
+    /* Level-triggered, one message is read per readiness */
+    for (i = 0; i < sim->n_hunters + sim->n_preys + 1; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+        if (sim->fds[i].fd == -1) {
+            continue;
+        }
+        if (epoll_ctl(sim->epfd, EPOLL_CTL_ADD, sim->fds[i].fd, &ev) == -1) {
+            perror("epoll_init()");
+            die(ERR_POLL);
+        }
+    }
+}
+
+static int epoll_wait_moves(struct agent_move *moves, int max)
+{
+    int n_objects = sim->n_hunters + sim->n_preys;
+    int i, n_ready, n_moves = 0;
+    while (n_moves == 0) {
+        do {
+            n_ready = epoll_wait(sim->epfd, sim->events, max, render_timeout_ms());
+        } while (n_ready == -1 && errno == EINTR);
+        if (n_ready == -1) {
+            perror("epoll_wait_moves()");
+            die(ERR_POLL);
+        }
+        if (n_ready == 0) {
+            /* A held back frame is due */
+            break;
+        }
+        for (i = 0; i < n_ready && n_moves < max; i++) {
+            int idx = sim->events[i].data.u32;
+            if (idx == n_objects) {
+                reap_children();
+            } else {
+                n_moves += sim->transport->receive(idx, &moves[n_moves], max - n_moves);
+            }
+        }
+    }
+    return n_moves;
+}
+
+static void epoll_remove(int idx)
+{
+    if (epoll_ctl(sim->epfd, EPOLL_CTL_DEL, sim->fds[idx].fd, NULL) == -1) {
+        perror("epoll_remove()");
+        die(ERR_POLL);
+    }
+    sim->fds[idx].fd = -1;
+}
+
+static void epoll_clean(void)
+{
+    close(sim->epfd);
+    free(sim->events);
+}
+
+static const struct event_backend epoll_backend = {
+    .init = epoll_init,
+    .send = transport_send,
+    .wait = epoll_wait_moves,
+    .receive = fd_receive,
+    .remove = epoll_remove,
+    .clean = epoll_clean,
+};
+
+/* io_uring backend, driven through the raw syscalls. Every live agent has a
+ * receive posted at all times and states go out as sends, so a wait()
+ * submits the whole batch and collects every reply already in with a
+ * single io_uring_enter(). The reap signalfd is watched with a multishot
+ * poll. user_data is the request kind in the high half and the agent in
+ * the low half.
+ */
+enum uring_op {
+    URING_RECEIVE = 1,
+    URING_SEND,
+    URING_CANCEL,
+    URING_REAP,
+};
+
+#define URING_DATA(op, idx) ((uint64_t)(op) << 32 | (uint32_t)(idx))
+
+static int uring_cq_ready(void)
+{
+    return *sim->uring.cq_head != __atomic_load_n(sim->uring.cq_tail, __ATOMIC_ACQUIRE);
+}
+
+/* Hands the queued SQEs to the kernel, then if wait is set blocks until
+ * there is at least one completion, or for at most timeout_ms unless that is
+ * -1. Returns 0 if the wait timed out.
+ */
+static int uring_submit(int wait, int timeout_ms)
+{
+    struct __kernel_timespec ts = { timeout_ms / 1000, timeout_ms % 1000 * 1000000LL };
+    struct io_uring_getevents_arg arg = { .ts = (uintptr_t)&ts };
+    __atomic_store_n(sim->uring.sq_tail, sim->uring.tail, __ATOMIC_RELEASE);
+    for (;;) {
+        int wait_cqe = wait && !uring_cq_ready();
+        int timed = wait_cqe && timeout_ms >= 0 && sim->uring.ext_arg;
+        if (sim->uring.to_submit == 0 && !wait_cqe) {
+            return 1;
+        }
+        /* Completions are only posted from in here, see uring_init() */
+        int n = syscall(__NR_io_uring_enter, sim->uring.fd, sim->uring.to_submit,
+                wait_cqe, (wait ? IORING_ENTER_GETEVENTS : 0) | (timed ? IORING_ENTER_EXT_ARG : 0),
+                timed ? (void *)&arg : NULL, timed ? sizeof arg : 0);
+        sim->uring.enters++;
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ETIME && timed) {
+                return 0;
+            }
+            perror("uring_submit()");
+            die(ERR_POLL);
+        }
+        sim->uring.to_submit -= n;
+        sim->uring.submitted += n;
+        if (sim->uring.to_submit == 0) {
+            return 1;
+        }
+    }
+}
+
+static struct io_uring_sqe *uring_sqe(void)
+{
+    if (sim->uring.tail - __atomic_load_n(sim->uring.sq_head, __ATOMIC_ACQUIRE) ==
+            sim->uring.sq_entries) {
+        uring_submit(0, -1);
+    }
+    struct io_uring_sqe *sqe = &sim->uring.sqes[sim->uring.tail++ & sim->uring.sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    sim->uring.to_submit++;
+    sim->uring.in_flight++;
+    return sqe;
+}
+
+static void uring_cancel(uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data;
+    sqe->user_data = URING_DATA(URING_CANCEL, 0);
+}
+
+/* Turns the receives to post again and the queued states into SQEs */
+static void uring_prepare(void)
+{
+    int i;
+    for (i = 0; i < sim->uring.n_rearm; i++) {
+        int idx = sim->uring.rearm[i];
+        if (sim->uring.removed[idx]) {
+            continue;
+        }
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sim->agents.fd[idx];
+        sqe->addr = (uintptr_t)&sim->uring.in[idx];
+        sqe->len = sizeof *sim->uring.in;
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->user_data = URING_DATA(URING_RECEIVE, idx);
+        sim->uring.receiving[idx] = 1;
+    }
+    sim->uring.n_rearm = 0;
+    for (i = 0; i < sim->uring.n_outbox; i++) {
+        int idx = sim->uring.outbox[i];
+        if (sim->uring.removed[idx]) {
+            continue;
+        }
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = sim->agents.fd[idx];
+        sqe->addr = (uintptr_t)&sim->uring.out[idx];
+        sqe->len = sizeof *sim->uring.out;
+        /* A dead agent shows up as a completion, not as SIGPIPE */
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = URING_DATA(URING_SEND, idx);
+    }
+    sim->uring.n_outbox = 0;
+    if (!sim->uring.reap_armed) {
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = sim->reap.sfd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = URING_DATA(URING_REAP, 0);
+        sim->uring.reap_armed = 1;
+    }
+}
+
+/* Takes completions off the CQ, at most max of them replies */
+static int uring_reap(struct agent_move *moves, int max)
+{
+    unsigned head = *sim->uring.cq_head;
+    unsigned tail = __atomic_load_n(sim->uring.cq_tail, __ATOMIC_ACQUIRE);
+    int n_moves = 0;
+    for (; head != tail && n_moves < max; head++) {
+        const struct io_uring_cqe *cqe = &sim->uring.cqes[head & sim->uring.cq_mask];
+        int idx = (uint32_t)cqe->user_data;
+        /* A multishot poll keeps going as long as it says so */
+        if (cqe->user_data >> 32 != URING_REAP || !(cqe->flags & IORING_CQE_F_MORE)) {
+            sim->uring.in_flight--;
+        }
+        switch (cqe->user_data >> 32) {
+            case URING_RECEIVE:
+                sim->uring.receiving[idx] = 0;
+                if (sim->uring.removed[idx]) {
+                    break;
+                }
+                if (cqe->res != sizeof *sim->uring.in) {
+                    die(ERR_READ);
+                }
+                moves[n_moves].idx = idx;
+                moves[n_moves].message = sim->uring.in[idx];
+                n_moves++;
+                sim->uring.rearm[sim->uring.n_rearm++] = idx;
+                break;
+            case URING_SEND:
+                if (!sim->uring.removed[idx] && cqe->res != sizeof *sim->uring.out) {
+                    die(ERR_WRITE);
+                }
+                break;
+            case URING_REAP:
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    sim->uring.reap_armed = 0;
+                }
+                reap_children();
+                break;
+        }
+    }
+    __atomic_store_n(sim->uring.cq_head, head, __ATOMIC_RELEASE);
+    return n_moves;
+}
+
+static void *uring_map(size_t size, off_t offset)
+{
+    void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            sim->uring.fd, offset);
+    if (ring == MAP_FAILED) {
+        perror("uring_init()");
+        die(ERR_POLL);
+    }
+    return ring;
+}
+
+/* Falls back to epoll when the kernel has no io_uring or does not let us
+ * use it.
+ */
+static void uring_init(void)
+{
+    int i, n_objects = sim->n_hunters + sim->n_preys;
+    struct io_uring_params params;
+    unsigned entries = 1;
+    /* Room for a receive, a send and the reap poll per agent, the SQ is
+     * flushed early if it ever fills up
+     */
+    while (entries < 2 * (unsigned)n_objects + 1) {
+        entries *= 2;
+    }
+    /* Only the simulation's thread ever submits, and completions wait for
+     * it to ask instead of interrupting the agents' replies
+     */
+    memset(&params, 0, sizeof params);
+    params.flags = IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL |
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    sim->uring.fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (sim->uring.fd == -1 && errno == EINVAL) {
+        /* Older kernels */
+        memset(&params, 0, sizeof params);
+        params.flags = IORING_SETUP_CLAMP;
+        sim->uring.fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (sim->uring.fd == -1) {
+        fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(errno));
+        sim->backend = &epoll_backend;
+        epoll_init();
+        return;
+    }
+
+    sim->uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    sim->uring.cq_ring_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (sim->uring.cq_ring_size > sim->uring.sq_ring_size) {
+            sim->uring.sq_ring_size = sim->uring.cq_ring_size;
+        }
+        sim->uring.sq_ring = uring_map(sim->uring.sq_ring_size, IORING_OFF_SQ_RING);
+        sim->uring.cq_ring = sim->uring.sq_ring;
+        sim->uring.cq_ring_size = 0;
+    } else {
+        sim->uring.sq_ring = uring_map(sim->uring.sq_ring_size, IORING_OFF_SQ_RING);
+        sim->uring.cq_ring = uring_map(sim->uring.cq_ring_size, IORING_OFF_CQ_RING);
+    }
+    sim->uring.ext_arg = (params.features & IORING_FEAT_EXT_ARG) != 0;
+    sim->uring.sqes_size = params.sq_entries * sizeof *sim->uring.sqes;
+    sim->uring.sqes = uring_map(sim->uring.sqes_size, IORING_OFF_SQES);
+    char *sq = sim->uring.sq_ring, *cq = sim->uring.cq_ring;
+    sim->uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    sim->uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sim->uring.sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sim->uring.sq_entries = params.sq_entries;
+    sim->uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    sim->uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    sim->uring.cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    sim->uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    /* SQ slot i always holds SQE i */
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (i = 0; i < (int)params.sq_entries; i++) {
+        array[i] = i;
+    }
+    sim->uring.tail = *sim->uring.sq_tail;
+
+    sim->uring.in = malloc(n_objects * sizeof *sim->uring.in);
+    sim->uring.out = malloc(n_objects * sizeof *sim->uring.out);
+    sim->uring.receiving = calloc(n_objects, sizeof *sim->uring.receiving);
+    sim->uring.removed = calloc(n_objects, sizeof *sim->uring.removed);
+    sim->uring.rearm = malloc(n_objects * sizeof *sim->uring.rearm);
+    sim->uring.outbox = malloc(n_objects * sizeof *sim->uring.outbox);
+    sim->uring.mailbox = malloc(2 * n_objects * sizeof *sim->uring.mailbox);
+    sim->uring.has_mail = calloc(n_objects, sizeof *sim->uring.has_mail);
+    for (i = 0; i < n_objects; i++) {
+        if (sim->agents.fd[i] == -1) {
+            sim->uring.removed[i] = 1;
+        } else {
+            sim->uring.rearm[sim->uring.n_rearm++] = i;
+        }
+    }
+}
+
+static void uring_send(int idx, const struct server_message *state)
+{
+    /* Every agent has at most one state in flight */
+    assert(sim->uring.n_outbox < sim->n_hunters + sim->n_preys);
+    sim->uring.out[idx] = *state;
+    sim->uring.outbox[sim->uring.n_outbox++] = idx;
+}
+
+static int uring_wait(struct agent_move *moves, int max)
+{
+    int n_moves = 0, waited = 1;
+    while (n_moves == 0 && waited) {
+        uring_prepare();
+        waited = uring_submit(1, render_timeout_ms());
+        n_moves = uring_reap(moves, max);
+    }
+    return n_moves;
+}
+
+static void uring_receive(int idx, struct agent_move *move)
+{
+    int n_objects = sim->n_hunters + sim->n_preys;
+    while (!sim->uring.has_mail[idx]) {
+        struct agent_move *moves = sim->uring.mailbox + n_objects;
+        int k, n_moves = uring_wait(moves, n_objects);
+        for (k = 0; k < n_moves; k++) {
+            sim->uring.mailbox[moves[k].idx] = moves[k];
+            sim->uring.has_mail[moves[k].idx] = 1;
+        }
+    }
+    *move = sim->uring.mailbox[idx];
+    sim->uring.has_mail[idx] = 0;
+}
+
+/* A reply that already came in is dropped by uring_reap(), a posted
+ * receive is cancelled before the agent's fd is closed and maybe reused
+ */
+static void uring_remove(int idx)
+{
+    sim->uring.removed[idx] = 1;
+    if (sim->uring.receiving[idx]) {
+        uring_cancel(URING_DATA(URING_RECEIVE, idx));
+    }
+}
+
+/* The kernel must be done with the buffers before they go, and agents going
+ * back to ./agentd must not be left with a receive posted
+ */
+static void uring_clean(void)
+{
+    int i;
+    for (i = 0; i < sim->n_hunters + sim->n_preys; i++) {
+        if (sim->uring.receiving[i] && !sim->uring.removed[i]) {
+            uring_cancel(URING_DATA(URING_RECEIVE, i));
+        }
+    }
+    if (sim->uring.reap_armed) {
+        uring_cancel(URING_DATA(URING_REAP, 0));
+    }
+    while (sim->uring.in_flight > 0) {
+        uring_submit(1, -1);
+        unsigned head = *sim->uring.cq_head;
+        unsigned tail = __atomic_load_n(sim->uring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &sim->uring.cqes[head & sim->uring.cq_mask];
+            if (cqe->user_data >> 32 != URING_REAP || !(cqe->flags & IORING_CQE_F_MORE)) {
+                sim->uring.in_flight--;
+            }
+        }
+        __atomic_store_n(sim->uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    munmap(sim->uring.sqes, sim->uring.sqes_size);
+    if (sim->uring.cq_ring != sim->uring.sq_ring) {
+        munmap(sim->uring.cq_ring, sim->uring.cq_ring_size);
+    }
+    munmap(sim->uring.sq_ring, sim->uring.sq_ring_size);
+    close(sim->uring.fd);
+    free(sim->uring.in);
+    free(sim->uring.out);
+    free(sim->uring.receiving);
+    free(sim->uring.removed);
+    free(sim->uring.rearm);
+    free(sim->uring.outbox);
+    free(sim->uring.mailbox);
+    free(sim->uring.has_mail);
+}
+
+static const struct event_backend uring_backend = {
+    .init = uring_init,
+    .send = uring_send,
+    .wait = uring_wait,
+    .receive = uring_receive,
+    .remove = uring_remove,
+    .clean = uring_clean,
+};
+
+/* Each worker takes a batch of jobs at a time to keep lock traffic low.
+ * Every agent has at most one state in flight, so both queues are bounded
+ * by the number of agents.
+ */
+#define POOL_BATCH 64
+
+static void *pool_worker(void *arg)
+{
+    int n_objects = sim->n_hunters + sim->n_preys;
+    struct agent_job batch[POOL_BATCH];
+    struct agent_move results[POOL_BATCH];
+    (void)arg;
+
+    for (;;) {
+        int i, n_batch = 0;
+        pthread_mutex_lock(&sim->pool.job_lock);
+        while (sim->pool.job_count == 0 && !sim->pool.stopping) {
+            pthread_cond_wait(&sim->pool.job_ready, &sim->pool.job_lock);
+        }
+        if (sim->pool.stopping) {
+            pthread_mutex_unlock(&sim->pool.job_lock);
+            return NULL;
+        }
+        while (sim->pool.job_count > 0 && n_batch < POOL_BATCH) {
+            batch[n_batch++] = sim->pool.jobs[sim->pool.job_head];
+            sim->pool.job_head = (sim->pool.job_head + 1) % n_objects;
+            sim->pool.job_count--;
+        }
+        pthread_mutex_unlock(&sim->pool.job_lock);
+
+        for (i = 0; i < n_batch; i++) {
+            agent_decide_fn decide = sim->agents.kind[batch[i].idx] == KIND_HUNTER ?
+                hunter_decide : prey_decide;
+            results[i].idx = batch[i].idx;
+            results[i].message.move_request = decide(&batch[i].state, sim->width, sim->height);
+        }
+
+        pthread_mutex_lock(&sim->pool.move_lock);
+        for (i = 0; i < n_batch; i++) {
+            int tail = (sim->pool.move_head + sim->pool.move_count) % n_objects;
+            sim->pool.moves[tail] = results[i];
+            sim->pool.move_count++;
+        }
+        pthread_cond_signal(&sim->pool.move_ready);
+        pthread_mutex_unlock(&sim->pool.move_lock);
+    }
+}
+
+static void pool_init(void)
+{
+    int i, n_objects = sim->n_hunters + sim->n_preys;
+    sim->pool.jobs = malloc(n_objects * sizeof *sim->pool.jobs);
+    sim->pool.moves = malloc(n_objects * sizeof *sim->pool.moves);
+    /* Second half is scratch space for pool_receive() */
+    sim->pool.mailbox = malloc(2 * n_objects * sizeof *sim->pool.mailbox);
+    sim->pool.has_mail = calloc(n_objects, sizeof *sim->pool.has_mail);
+    sim->pool.job_head = sim->pool.job_count = 0;
+    sim->pool.move_head = sim->pool.move_count = 0;
+    sim->pool.stopping = 0;
+    pthread_mutex_init(&sim->pool.job_lock, NULL);
+    pthread_cond_init(&sim->pool.job_ready, NULL);
+    pthread_mutex_init(&sim->pool.move_lock, NULL);
+    pthread_cond_init(&sim->pool.move_ready, NULL);
+    sim->pool.workers = malloc(sim->pool.n_workers * sizeof *sim->pool.workers);
+    for (i = 0; i < sim->pool.n_workers; i++) {
+        sim_thread_create(&sim->pool.workers[i], pool_worker, NULL);
+    }
+}
+
+static void pool_send(int idx, const struct server_message *state)
+{
+    int n_objects = sim->n_hunters + sim->n_preys;
+    pthread_mutex_lock(&sim->pool.job_lock);
+    int tail = (sim->pool.job_head + sim->pool.job_count) % n_objects;
+    sim->pool.jobs[tail].idx = idx;
+    sim->pool.jobs[tail].state = *state;
+    sim->pool.job_count++;
+    pthread_cond_signal(&sim->pool.job_ready);
+    pthread_mutex_unlock(&sim->pool.job_lock);
+}
+
+static int pool_wait(struct agent_move *moves, int max)
+{
+    int n_objects = sim->n_hunters + sim->n_preys;
+    int n_moves = 0;
+    pthread_mutex_lock(&sim->pool.move_lock);
+    while (sim->pool.move_count == 0) {
+        pthread_cond_wait(&sim->pool.move_ready, &sim->pool.move_lock);
+    }
+    while (sim->pool.move_count > 0 && n_moves < max) {
+        moves[n_moves++] = sim->pool.moves[sim->pool.move_head];
+        sim->pool.move_head = (sim->pool.move_head + 1) % n_objects;
+        sim->pool.move_count--;
+    }
+    pthread_mutex_unlock(&sim->pool.move_lock);
+    return n_moves;
+}
+
+static void pool_receive(int idx, struct agent_move *move)
+{
+    int n_objects = sim->n_hunters + sim->n_preys;
+    while (!sim->pool.has_mail[idx]) {
+        struct agent_move *moves = sim->pool.mailbox + n_objects;
+        int k, n_moves = pool_wait(moves, n_objects);
+        for (k = 0; k < n_moves; k++) {
+            sim->pool.mailbox[moves[k].idx] = moves[k];
+            sim->pool.has_mail[moves[k].idx] = 1;
+        }
+    }
+    *move = sim->pool.mailbox[idx];
+    sim->pool.has_mail[idx] = 0;
+}
+
+static void pool_remove(int idx)
+{
+    /* Replies still in flight are dropped by run_simulation() */
+    (void)idx;
+}
+
+static void pool_clean(void)
+{
+    int i;
+    pthread_mutex_lock(&sim->pool.job_lock);
+    sim->pool.stopping = 1;
+    pthread_cond_broadcast(&sim->pool.job_ready);
+    pthread_mutex_unlock(&sim->pool.job_lock);
+    for (i = 0; i < sim->pool.n_workers; i++) {
+        pthread_join(sim->pool.workers[i], NULL);
+    }
+    pthread_mutex_destroy(&sim->pool.job_lock);
+    pthread_cond_destroy(&sim->pool.job_ready);
+    pthread_mutex_destroy(&sim->pool.move_lock);
+    pthread_cond_destroy(&sim->pool.move_ready);
+    free(sim->pool.workers);
+    free(sim->pool.jobs);
+    free(sim->pool.moves);
+    free(sim->pool.mailbox);
+    free(sim->pool.has_mail);
+}
+
+static const struct event_backend pool_backend = {
+    .init = pool_init,
+    .send = pool_send,
+    .wait = pool_wait,
+    .receive = pool_receive,
+    .remove = pool_remove,
+    .clean = pool_clean,
+};
+
+/* Agents decided on the spot by the thread running the simulation, for the
+ * batch runner. Moves wait in sim.direct until the next wait().
+ */
+static void direct_init(void)
+{
+    sim->direct.moves = malloc((sim->n_hunters + sim->n_preys) * sizeof *sim->direct.moves);
+    sim->direct.n_moves = 0;
+}
+
+static void direct_send(int idx, const struct server_message *state)
+{
+    agent_decide_fn decide = sim->agents.kind[idx] == KIND_HUNTER ?
+        hunter_decide : prey_decide;
+    struct agent_move *move = &sim->direct.moves[sim->direct.n_moves++];
+    move->idx = idx;
+    move->message.move_request = decide(state, sim->width, sim->height);
+}
+
+static int direct_wait(struct agent_move *moves, int max)
+{
+    int n_moves = sim->direct.n_moves < max ? sim->direct.n_moves : max;
+    /* Every live agent has been sent a state it has not answered */
+    assert(n_moves > 0);
+    memcpy(moves, sim->direct.moves, n_moves * sizeof *moves);
+    sim->direct.n_moves -= n_moves;
+    memmove(sim->direct.moves, sim->direct.moves + n_moves,
+            sim->direct.n_moves * sizeof *moves);
+    return n_moves;
+}
+
+static void direct_receive(int idx, struct agent_move *move)
+{
+    int i;
+    for (i = 0; sim->direct.moves[i].idx != idx; i++) {
+        assert(i + 1 < sim->direct.n_moves);
+    }
+    *move = sim->direct.moves[i];
+    sim->direct.moves[i] = sim->direct.moves[--sim->direct.n_moves];
+}
+
+static void direct_remove(int idx)
+{
+    /* Moves already decided are dropped by accept_move() */
+    (void)idx;
+}
+
+static void direct_clean(void)
+{
+    free(sim->direct.moves);
+}
+
+static const struct event_backend direct_backend = {
+    .init = direct_init,
+    .send = direct_send,
+    .wait = direct_wait,
+    .receive = direct_receive,
+    .remove = direct_remove,
+    .clean = direct_clean,
+};
+
+/* Host mode, one process per_host agents. States are queued per host and
+ * written in one go right before the server waits for moves.
+ */
+static int host_of(int idx)
+{
+    if (idx < sim->n_hunters) {
+        return idx / sim->host.per_host;
+    }
+    return (sim->n_hunters + sim->host.per_host - 1) / sim->host.per_host +
+        (idx - sim->n_hunters) / sim->host.per_host;
+}
+
+static void host_spawn(int h)
+{
+    const char *path = sim->agents.kind[sim->host.first[h]] == KIND_HUNTER ?
+        "./hunter" : "./prey";
+    char *const mode[2] = { "-H", NULL };
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, PF_UNIX, sv) == -1) {
+        perror("host_spawn()");
+        die(ERR_SOCKET);
+    }
+    int child_fds[2] = { sv[1], sv[1] };
+    pid_t pid = agent_exec(path, mode, sim->seed + sim->host.first[h], child_fds);
+    close(sv[1]);
+    sim->host.fd[h] = sv[0];
+    sim->host.pid[h] = pid;
+    sim->bench.spawned++;
+}
+
+static void host_init(void)
+{
+    int h, i, n_objects = sim->n_hunters + sim->n_preys;
+    int per_host = sim->host.per_host;
+    int hunter_hosts = (sim->n_hunters + per_host - 1) / per_host;
+    sim->host.n_hosts = hunter_hosts + (sim->n_preys + per_host - 1) / per_host;
+    sim->host.first = malloc(sim->host.n_hosts * sizeof *sim->host.first);
+    sim->host.alive = calloc(sim->host.n_hosts, sizeof *sim->host.alive);
+    sim->host.fd = malloc(sim->host.n_hosts * sizeof *sim->host.fd);
+    sim->host.pid = malloc(sim->host.n_hosts * sizeof *sim->host.pid);
+    sim->host.out = malloc((size_t)sim->host.n_hosts * per_host * sizeof *sim->host.out);
+    sim->host.n_out = calloc(sim->host.n_hosts, sizeof *sim->host.n_out);
+    sim->host.in = malloc((size_t)sim->host.n_hosts * per_host * sizeof *sim->host.in);
+    sim->host.in_len = calloc(sim->host.n_hosts, sizeof *sim->host.in_len);
+    /* Second half is scratch space for host_receive() */
+    sim->host.mailbox = malloc(2 * n_objects * sizeof *sim->host.mailbox);
+    sim->host.has_mail = calloc(n_objects, sizeof *sim->host.has_mail);
+    for (h = 0; h < sim->host.n_hosts; h++) {
+        sim->host.first[h] = h < hunter_hosts ? h * per_host :
+            sim->n_hunters + (h - hunter_hosts) * per_host;
+    }
+    for (i = 0; i < n_objects; i++) {
+        sim->host.alive[host_of(i)] += sim->agents.alive[i];
+    }
+
+    reap_init();
+    sim->host.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sim->host.epfd == -1) {
+        perror("host_init()");
+        die(ERR_POLL);
+    }
+    sim->host.events = malloc((sim->host.n_hosts + 1) * sizeof *sim->host.events);
+    for (h = 0; h <= sim->host.n_hosts; h++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = h };
+        int fd = sim->reap.sfd;
+        if (h < sim->host.n_hosts) {
+            sim->host.fd[h] = -1;
+            sim->host.pid[h] = -1;
+            if (sim->host.alive[h] == 0) {
+                /* Everyone died before a snapshot */
+                continue;
+            }
+            host_spawn(h);
+            fd = sim->host.fd[h];
+        }
+        if (epoll_ctl(sim->host.epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("host_init()");
+            die(ERR_POLL);
+        }
+    }
+}
+
+static void host_send(int idx, const struct server_message *state)
+{
+    int h = host_of(idx);
+    struct host_state *out = sim->host.out + (size_t)h * sim->host.per_host;
+    out[sim->host.n_out[h]].idx = idx;
+    out[sim->host.n_out[h]].state = *state;
+    sim->host.n_out[h]++;
+}
+
+static void host_flush(void)
+{
+    int h;
+    for (h = 0; h < sim->host.n_hosts; h++) {
+        const char *p = (const char *)(sim->host.out + (size_t)h * sim->host.per_host);
+        size_t len = sim->host.n_out[h] * sizeof *sim->host.out;
+        while (len > 0) {
+            ssize_t n = write(sim->host.fd[h], p, len);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("host_flush()");
+                die(ERR_WRITE);
+            }
+            p += n;
+            len -= n;
+        }
+        sim->host.n_out[h] = 0;
+    }
+}
+
+/* Reads what host h has ready, at most max moves */
+static int host_read(int h, struct agent_move *moves, int max)
+{
+    struct host_move *in = sim->host.in + (size_t)h * sim->host.per_host;
+    size_t room = sim->host.per_host * sizeof *in;
+    size_t want = max * sizeof *in;
+    int i, n_moves;
+    if (want < room) {
+        room = want;
+    }
+    ssize_t n = read(sim->host.fd[h], (char *)in + sim->host.in_len[h],
+            room - sim->host.in_len[h]);
+    if (n <= 0) {
+        if (n == -1 && errno == EINTR) {
+            return 0;
+        }
+        perror("host_read()");
+        die(ERR_READ);
+    }
+    sim->host.in_len[h] += n;
+    n_moves = sim->host.in_len[h] / sizeof *in;
+    for (i = 0; i < n_moves; i++) {
+        moves[i].idx = in[i].idx;
+        moves[i].message = in[i].move;
+    }
+    sim->host.in_len[h] -= n_moves * sizeof *in;
+    memmove(in, in + n_moves, sim->host.in_len[h]);
+    return n_moves;
+}
+
+static int host_wait(struct agent_move *moves, int max)
+{
+    int i, n_ready, n_moves = 0;
+    host_flush();
+    while (n_moves == 0) {
+        do {
+            n_ready = epoll_wait(sim->host.epfd, sim->host.events, sim->host.n_hosts + 1,
+                    render_timeout_ms());
+        } while (n_ready == -1 && errno == EINTR);
+        if (n_ready == -1) {
+            perror("host_wait()");
+            die(ERR_POLL);
+        }
+        if (n_ready == 0) {
+            /* A held back frame is due */
+            break;
+        }
+        for (i = 0; i < n_ready && n_moves < max; i++) {
+            int h = sim->host.events[i].data.u32;
+            if (h == sim->host.n_hosts) {
+                reap_children();
+            } else if (sim->host.fd[h] != -1) {
+                n_moves += host_read(h, &moves[n_moves], max - n_moves);
+            }
+        }
+    }
+    return n_moves;
+}
+
+static void host_receive(int idx, struct agent_move *move)
+{
+    int n_objects = sim->n_hunters + sim->n_preys;
+    while (!sim->host.has_mail[idx]) {
+        struct agent_move *moves = sim->host.mailbox + n_objects;
+        int k, n_moves = host_wait(moves, n_objects);
+        for (k = 0; k < n_moves; k++) {
+            sim->host.mailbox[moves[k].idx] = moves[k];
+            sim->host.has_mail[moves[k].idx] = 1;
+        }
+    }
+    *move = sim->host.mailbox[idx];
+    sim->host.has_mail[idx] = 0;
+}
+
+/* Replies still in flight are dropped by accept_move(), a host is stopped
+ * with its last agent
+ */
+static void host_remove(int idx)
+{
+    int h = host_of(idx);
+    if (--sim->host.alive[h] > 0) {
+        return;
+    }
+    if (sim->host.pid[h] > 0) {
+        if (kill(sim->host.pid[h], SIGTERM) == -1) {
+            perror("host_remove()");
+            die(ERR_KILL);
+        }
+        sim->reap.pending++;
+    }
+    if (epoll_ctl(sim->host.epfd, EPOLL_CTL_DEL, sim->host.fd[h], NULL) == -1) {
+        perror("host_remove()");
+        die(ERR_POLL);
+    }
+    close(sim->host.fd[h]);
+    sim->host.fd[h] = -1;
+    sim->host.pid[h] = -1;
+    sim->host.n_out[h] = 0;
+}
+
+static void host_clean(void)
+{
+    int h;
+    for (h = 0; h < sim->host.n_hosts; h++) {
+        if (sim->host.pid[h] > 0 && kill(sim->host.pid[h], SIGTERM) == -1) {
+            perror("host_clean()");
+            die(ERR_KILL);
+        }
+    }
+    for (h = 0; h < sim->host.n_hosts; h++) {
+        if (sim->host.pid[h] > 0 && waitpid(sim->host.pid[h], NULL, 0) == -1) {
+            perror("host_clean()");
+            die(ERR_WAIT);
+        }
+        if (sim->host.fd[h] != -1) {
+            close(sim->host.fd[h]);
+        }
+    }
+    close(sim->host.epfd);
+    free(sim->host.events);
+    free(sim->host.first);
+    free(sim->host.alive);
+    free(sim->host.fd);
+    free(sim->host.pid);
+    free(sim->host.out);
+    free(sim->host.n_out);
+    free(sim->host.in);
+    free(sim->host.in_len);
+    free(sim->host.mailbox);
+    free(sim->host.has_mail);
+}
+
+static const struct event_backend host_backend = {
+    .init = host_init,
+    .send = host_send,
+    .wait = host_wait,
+    .receive = host_receive,
+    .remove = host_remove,
+    .clean = host_clean,
+};
+
+/* Sends every live agent its state for a map that is not changing in the
+ * meantime, so the adversary queries can be answered in a batch up front.
+ */
+static void send_all_states(void)
+{
+    int i, n_objects = sim->n_hunters + sim->n_preys;
+    int *adv = NULL;
+    if (sim->index.simd) {
+        adv = malloc(n_objects * sizeof *adv);
+        closest_adversary_batch(0, sim->n_hunters, adv);
+        closest_adversary_batch(sim->n_hunters, n_objects, adv);
+    }
+    for (i = 0; i < n_objects; i++) {
+        if (sim->agents.alive[i]) {
+            send_state(i, adv ? adv[i] : closest_adversary(i));
+        }
+    }
+    free(adv);
+}
+
+static char cell_represent(int idx)
+{
+    if (idx == IDX_OBSTACLE) {
+        return 'X';
+    } else if (idx == IDX_EMPTY) {
+        return ' ';
+    } else {
+        return sim->agents.kind[idx] == KIND_HUNTER ? 'H' : 'P';
+    }
+}
+
+static void render_reserve(size_t extra)
+{
+    if (sim->render.len + extra > sim->render.cap) {
+        while (sim->render.len + extra > sim->render.cap) {
+            sim->render.cap = sim->render.cap ? 2*sim->render.cap : 4096;
+        }
+        sim->render.buf = realloc(sim->render.buf, sim->render.cap);
+    }
+}
+
+static void render_border(void)
+{
+    render_reserve(sim->width + 3);
+    sim->render.buf[sim->render.len++] = '+';
+    memset(sim->render.buf + sim->render.len, '-', sim->width);
+    sim->render.len += sim->width;
+    sim->render.buf[sim->render.len++] = '+';
+    sim->render.buf[sim->render.len++] = '\n';
+}
+
+static void render_full(void)
+{
+    int i, j;
+    render_border();
+    render_reserve((size_t)sim->height * (sim->width + 3));
+    for (i = 0; i < sim->height; i++) {
+        sim->render.buf[sim->render.len++] = '|';
+        for (j = 0; j < sim->width; j++) {
+            size_t cell = grid_idx_(i, j);
+            char c = cell_represent(grid_get_idx(i, j));
+            sim->render.buf[sim->render.len++] = c;
+            if (sim->render.shown) {
+                sim->render.shown[cell] = c;
+            }
+        }
+        sim->render.buf[sim->render.len++] = '|';
+        sim->render.buf[sim->render.len++] = '\n';
+    }
+    render_border();
+}
+
+/* Moves the cursor to each changed cell and redraws it, then parks the
+ * cursor below the map.
+ */
+static void render_delta(void)
+{
+    size_t k;
+    for (k = 0; k < sim->render.n_dirty; k++) {
+        size_t cell = sim->render.dirty_list[k];
+        char c = cell_represent(grid_get_idx(cell / sim->width, cell % sim->width));
+        sim->render.dirty[cell] = 0;
+        if (sim->render.shown[cell] == c) {
+            continue;
+        }
+        sim->render.shown[cell] = c;
+        render_reserve(32);
+        sim->render.len += snprintf(sim->render.buf + sim->render.len, 32, "\033[%zu;%zuH%c",
+                cell / sim->width + 2, cell % sim->width + 2, c);
+    }
+    sim->render.n_dirty = 0;
+    render_reserve(32);
+    sim->render.len += snprintf(sim->render.buf + sim->render.len, 32, "\033[%d;1H",
+            sim->height + 3);
+}
+
+static void render_write(void)
+{
+    size_t done = 0;
+    fflush(stdout);
+    while (done < sim->render.len) {
+        ssize_t n = write(STDOUT_FILENO, sim->render.buf + done, sim->render.len - done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die(ERR_WRITE);
+        }
+        done += n;
+    }
+    sim->render.len = 0;
+}
+
+/* Draws the map unless the frame rate cap says to wait, in which case the
+ * changes are kept for the next frame, see render_poll(). force draws
+ * anyway.
+ */
+static void render_frame(int force)
+{
+    if (sim->render.fps > 0 && !force) {
+        long long now = now_ns();
+        if (now - sim->render.last_frame < 1000000000LL / sim->render.fps) {
+            sim->render.pending = 1;
+            return;
+        }
+        sim->render.last_frame = now;
+    }
+    sim->render.pending = 0;
+
+    if (sim->render.delta && sim->render.shown_valid) {
+        render_delta();
+    } else {
+        if (sim->render.delta) {
+            /* Clear the terminal once, deltas are drawn over this frame */
+            render_reserve(8);
+            memcpy(sim->render.buf + sim->render.len, "\033[H\033[2J", 7);
+            sim->render.len += 7;
+            sim->render.n_dirty = 0;
+            memset(sim->render.dirty, 0, (size_t)sim->width * sim->height);
+            sim->render.shown_valid = 1;
+        }
+        render_full();
+    }
+    render_write();
+}
+
+static void render_init(void)
+{
+    if (sim->render.delta) {
+        sim->render.shown = malloc((size_t)sim->width * sim->height);
+        sim->render.dirty = calloc((size_t)sim->width * sim->height, 1);
+        sim->render.dirty_list = malloc((size_t)sim->width * sim->height *
+                sizeof *sim->render.dirty_list);
+    }
+}
+
+/* Draws a frame held back by the frame rate cap once it is due, so that the
+ * screen catches up even when nothing changes after it.
+ */
+static void render_poll(void)
+{
+    if (sim->render.pending) {
+        render_frame(0);
+    }
+}
+
+static void render_clean(void)
+{
+    free(sim->render.buf);
+    free(sim->render.shown);
+    free(sim->render.dirty);
+    free(sim->render.dirty_list);
+}
+
+/* Moves since the last keyframe worth a keyframe, so that keyframes stay a
+ * fraction of the log
+ */
+#define LOG_KEYFRAME_MOVES 65536
+/* Buffered records are handed to the writer once there are this many, at
+ * every keyframe and at least this often, so that a run that gets killed
+ * leaves most of its log behind
+ */
+#define LOG_FLUSH_BYTES (1 << 20)
+#define LOG_FLUSH_NS 200000000LL
+
+static void log_write(const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(sim->log.fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("log_write()");
+            die(ERR_WRITE);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void *log_writer(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&sim->log.lock);
+    for (;;) {
+        while (!sim->log.writing && !sim->log.stopping) {
+            pthread_cond_wait(&sim->log.ready, &sim->log.lock);
+        }
+        if (!sim->log.writing) {
+            break;
+        }
+        pthread_mutex_unlock(&sim->log.lock);
+        log_write(sim->log.spare.data, sim->log.spare.len);
+        pthread_mutex_lock(&sim->log.lock);
+        sim->log.spare.len = 0;
+        sim->log.writing = 0;
+        pthread_cond_signal(&sim->log.done);
+    }
+    pthread_mutex_unlock(&sim->log.lock);
+    return NULL;
+}
+
+/* Hands the buffered records to the writer and carries on in the buffer it
+ * wrote last.
+ */
+static void log_flush(void)
+{
+    struct movelog_buf full;
+    sim->log.moves += sim->log.buf.moves;
+    sim->log.buf.moves = 0;
+    sim->log.flushed_at = now_ns();
+    full = sim->log.buf;
+    pthread_mutex_lock(&sim->log.lock);
+    while (sim->log.writing) {
+        pthread_cond_wait(&sim->log.done, &sim->log.lock);
+    }
+    sim->log.buf.data = sim->log.spare.data;
+    sim->log.buf.cap = sim->log.spare.cap;
+    sim->log.buf.len = 0;
+    sim->log.spare = full;
+    sim->log.offset += full.len;
+    sim->log.writing = 1;
+    pthread_cond_signal(&sim->log.ready);
+    pthread_mutex_unlock(&sim->log.lock);
+}
+
+static long log_moves(void)
+{
+    return sim->log.moves + sim->log.buf.moves;
+}
+
+static void log_keyframe(void)
+{
+    struct movelog_keyframe keyframe = { sim->log.offset + sim->log.buf.len, log_moves() };
+    int i;
+    if (sim->log.n_keyframes == sim->log.cap_keyframes) {
+        sim->log.cap_keyframes = sim->log.cap_keyframes ? 2 * sim->log.cap_keyframes : 64;
+        sim->log.keyframes = realloc(sim->log.keyframes,
+                sim->log.cap_keyframes * sizeof *sim->log.keyframes);
+    }
+    sim->log.keyframes[sim->log.n_keyframes++] = keyframe;
+    movelog_mark(&sim->log.buf, MOVELOG_KEYFRAME);
+    movelog_reserve(&sim->log.buf, 20 + 30 * (size_t)(sim->n_hunters + sim->n_preys));
+    movelog_put(&sim->log.buf, keyframe.moves);
+    movelog_put(&sim->log.buf, sim->lockstep.ticks);
+    for (i = 0; i < sim->n_hunters + sim->n_preys; i++) {
+        if (!sim->agents.alive[i]) {
+            movelog_put(&sim->log.buf, 0);
+            continue;
+        }
+        int shown = grid_get_idx(sim->agents.x[i], sim->agents.y[i]) == i;
+        movelog_put(&sim->log.buf, (uint64_t)sim->agents.x[i] * 2 + shown + 1);
+        movelog_put(&sim->log.buf, sim->agents.y[i]);
+        movelog_put(&sim->log.buf, sim->agents.energy[i]);
+    }
+    sim->log.since_keyframe = log_moves();
+}
+
+/* Called between moves, keeps the keyframes coming and the buffer small */
+static void log_poll(void)
+{
+    if (sim->log.fd == -1) {
+        return;
+    }
+    if (log_moves() - sim->log.since_keyframe >= sim->log.keyframe_every) {
+        log_keyframe();
+        log_flush();
+    } else if (sim->log.buf.len >= LOG_FLUSH_BYTES ||
+            (sim->log.buf.len > 0 && now_ns() - sim->log.flushed_at >= LOG_FLUSH_NS)) {
+        log_flush();
+    }
+}
+
+static void log_open(const char *path)
+{
+    struct movelog_header header = {
+        .version = MOVELOG_VERSION,
+        .width = sim->width,
+        .height = sim->height,
+        .n_hunters = sim->n_hunters,
+        .n_preys = sim->n_preys,
+    };
+    sim->log.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (sim->log.fd == -1) {
+        perror("log_open()");
+        die(ERR_WRITE);
+    }
+    memcpy(header.magic, MOVELOG_MAGIC, sizeof header.magic);
+    log_write(&header, sizeof header);
+    sim->log.offset = sizeof header;
+    /* Keyframes hold every agent, space them out on large maps */
+    sim->log.keyframe_every = LOG_KEYFRAME_MOVES;
+    if (sim->log.keyframe_every < 4L * (sim->n_hunters + sim->n_preys)) {
+        sim->log.keyframe_every = 4L * (sim->n_hunters + sim->n_preys);
+    }
+    pthread_mutex_init(&sim->log.lock, NULL);
+    pthread_cond_init(&sim->log.done, NULL);
+    pthread_cond_init(&sim->log.ready, NULL);
+    sim_thread_create(&sim->log.writer, log_writer, NULL);
+    /* Replay can start anywhere there is a keyframe, including here */
+    log_keyframe();
+    log_flush();
+}
+
+/* Ends the log with a keyframe of the final map and the keyframe index */
+static void log_close(void)
+{
+    struct movelog_trailer trailer;
+    log_keyframe();
+    movelog_mark(&sim->log.buf, MOVELOG_END);
+    /* The index is read in place by ./replay */
+    movelog_reserve(&sim->log.buf, 8);
+    while ((sim->log.offset + sim->log.buf.len) % 8 != 0) {
+        sim->log.buf.data[sim->log.buf.len++] = 0;
+    }
+    log_flush();
+    pthread_mutex_lock(&sim->log.lock);
+    sim->log.stopping = 1;
+    pthread_cond_signal(&sim->log.ready);
+    pthread_mutex_unlock(&sim->log.lock);
+    pthread_join(sim->log.writer, NULL);
+    trailer.index_offset = sim->log.offset;
+    trailer.n_keyframes = sim->log.n_keyframes;
+    memcpy(trailer.magic, MOVELOG_TRAILER_MAGIC, sizeof trailer.magic);
+    log_write(sim->log.keyframes, sim->log.n_keyframes * sizeof *sim->log.keyframes);
+    log_write(&trailer, sizeof trailer);
+    if (close(sim->log.fd) == -1) {
+        perror("log_close()");
+        die(ERR_WRITE);
+    }
+    sim->log.fd = -1;
+    pthread_mutex_destroy(&sim->log.lock);
+    pthread_cond_destroy(&sim->log.done);
+    pthread_cond_destroy(&sim->log.ready);
+    free(sim->log.buf.data);
+    free(sim->log.spare.data);
+    free(sim->log.keyframes);
+}
+
+void init_map(void)
+{
+    read_scenario();
+    if (sim->scenario.header) {
+        scenario_close(&sim->scenario);
+    }
+    init_agents();
+    if (sim->log.path) {
+        log_open(sim->log.path);
+    }
+    if (sim->index.enabled) {
+        init_index();
+    }
+    if (sim->field.enabled) {
+        init_field();
+    }
+    long long start = now_ns();
+    if (!sim->in_process && !sim->host.per_host) {
+        fayrapla();
+    }
+    sim->backend->init();
+    sim->bench.startup = now_ns() - start;
+    /* Deadlines count from here too */
+    sim->bench.start = now_ns();
+    if (sim->bench.enabled) {
+        sim->bench.sent_at = malloc((sim->n_hunters + sim->n_preys) * sizeof *sim->bench.sent_at);
+    }
+    if (!sim->quiet) {
+        render_init();
+    }
+    if (sim->snapshot.restored && sim->clock.enabled) {
+        /* Under the virtual clock agents answer states sent at different
+         * times, they pick up from the one they were answering. Everywhere
+         * else the map as it is will do.
+         */
+        int i;
+        for (i = 0; i < sim->n_hunters + sim->n_preys; i++) {
+            if (sim->agents.alive[i]) {
+                send_built_state(i, &sim->snapshot.sent[i]);
+            }
+        }
+    } else {
+        if (sim->snapshot.path) {
+            sim->snapshot.sent = malloc((sim->n_hunters + sim->n_preys) * sizeof *sim->snapshot.sent);
+        }
+        send_all_states();
+    }
+    if (!sim->quiet) {
+        render_frame(1);
+    }
+}
+
+void clean_map(void)
+{
+    int i;
+    /* Signal everyone first so that they exit in parallel */
+    for (i = 0; i < sim->n_hunters + sim->n_preys; i++) {
+        if (sim->agents.pid[i] > 0) {
+            if (kill(sim->agents.pid[i], SIGTERM) == -1) {
+                perror("clean_map()");
+                die(ERR_KILL);
+            }
+            sim->reap.pending++;
+            sim->agents.pid[i] = -1;
+            sim->transport->close(i);
+        } else if (sim->agents.fd[i] != -1) {
+            /* Leased from ./agentd, or exited on its own and reaped */
+            sim->transport->close(i);
+        }
+    }
+    while (sim->reap.pending > 0) {
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid == -1) {
+            perror("clean_map()");
+            die(ERR_WAIT);
+        }
+        if (!reap_unsignalled(pid)) {
+            sim->reap.pending--;
+        }
+    }
+    if (!sim->in_process) {
+        reap_clean();
+    }
+    sim->backend->clean();
+    if (sim->agentd.path) {
+        /* The agents go back to the pool, once nothing reads from them */
+        close(sim->agentd.fd);
+    }
+    if (sim->index.enabled) {
+        free(sim->index.head[KIND_HUNTER]);
+        free(sim->index.head[KIND_PREY]);
+        free(sim->index.next);
+        free(sim->index.prev);
+    }
+    if (sim->field.enabled) {
+        field_free(&sim->field.to[KIND_HUNTER]);
+        field_free(&sim->field.to[KIND_PREY]);
+        free(sim->field.blocked);
+    }
+    tiles_free(&sim->grid);
+    free(sim->agents.x);
+    free(sim->agents.y);
+    free(sim->agents.energy);
+    free(sim->agents.kind);
+    free(sim->agents.alive);
+    free(sim->agents.fd);
+    free(sim->agents.pid);
+    free(sim->deaths.events);
+    free(sim->fds);
+    free(sim->channels);
+    render_clean();
+    free(sim->bench.sent_at);
+    free(sim->bench.latencies);
+    free(sim->clock.events);
+    free(sim->snapshot.sent);
+}
+
+static void agent_terminate(int idx)
+{
+    if (sim->agents.pid[idx] > 0) {
+        /* Reaped later by reap_children() */
+        if (kill(sim->agents.pid[idx], SIGTERM) == -1) {
+            perror("agent_terminate()");
+            die(ERR_KILL);
+        }
+        sim->reap.pending++;
+    }
+    sim->backend->remove(idx);
+    if (!sim->in_process && !sim->host.per_host) {
+        sim->transport->close(idx);
+    }
+    if (sim->index.enabled) {
+        index_remove(idx);
+    }
+    if (sim->field.enabled) {
+        field_remove(&sim->field.to[sim->agents.kind[idx]],
+                grid_idx_(sim->agents.x[idx], sim->agents.y[idx]));
+    }
+    sim->agents.fd[idx] = -1;
+    sim->agents.pid[idx] = -1;
+}
+
+static void bench_record(long long latency)
+{
+    if (sim->bench.n_latencies == sim->bench.cap_latencies) {
+        sim->bench.cap_latencies = sim->bench.cap_latencies ? 2*sim->bench.cap_latencies : 4096;
+        sim->bench.latencies = realloc(sim->bench.latencies,
+                sim->bench.cap_latencies * sizeof *sim->bench.latencies);
+    }
+    sim->bench.latencies[sim->bench.n_latencies++] = latency;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static double bench_percentile(double p)
+{
+    long i = (long)(p * (sim->bench.n_latencies - 1) + 0.5);
+    return sim->bench.latencies[i] / 1e3;
+}
+
+static void print_bench_summary(void)
+{
+    double elapsed = (now_ns() - sim->bench.start) / 1e9;
+    printf("agents: %d (%d hunters, %d preys)\n", sim->n_hunters + sim->n_preys,
+            sim->n_hunters, sim->n_preys);
+    if (sim->grid.tiles) {
+        printf("grid: %zu KiB for %d x %d cells\n", tiles_bytes(&sim->grid) / 1024,
+                sim->height, sim->width);
+    }
+    if (sim->host.per_host) {
+        printf("hosts: %d, up to %d agents each\n", sim->host.n_hosts, sim->host.per_host);
+    }
+    if (sim->bench.spawned > 0) {
+        printf("startup: %d processes %s in %.3f s\n", sim->bench.spawned,
+                sim->agentd.path ? "attached" : "started", sim->bench.startup / 1e9);
+    }
+    printf("moves: %ld in %.3f s, %.0f moves/s\n", sim->bench.moves, elapsed,
+            elapsed > 0 ? sim->bench.moves / elapsed : 0.0);
+    if (sim->bench.n_latencies > 0) {
+        qsort(sim->bench.latencies, sim->bench.n_latencies, sizeof *sim->bench.latencies,
+                compare_latency);
+        printf("latency: p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+                bench_percentile(0.50), bench_percentile(0.90), bench_percentile(0.99),
+                bench_percentile(1.0));
+    }
+    if (sim->clock.enabled) {
+        printf("virtual time: %.3f s\n", sim->clock.now / 1e9);
+    }
+    if (sim->lockstep.enabled) {
+        printf("ticks: %ld\n", sim->lockstep.ticks);
+    }
+    if (sim->backend == &uring_backend) {
+        printf("io_uring: %ld requests in %ld io_uring_enter() calls\n",
+                sim->uring.submitted, sim->uring.enters);
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        printf("context switches: %ld voluntary, %ld involuntary\n",
+                usage.ru_nvcsw, usage.ru_nivcsw);
+    }
+    printf("deaths: %d preys caught, %d hunters exhausted\n",
+            sim->bench.preys_caught, sim->bench.hunters_exhausted);
+}
+
+/* Counts a move request, returns 0 if it came from a dead agent and is to
+ * be dropped.
+ */
+static int accept_move(const struct agent_move *move)
+{
+    if (!sim->agents.alive[move->idx]) {
+        /* Died while the request was in flight */
+        return 0;
+    }
+    if (sim->bench.enabled) {
+        bench_record(now_ns() - sim->bench.sent_at[move->idx]);
+    }
+    sim->bench.moves++;
+    return 1;
+}
+
+/* Applies a move request. Returns whether the map changed, requests from
+ * dead agents are dropped.
+ */
+static int process_move(const struct agent_move *move)
+{
+    if (!accept_move(move)) {
+        return 0;
+    }
+    return handle_move(move->idx, move->message.move_request.x,
+            move->message.move_request.y);
+}
+
+static int move_limit_reached(void)
+{
+    return sim->bench.max_moves && sim->bench.moves >= sim->bench.max_moves;
+}
+
+static int deadline_reached(void)
+{
+    return sim->bench.deadline > 0 &&
+        now_ns() - sim->bench.start >= sim->bench.deadline * 1e9;
+}
+
+/* Map side of a recorded death, touching only the dying agent, its cell
+ * and the hunter on it, so band workers may run it. Returns whether the
+ * agent died.
+ */
+static int settle_death(const struct death_event *event)
+{
+    int idx = event->idx;
+    int x = sim->agents.x[idx], y = sim->agents.y[idx];
+    if (!sim->agents.alive[idx]) {
+        /* Already dead */
+        return 0;
+    }
+    if (event->kind == DEATH_CAPTURE) {
+        /* Hunter on prey, add prey energy to hunter */
+        sim->agents.energy[grid_get_idx(x, y)] += sim->agents.energy[idx];
+    } else if (sim->agents.energy[idx] == 0) {
+        /* Hunter died, update the grid unless a prey is standing on it */
+        if (grid_get_idx(x, y) == idx) {
+            grid_set(x, y, IDX_EMPTY);
+        }
+    } else {
+        /* Refilled by a capture */
+        return 0;
+    }
+    sim->agents.alive[idx] = 0;
+    sim->agents.energy[idx] = 0;
+    return 1;
+}
+
+/* Rest of a settled death, main thread only.
+ */
+static void retire_agent(int idx)
+{
+    agent_terminate(idx);
+    if (sim->agents.kind[idx] == KIND_PREY) {
+        sim->bench.preys_caught++;
+        sim->preys_alive--;
+    } else {
+        sim->bench.hunters_exhausted++;
+        sim->hunters_alive--;
+    }
+    /* Invalidate remaining attributes, parked out of reach of the vector
+     * scan
+     */
+    sim->agents.x[idx] = NEAREST_FAR;
+    sim->agents.y[idx] = NEAREST_FAR;
+}
+
+/* Reaps the agents recorded by the move handlers since the last call.
+ * Captures are queued before the capturing hunter's exhaustion, so a hunter
+ * that runs dry on the move that catches a prey lives on its energy.
+ * Returns whether the map changed.
+ */
+static int reap_dead(void)
+{
+    int i, updated = 0;
+    for (i = 0; i < sim->deaths.count; i++) {
+        if (settle_death(&sim->deaths.events[i])) {
+            if (main_log()) {
+                movelog_death(main_log(), sim->deaths.events[i].idx, sim->deaths.events[i].kind);
+            }
+            retire_agent(sim->deaths.events[i].idx);
+            /* Map is updated */
+            updated = 1;
+        }
+    }
+    sim->deaths.count = 0;
+    return updated;
+}
+
+static int game_over(void)
+{
+    return sim->hunters_alive == 0 || sim->preys_alive == 0;
+}
+
+static int snapshot_put(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Runs in the forked copy, which must not touch the heap as another thread
+ * may have held its lock at the fork. row is set aside by the parent.
+ */
+static int snapshot_write(int fd, uint64_t *row)
+{
+    struct scenario_header header = {
+        .version = SCENARIO_VERSION,
+        .width = sim->width,
+        .height = sim->height,
+        .n_hunters = sim->n_hunters,
+        .n_preys = sim->n_preys,
+        .flags = SCENARIO_SNAPSHOT,
+    };
+    struct scenario_state state = {
+        .rng = sim->clock.rng.state,
+        .moves = sim->bench.moves,
+        .ticks = sim->lockstep.ticks,
+        .now = sim->clock.now,
+        .seq = sim->clock.seq,
+        .preys_caught = sim->bench.preys_caught,
+        .hunters_exhausted = sim->bench.hunters_exhausted,
+        .n_events = sim->clock.enabled ? sim->clock.n_events : 0,
+    };
+    size_t row_words = scenario_row_words(sim->width), k;
+    int i, x, n_objects = sim->n_hunters + sim->n_preys;
+    static const char padding[8];
+    memcpy(header.magic, SCENARIO_MAGIC, sizeof header.magic);
+    if (snapshot_put(fd, &header, sizeof header) == -1) {
+        return -1;
+    }
+    for (x = 0; x < sim->height; x++) {
+        tiles_store_obstacles(&sim->grid, x, row, row_words);
+        for (k = 0; k < row_words; k++) {
+            header.n_obstacles += __builtin_popcountll(row[k]);
+        }
+        if (snapshot_put(fd, row, row_words * sizeof *row) == -1) {
+            return -1;
+        }
+    }
+    for (i = 0; i < n_objects; i++) {
+        struct scenario_agent agent = { sim->agents.x[i], sim->agents.y[i], sim->agents.energy[i] };
+        if (snapshot_put(fd, &agent, sizeof agent) == -1) {
+            return -1;
+        }
+    }
+    if (snapshot_put(fd, padding, scenario_state_offset(&header) - scenario_size(&header)) == -1 ||
+            snapshot_put(fd, &state, sizeof state) == -1) {
+        return -1;
+    }
+    for (i = 0; i < state.n_events; i++) {
+        struct scenario_event event = { sim->clock.events[i].time, sim->clock.events[i].seq,
+            sim->clock.events[i].idx, 0 };
+        if (snapshot_put(fd, &event, sizeof event) == -1) {
+            return -1;
+        }
+    }
+    if (snapshot_put(fd, sim->snapshot.sent, n_objects * sizeof *sim->snapshot.sent) == -1 ||
+            snapshot_put(fd, sim->agents.alive, n_objects * sizeof *sim->agents.alive) == -1) {
+        return -1;
+    }
+    /* Now that the obstacles are counted */
+    if (pwrite(fd, &header, sizeof header, 0) != sizeof header) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Forks and lets the copy-on-write child write the snapshot while the
+ * server carries on. It goes to a temporary file that is renamed over the
+ * snapshot, so the file is always a complete one.
+ */
+static void snapshot_take(void)
+{
+    size_t len = strlen(sim->snapshot.path) + 32;
+    char *tmp = malloc(len);
+    uint64_t *row = malloc(scenario_row_words(sim->width) * sizeof *row);
+    pid_t pid;
+    snapshot_requested = 0;
+    snprintf(tmp, len, "%s.%d.tmp", sim->snapshot.path, (int)getpid());
+    pid = fork();
+    if (pid == -1) {
+        perror("snapshot_take()");
+        die(ERR_FORK);
+    }
+    if (pid == 0) {
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1 || snapshot_write(fd, row) == -1 || close(fd) == -1 ||
+                rename(tmp, sim->snapshot.path) == -1) {
+            perror("snapshot_take()");
+            unlink(tmp);
+            _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    /* Reaped along with the agents */
+    sim->reap.pending++;
+    free(tmp);
+    free(row);
+}
+
+static void snapshot_poll(void)
+{
+    if (snapshot_requested) {
+        snapshot_take();
+    }
+}
+
+static void snapshot_request(int sig)
+{
+    (void)sig;
+    snapshot_requested = 1;
+}
+
+static void snapshot_init(void)
+{
+    struct sigaction sa = { .sa_handler = snapshot_request, .sa_flags = SA_RESTART };
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        perror("snapshot_init()");
+        die(ERR_SNAPSHOT);
+    }
+}
+
+/* Real time, moves are applied in the order the agents send them.
+ */
+static void run_realtime(void)
+{
+    int updated = reap_dead();
+    int stopped = 0;
+    struct agent_move *moves = malloc((sim->n_hunters + sim->n_preys) * sizeof *moves);
+    while (!game_over() && !stopped) {
+        int k, n_moves;
+        n_moves = sim->backend->wait(moves, sim->n_hunters + sim->n_preys);
+        for (k = 0; k < n_moves && !game_over(); k++) {
+            updated |= process_move(&moves[k]);
+            updated |= reap_dead();
+            if (move_limit_reached()) {
+                stopped = 1;
+                break;
+            }
+        }
+        if (deadline_reached()) {
+            stopped = 1;
+        }
+
+        if (updated && !sim->quiet) {
+            render_frame(0);
+            updated = 0;
+        }
+        render_poll();
+        log_poll();
+        snapshot_poll();
+    }
+    free(moves);
+}
+
+static int band_of(int x)
+{
+    int band = x / BAND_ROWS;
+    return band < sim->bands.n_bands ? band : sim->bands.n_bands - 1;
+}
+
+static void band_apply(struct band *band, int idx, struct movelog_buf *log)
+{
+    const struct ph_message *message = &sim->bands.pending[idx].message;
+    int i;
+    band->moves++;
+    band->updated |= apply_logged(log, idx, message->move_request.x, message->move_request.y,
+            &band->deaths);
+    for (i = 0; i < band->deaths.count; i++) {
+        if (settle_death(&band->deaths.events[i])) {
+            if (log) {
+                movelog_death(log, band->deaths.events[i].idx, band->deaths.events[i].kind);
+            }
+            sim->bands.died[band->deaths.events[i].idx] = 1;
+            band->updated = 1;
+        }
+    }
+    band->deaths.count = 0;
+}
+
+/* Moves that stay within the band, in index order. The rest are pushed on
+ * the incoming list of the band they go to.
+ */
+static void band_resolve_local(int b)
+{
+    struct band *band = &sim->bands.bands[b];
+    int k;
+    for (k = sim->bands.band_start[b]; k < sim->bands.band_start[b + 1]; k++) {
+        int idx = sim->bands.order[k];
+        int target = band_of(sim->bands.pending[idx].message.move_request.x);
+        if (!sim->agents.alive[idx]) {
+            /* Caught earlier in the tick */
+            continue;
+        }
+        if (target == b) {
+            band_apply(band, idx, sim->log.fd != -1 ? &band->log[0] : NULL);
+            continue;
+        }
+        struct band *other = &sim->bands.bands[target];
+        int head = atomic_load_explicit(&other->incoming, memory_order_relaxed);
+        do {
+            sim->bands.handoff_next[idx] = head;
+        } while (!atomic_compare_exchange_weak_explicit(&other->incoming, &head, idx,
+                    memory_order_release, memory_order_relaxed));
+    }
+}
+
+static int compare_idx(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Moves into band b from its neighbours. These touch the neighbours' edge
+ * rows as well, so bands of one parity go at a time. Pushes came from
+ * several threads, sorting restores the index order.
+ */
+static void band_resolve_incoming(int b, int worker)
+{
+    int *incoming = sim->bands.scratch + (size_t)worker * (sim->n_hunters + sim->n_preys);
+    int i, n = 0;
+    int idx = atomic_exchange_explicit(&sim->bands.bands[b].incoming, -1, memory_order_acquire);
+    while (idx != -1) {
+        incoming[n++] = idx;
+        idx = sim->bands.handoff_next[idx];
+    }
+    qsort(incoming, n, sizeof *incoming, compare_idx);
+    for (i = 0; i < n; i++) {
+        if (sim->agents.alive[incoming[i]]) {
+            struct band *band = &sim->bands.bands[b];
+            band_apply(band, incoming[i], sim->log.fd != -1 ? &band->log[1] : NULL);
+        }
+    }
+}
+
+static void band_task(int worker)
+{
+    int i, b, parity, n_objects = sim->n_hunters + sim->n_preys;
+    switch (sim->bands.task) {
+        case BAND_RESOLVE:
+            for (b = worker; b < sim->bands.n_bands; b += sim->bands.n_workers) {
+                band_resolve_local(b);
+            }
+            for (parity = 0; parity < 2; parity++) {
+                pthread_barrier_wait(&sim->bands.barrier);
+                for (b = worker; b < sim->bands.n_bands; b += sim->bands.n_workers) {
+                    if (b % 2 == parity) {
+                        band_resolve_incoming(b, worker);
+                    }
+                }
+            }
+            break;
+        case BAND_STATES:
+            for (i = worker; i < n_objects; i += sim->bands.n_workers) {
+                if (sim->agents.alive[i]) {
+                    build_state(i, closest_adversary(i), &sim->bands.states[i]);
+                }
+            }
+            break;
+        case BAND_QUIT:
+            break;
+    }
+}
+
+static void *band_worker(void *arg)
+{
+    int worker = (intptr_t)arg;
+    for (;;) {
+        pthread_barrier_wait(&sim->bands.barrier);
+        if (sim->bands.task == BAND_QUIT) {
+            return NULL;
+        }
+        band_task(worker);
+        pthread_barrier_wait(&sim->bands.barrier);
+    }
+}
+
+/* The main thread works as worker 0.
+ */
+static void bands_run(enum band_task task)
+{
+    sim->bands.task = task;
+    pthread_barrier_wait(&sim->bands.barrier);
+    if (task != BAND_QUIT) {
+        band_task(0);
+        pthread_barrier_wait(&sim->bands.barrier);
+    }
+}
+
+static void bands_start(struct agent_move *pending, unsigned char *has_move)
+{
+    int i, n_objects = sim->n_hunters + sim->n_preys;
+    /* A band needs at least two rows so that bands of one parity never
+     * touch the same row, the last band takes the leftover rows
+     */
+    sim->bands.n_bands = sim->height / BAND_ROWS > 0 ? sim->height / BAND_ROWS : 1;
+    sim->bands.bands = calloc(sim->bands.n_bands, sizeof *sim->bands.bands);
+    for (i = 0; i < sim->bands.n_bands; i++) {
+        struct band *band = &sim->bands.bands[i];
+        atomic_init(&band->incoming, -1);
+        band->deaths.events = band->death_slots;
+    }
+    sim->bands.order = malloc(n_objects * sizeof *sim->bands.order);
+    sim->bands.band_start = malloc((sim->bands.n_bands + 1) * sizeof *sim->bands.band_start);
+    sim->bands.handoff_next = malloc(n_objects * sizeof *sim->bands.handoff_next);
+    sim->bands.scratch = malloc((size_t)sim->bands.n_workers * n_objects * sizeof *sim->bands.scratch);
+    sim->bands.old_x = malloc(n_objects * sizeof *sim->bands.old_x);
+    sim->bands.old_y = malloc(n_objects * sizeof *sim->bands.old_y);
+    sim->bands.died = calloc(n_objects, sizeof *sim->bands.died);
+    sim->bands.states = malloc(n_objects * sizeof *sim->bands.states);
+    sim->bands.pending = pending;
+    sim->bands.has_move = has_move;
+    pthread_barrier_init(&sim->bands.barrier, NULL, sim->bands.n_workers);
+    sim->bands.threads = malloc(sim->bands.n_workers * sizeof *sim->bands.threads);
+    for (i = 1; i < sim->bands.n_workers; i++) {
+        sim_thread_create(&sim->bands.threads[i], band_worker, (void *)(intptr_t)i);
+    }
+}
+
+static void bands_stop(void)
+{
+    int i;
+    bands_run(BAND_QUIT);
+    for (i = 1; i < sim->bands.n_workers; i++) {
+        pthread_join(sim->bands.threads[i], NULL);
+    }
+    pthread_barrier_destroy(&sim->bands.barrier);
+    free(sim->bands.threads);
+    for (i = 0; i < sim->bands.n_bands; i++) {
+        free(sim->bands.bands[i].log[0].data);
+        free(sim->bands.bands[i].log[1].data);
+    }
+    free(sim->bands.bands);
+    free(sim->bands.order);
+    free(sim->bands.band_start);
+    free(sim->bands.handoff_next);
+    free(sim->bands.scratch);
+    free(sim->bands.old_x);
+    free(sim->bands.old_y);
+    free(sim->bands.died);
+    free(sim->bands.states);
+}
+
+/* Brings the index, the distance fields, the render and the agents of the
+ * dead up to date after the band workers moved everyone. Positions are
+ * rolled back for a moment since those updates expect the old ones.
+ */
+static void tick_fixup(void)
+{
+    int idx, n_objects = sim->n_hunters + sim->n_preys;
+    for (idx = 0; idx < n_objects; idx++) {
+        int x = sim->agents.x[idx], y = sim->agents.y[idx];
+        int old_x = sim->bands.old_x[idx], old_y = sim->bands.old_y[idx];
+        if (!sim->bands.died[idx] && (x == old_x && y == old_y)) {
+            continue;
+        }
+        grid_touch(grid_idx_(old_x, old_y));
+        grid_touch(grid_idx_(x, y));
+        sim->agents.x[idx] = old_x;
+        sim->agents.y[idx] = old_y;
+        if (sim->bands.died[idx]) {
+            sim->bands.died[idx] = 0;
+            retire_agent(idx);
+            continue;
+        }
+        index_move(idx, x, y);
+        field_move(idx, x, y);
+        sim->agents.x[idx] = x;
+        sim->agents.y[idx] = y;
+    }
+}
+
+/* Appends the bands' records in an order that replays like the tick went:
+ * every band's local moves, then the incoming moves of even bands and then
+ * odd ones. Bands of a phase touched different cells, so their order within
+ * it does not matter.
+ */
+static void log_bands(void)
+{
+    int phase, b;
+    for (phase = 0; phase < 3; phase++) {
+        for (b = 0; b < sim->bands.n_bands; b++) {
+            struct movelog_buf *segment = &sim->bands.bands[b].log[phase > 0];
+            if ((phase > 0 && b % 2 != phase - 1) || segment->len == 0) {
+                continue;
+            }
+            /* Differences start over in every segment */
+            movelog_mark(&sim->log.buf, MOVELOG_SYNC);
+            movelog_reserve(&sim->log.buf, segment->len);
+            memcpy(sim->log.buf.data + sim->log.buf.len, segment->data, segment->len);
+            sim->log.buf.len += segment->len;
+            sim->log.buf.moves += segment->moves;
+            segment->len = 0;
+            segment->moves = 0;
+            segment->last_idx = 0;
+        }
+    }
+}
+
+/* Resolves a tick over bands of BAND_ROWS rows. Each band applies the moves
+ * that stay inside it in index order, then moves across a band edge are
+ * applied by the band they enter, even bands first and odd ones next. The
+ * order only depends on the map, so runs do not change with the number of
+ * workers. Returns whether the map changed.
+ */
+static int resolve_tick_banded(void)
+{
+    int i, b, updated = 0, n_objects = sim->n_hunters + sim->n_preys;
+    for (b = 0; b <= sim->bands.n_bands; b++) {
+        sim->bands.band_start[b] = 0;
+    }
+    for (i = 0; i < n_objects; i++) {
+        if (sim->bands.has_move[i]) {
+            sim->bands.band_start[band_of(sim->agents.x[i]) + 1]++;
+        }
+    }
+    for (b = 0; b < sim->bands.n_bands; b++) {
+        sim->bands.band_start[b + 1] += sim->bands.band_start[b];
+    }
+    for (i = 0; i < n_objects; i++) {
+        if (sim->bands.has_move[i]) {
+            /* Counting sort, band_start[b] ends up at the end of band b */
+            sim->bands.order[sim->bands.band_start[band_of(sim->agents.x[i])]++] = i;
+        }
+    }
+    for (b = sim->bands.n_bands; b > 0; b--) {
+        sim->bands.band_start[b] = sim->bands.band_start[b - 1];
+    }
+    sim->bands.band_start[0] = 0;
+    memcpy(sim->bands.old_x, sim->agents.x, n_objects * sizeof *sim->agents.x);
+    memcpy(sim->bands.old_y, sim->agents.y, n_objects * sizeof *sim->agents.y);
+
+    sim->bands.active = 1;
+    bands_run(BAND_RESOLVE);
+    sim->bands.active = 0;
+    if (sim->log.fd != -1) {
+        log_bands();
+    }
+
+    for (b = 0; b < sim->bands.n_bands; b++) {
+        struct band *band = &sim->bands.bands[b];
+        sim->bench.moves += band->moves;
+        updated |= band->updated;
+        band->moves = 0;
+        band->updated = 0;
+    }
+    tick_fixup();
+    return updated;
+}
+
+/* send_all_states() with the adversary queries and state building spread
+ * over the band workers.
+ */
+static void send_all_states_banded(void)
+{
+    int i;
+    bands_run(BAND_STATES);
+    for (i = 0; i < sim->n_hunters + sim->n_preys; i++) {
+        if (sim->agents.alive[i]) {
+            send_built_state(i, &sim->bands.states[i]);
+        }
+    }
+}
+
+/* Lockstep ticks. Every live agent's move for the tick is collected first,
+ * then they are applied in index order, hunters before preys, and the new
+ * states go out together. A run then depends on what the agents chose and
+ * not on the order their replies arrived in.
+ */
+static void lockstep_save(void)
+{
+    int n_objects = sim->n_hunters + sim->n_preys;
+    memcpy(sim->lockstep.seen, sim->agents.x, n_objects * sizeof *sim->agents.x);
+    memcpy(sim->lockstep.seen + n_objects, sim->agents.y, n_objects * sizeof *sim->agents.y);
+    memcpy(sim->lockstep.seen + 2 * n_objects, sim->agents.energy,
+            n_objects * sizeof *sim->agents.energy);
+    memcpy(sim->lockstep.seen_alive, sim->agents.alive, n_objects);
+}
+
+/* In-process agents decide from the map alone, so a map seen before means
+ * the ticks since then will repeat forever. The map is saved at ticks 1, 2,
+ * 4, 8 and so on, which finds a cycle of length l starting at tick t within
+ * about 2 (t + l) ticks (Brent's algorithm).
+ */
+static int lockstep_cycled(void)
+{
+    int n_objects = sim->n_hunters + sim->n_preys;
+    if (!sim->lockstep.seen) {
+        sim->lockstep.seen = malloc(3 * n_objects * sizeof *sim->lockstep.seen);
+        sim->lockstep.seen_alive = malloc(n_objects);
+        sim->lockstep.power = 1;
+        sim->lockstep.span = 0;
+        lockstep_save();
+        return 0;
+    }
+    if (memcmp(sim->lockstep.seen, sim->agents.x, n_objects * sizeof *sim->agents.x) == 0 &&
+            memcmp(sim->lockstep.seen + n_objects, sim->agents.y,
+                n_objects * sizeof *sim->agents.y) == 0 &&
+            memcmp(sim->lockstep.seen + 2 * n_objects, sim->agents.energy,
+                n_objects * sizeof *sim->agents.energy) == 0 &&
+            memcmp(sim->lockstep.seen_alive, sim->agents.alive, n_objects) == 0) {
+        return 1;
+    }
+    if (++sim->lockstep.span == sim->lockstep.power) {
+        lockstep_save();
+        sim->lockstep.power *= 2;
+        sim->lockstep.span = 0;
+    }
+    return 0;
+}
+
+static void run_lockstep(void)
+{
+    int i, n_objects = sim->n_hunters + sim->n_preys;
+    struct agent_move *moves = malloc(n_objects * sizeof *moves);
+    struct agent_move *pending = malloc(n_objects * sizeof *pending);
+    unsigned char *has_move = calloc(n_objects, sizeof *has_move);
+    int stopped = 0;
+    if (reap_dead() && !sim->quiet) {
+        render_frame(0);
+    }
+    if (sim->bands.n_workers) {
+        bands_start(pending, has_move);
+    }
+    while (!game_over() && !stopped) {
+        int missing = sim->hunters_alive + sim->preys_alive, updated = 0;
+        while (missing > 0) {
+            int k, n_moves = sim->backend->wait(moves, n_objects);
+            for (k = 0; k < n_moves; k++) {
+                int idx = moves[k].idx;
+                if (sim->agents.alive[idx] && !has_move[idx]) {
+                    pending[idx] = moves[k];
+                    has_move[idx] = 1;
+                    missing--;
+                }
+            }
+            render_poll();
+        }
+        if (sim->bands.n_workers) {
+            /* The tick that ends the game or hits the move limit is played
+             * out in full
+             */
+            for (i = 0; i < n_objects; i++) {
+                if (has_move[i] && sim->bench.enabled) {
+                    bench_record(now_ns() - sim->bench.sent_at[i]);
+                }
+            }
+            updated = resolve_tick_banded();
+            stopped = move_limit_reached();
+        }
+        for (i = 0; i < n_objects && !sim->bands.n_workers && !game_over() && !stopped; i++) {
+            if (!has_move[i]) {
+                continue;
+            }
+            if (accept_move(&pending[i])) {
+                updated |= apply_logged(main_log(), i, pending[i].message.move_request.x,
+                        pending[i].message.move_request.y, &sim->deaths);
+            }
+            updated |= reap_dead();
+            stopped = move_limit_reached();
+        }
+        memset(has_move, 0, n_objects * sizeof *has_move);
+        sim->lockstep.ticks++;
+        if (main_log()) {
+            movelog_mark(main_log(), MOVELOG_TICK);
+        }
+        if (deadline_reached()) {
+            stopped = 1;
+        }
+        if (sim->in_process && lockstep_cycled()) {
+            stopped = 1;
+        }
+        if (!game_over() && !stopped) {
+            if (sim->bands.n_workers) {
+                send_all_states_banded();
+            } else {
+                send_all_states();
+            }
+        }
+        if (updated && !sim->quiet) {
+            render_frame(0);
+        }
+        render_poll();
+        log_poll();
+        snapshot_poll();
+    }
+    if (sim->bands.n_workers) {
+        bands_stop();
+    }
+    free(moves);
+    free(pending);
+    free(has_move);
+    free(sim->lockstep.seen);
+    free(sim->lockstep.seen_alive);
+    sim->lockstep.seen = NULL;
+    sim->lockstep.seen_alive = NULL;
+}
+
+static int event_before(const struct sim_event *a, const struct sim_event *b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void schedule_push(long long time, int idx)
+{
+    int i = sim->clock.n_events++;
+    struct sim_event event = { time, sim->clock.seq++, idx };
+    /* Sift up */
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!event_before(&event, &sim->clock.events[parent])) {
+            break;
+        }
+        sim->clock.events[i] = sim->clock.events[parent];
+        i = parent;
+    }
+    sim->clock.events[i] = event;
+}
+
+static struct sim_event schedule_pop(void)
+{
+    struct sim_event top = sim->clock.events[0];
+    struct sim_event last = sim->clock.events[--sim->clock.n_events];
+    int i = 0;
+    /* Sift down */
+    for (;;) {
+        int child = 2*i + 1;
+        if (child >= sim->clock.n_events) {
+            break;
+        }
+        if (child + 1 < sim->clock.n_events &&
+                event_before(&sim->clock.events[child + 1], &sim->clock.events[child])) {
+            child++;
+        }
+        if (!event_before(&sim->clock.events[child], &last)) {
+            break;
+        }
+        sim->clock.events[i] = sim->clock.events[child];
+        i = child;
+    }
+    sim->clock.events[i] = last;
+    return top;
+}
+
+/* Same 10-90 ms pause the agents take between moves */
+#define THINK_MAX_NS 90000000LL
+
+static long long think_time(void)
+{
+    return 10000000LL * (1 + rng_below(&sim->clock.rng, 9));
+}
+
+/* Virtual time. Agents reply at once and the server applies their moves in
+ * the order of their scheduled times, so a run only depends on the seed.
+ * In-process agents decide from the state alone, so once every one of them
+ * has decided on the map as it is and found nothing to do, nothing ever
+ * will change again and the run stops.
+ */
+static void run_virtual(void)
+{
+    int i, n_objects = sim->n_hunters + sim->n_preys;
+    long long changed_at = sim->clock.now;
+    if (!sim->snapshot.restored) {
+        sim->clock.events = malloc(n_objects * sizeof *sim->clock.events);
+        /* Every agent answers its initial state at time zero */
+        for (i = 0; i < n_objects; i++) {
+            schedule_push(0, i);
+        }
+    }
+    if (reap_dead() && !sim->quiet) {
+        render_frame(0);
+    }
+    while (!game_over() && sim->clock.n_events > 0) {
+        struct sim_event event = schedule_pop();
+        struct agent_move move;
+        if (!sim->agents.alive[event.idx]) {
+            /* Died since it was scheduled */
+            continue;
+        }
+        sim->clock.now = event.time;
+        sim->backend->receive(event.idx, &move);
+        int updated = process_move(&move);
+        updated |= reap_dead();
+        if (sim->reap.pending > 0) {
+            /* Nothing polls the signalfd here, pick up exits as we go */
+            reap_children();
+        }
+        if (updated && !sim->quiet) {
+            render_frame(0);
+        }
+        if (sim->agents.alive[event.idx]) {
+            schedule_push(event.time + think_time(), event.idx);
+        }
+        if (updated) {
+            changed_at = event.time;
+        }
+        /* Everyone has decided since the last change and then had that
+         * decision applied
+         */
+        if (sim->in_process && event.time - changed_at > 2 * THINK_MAX_NS) {
+            break;
+        }
+        if (move_limit_reached() || deadline_reached()) {
+            break;
+        }
+        render_poll();
+        log_poll();
+        snapshot_poll();
+    }
+}
+
+void run_simulation(void)
+{
+    if (sim->clock.enabled) {
+        run_virtual();
+    } else if (sim->lockstep.enabled) {
+        run_lockstep();
+    } else {
+        run_realtime();
+    }
+    if (sim->log.fd != -1) {
+        log_close();
+    }
+    if (sim->snapshot.path) {
+        snapshot_take();
+    }
+    if (sim->render.pending) {
+        /* Last changes were held back by the frame rate cap */
+        render_frame(1);
+    }
+    if (sim->bench.enabled) {
+        print_bench_summary();
+    }
+}
+
+static void shard_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("shard_write()");
+            die(ERR_WRITE);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void shard_read(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("shard_read()");
+            die(ERR_READ);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* Grows buf to at least n elements of size bytes */
+static void *shard_reserve(void *buf, int *cap, int n, size_t size)
+{
+    if (n > *cap) {
+        *cap = n > 2 * *cap ? n : 2 * *cap;
+        buf = realloc(buf, *cap * size);
+    }
+    return buf;
+}
+
+/* Hands the sockets of agents moving to a neighbour over the link, one
+ * byte carries up to SHARD_FDS_PER_MSG of them.
+ */
+#define SHARD_FDS_PER_MSG 250
+
+static void shard_send_fds(int fd, const int *fds, int n)
+{
+    int i, sent;
+    for (sent = 0; sent < n; sent += SHARD_FDS_PER_MSG) {
+        int n_fds = n - sent < SHARD_FDS_PER_MSG ? n - sent : SHARD_FDS_PER_MSG;
+        char control[CMSG_SPACE(SHARD_FDS_PER_MSG * sizeof(int))];
+        char byte = 0;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = CMSG_SPACE(n_fds * sizeof(int)),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+        for (i = 0; i < n_fds; i++) {
+            ((int *)CMSG_DATA(cmsg))[i] = fds[sent + i];
+        }
+        if (sendmsg(fd, &msg, 0) != 1) {
+            perror("shard_send_fds()");
+            die(ERR_SOCKET);
+        }
+    }
+}
+
+static void shard_receive_fds(int fd, int *fds, int n)
+{
+    int i, received = 0;
+    while (received < n) {
+        char control[CMSG_SPACE(SHARD_FDS_PER_MSG * sizeof(int))];
+        char byte;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof control,
+        };
+        struct cmsghdr *cmsg;
+        int n_fds;
+        if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+            perror("shard_receive_fds()");
+            die(ERR_SOCKET);
+        }
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+            fprintf(stderr, "shard_receive_fds(): no sockets in message\n");
+            die(ERR_SOCKET);
+        }
+        n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n_fds; i++) {
+            fds[received + i] = ((int *)CMSG_DATA(cmsg))[i];
+        }
+        received += n_fds;
+    }
+}
+
+/* Rows [*lo, *hi) of shard k */
+static void shard_rows(int k, int *lo, int *hi)
+{
+    *lo = (long)k * sim->height / sim->shard.n_shards;
+    *hi = (long)(k + 1) * sim->height / sim->shard.n_shards;
+}
+
+static int shard_owner(int x)
+{
+    int k, lo, hi;
+    for (k = 0; k + 1 < sim->shard.n_shards; k++) {
+        shard_rows(k, &lo, &hi);
+        if (x < hi) {
+            break;
+        }
+    }
+    return k;
+}
+
+/* Room for at least n slots, the new ones go on the spare stack lowest
+ * first
+ */
+static void shard_grow(int n)
+{
+    int k, slot, old = sim->shard.n_slots;
+    if (n <= old) {
+        return;
+    }
+    n = n > 2 * old ? n : 2 * old;
+    agents_resize(n);
+    sim->shard.gid = realloc(sim->shard.gid, n * sizeof *sim->shard.gid);
+    sim->shard.owned = realloc(sim->shard.owned, n * sizeof *sim->shard.owned);
+    sim->shard.spare = realloc(sim->shard.spare, n * sizeof *sim->shard.spare);
+    sim->shard.order = realloc(sim->shard.order, n * sizeof *sim->shard.order);
+    sim->shard.decided = realloc(sim->shard.decided, n * sizeof *sim->shard.decided);
+    sim->shard.adv = realloc(sim->shard.adv, n * sizeof *sim->shard.adv);
+    sim->shard.adv_dist = realloc(sim->shard.adv_dist, n * sizeof *sim->shard.adv_dist);
+    sim->shard.adv_gid = realloc(sim->shard.adv_gid, n * sizeof *sim->shard.adv_gid);
+    sim->shard.rec_of = realloc(sim->shard.rec_of, n * sizeof *sim->shard.rec_of);
+    sim->shard.near = realloc(sim->shard.near, n * sizeof *sim->shard.near);
+    for (k = 0; k < 2; k++) {
+        sim->shard.own_x[k] = realloc(sim->shard.own_x[k], n * sizeof *sim->shard.own_x[k]);
+        sim->shard.own_y[k] = realloc(sim->shard.own_y[k], n * sizeof *sim->shard.own_y[k]);
+        sim->shard.own_slot[k] = realloc(sim->shard.own_slot[k],
+                n * sizeof *sim->shard.own_slot[k]);
+    }
+    for (slot = n - 1; slot >= old; slot--) {
+        sim->shard.owned[slot] = 0;
+        sim->agents.alive[slot] = 0;
+        sim->shard.spare[sim->shard.n_spare++] = slot;
+    }
+    sim->shard.n_slots = n;
+}
+
+/* Takes an agent into a free slot. Agents lent by the shard below for an
+ * edge are held without being owned.
+ */
+static int shard_adopt(const struct shard_record *record, int owned)
+{
+    int slot;
+    if (sim->shard.n_spare == 0) {
+        shard_grow(sim->shard.n_slots + 1);
+    }
+    slot = sim->shard.spare[--sim->shard.n_spare];
+    sim->shard.gid[slot] = record->idx;
+    sim->shard.owned[slot] = owned;
+    sim->shard.held += owned;
+    sim->agents.x[slot] = record->x;
+    sim->agents.y[slot] = record->y;
+    sim->agents.energy[slot] = record->energy;
+    sim->agents.kind[slot] = record->idx < sim->n_hunters ? KIND_HUNTER : KIND_PREY;
+    sim->agents.alive[slot] = 1;
+    sim->agents.fd[slot] = -1;
+    sim->agents.pid[slot] = -1;
+    return slot;
+}
+
+static void shard_release(int slot)
+{
+    sim->shard.held -= sim->shard.owned[slot];
+    sim->shard.owned[slot] = 0;
+    sim->agents.alive[slot] = 0;
+    sim->shard.spare[sim->shard.n_spare++] = slot;
+}
+
+/* Forgets an agent that died or went to another shard, its process sees
+ * the socket close once no shard holds it
+ */
+static void shard_drop(int slot)
+{
+    if (sim->agents.fd[slot] != -1) {
+        close(sim->agents.fd[slot]);
+    }
+    shard_release(slot);
+}
+
+/* Applies a move and settles the deaths it caused, which are counted by
+ * the shard that applied it. Lent agents that die are reported back to
+ * their shard.
+ */
+static void shard_apply(int slot, int x, int y)
+{
+    int i;
+    sim->bench.moves++;
+    apply_move(slot, x, y, &sim->deaths);
+    for (i = 0; i < sim->deaths.count; i++) {
+        int dead = sim->deaths.events[i].idx;
+        if (settle_death(&sim->deaths.events[i])) {
+            if (sim->agents.kind[dead] == KIND_PREY) {
+                sim->bench.preys_caught++;
+            } else {
+                sim->bench.hunters_exhausted++;
+            }
+            if (sim->shard.owned[dead]) {
+                shard_drop(dead);
+            }
+        }
+    }
+    sim->deaths.count = 0;
+}
+
+/* Row x for the halo of a neighbour, which only needs to know the kind of
+ * each agent. Slots 0 and 1 stand for any hunter and any prey there, so
+ * kinds go into the grid as they are.
+ */
+static void shard_write_halo(int fd, int x)
+{
+    int y;
+    for (y = 0; y < sim->width; y++) {
+        int idx = grid_get_idx(x, y);
+        sim->shard.row[y] = idx < 0 ? idx : sim->agents.kind[idx];
+    }
+    shard_write(fd, sim->shard.row, sim->width * sizeof *sim->shard.row);
+}
+
+static void shard_read_halo(int fd, int x)
+{
+    int y;
+    shard_read(fd, sim->shard.row, sim->width * sizeof *sim->shard.row);
+    for (y = 0; y < sim->width; y++) {
+        grid_set(x, y, sim->shard.row[y]);
+    }
+}
+
+/* Row x with each agent given as its record in the package */
+static void shard_write_row(int fd, int x)
+{
+    int y;
+    for (y = 0; y < sim->width; y++) {
+        int idx = grid_get_idx(x, y);
+        sim->shard.row[y] = idx < 0 ? idx : sim->shard.rec_of[idx];
+    }
+    shard_write(fd, sim->shard.row, sim->width * sizeof *sim->shard.row);
+}
+
+static void shard_read_row(int fd, int x)
+{
+    int y;
+    shard_read(fd, sim->shard.row, sim->width * sizeof *sim->shard.row);
+    for (y = 0; y < sim->width; y++) {
+        int idx = sim->shard.row[y];
+        grid_set(x, y, idx < 0 ? idx : sim->shard.slot_of[idx]);
+    }
+}
+
+/* Obstacles and agents of our rows, from the binary scenario still mapped
+ * from before the fork or from the coordinator reading the text one. The
+ * grid holds our rows and a halo row on either side.
+ */
+static void shard_load(void)
+{
+    int k, slot, lo = sim->shard.lo, hi = sim->shard.hi;
+    int base = lo > 0 ? lo - 1 : 0, end = hi < sim->height ? hi + 1 : hi;
+    grid_alloc(base, end - base);
+    sim->shard.row = malloc(sim->width * sizeof *sim->shard.row);
+    shard_grow(64);
+    for (k = 0; k < 2; k++) {
+        slot = sim->shard.spare[--sim->shard.n_spare];
+        sim->shard.gid[slot] = -1;
+        sim->agents.kind[slot] = k;
+    }
+    if (sim->scenario.header) {
+        size_t row_words = scenario_row_words(sim->width);
+        int i, n_objects = sim->n_hunters + sim->n_preys;
+        tiles_load_obstacles(&sim->grid, sim->scenario.obstacles + base * row_words, row_words);
+        for (i = 0; i < n_objects; i++) {
+            const struct scenario_agent *agent = &sim->scenario.agents[i];
+            if (agent->x >= lo && agent->x < hi &&
+                    (!sim->scenario.alive || sim->scenario.alive[i])) {
+                struct shard_record record = { i, agent->x, agent->y, agent->energy };
+                shard_adopt(&record, 1);
+            }
+        }
+        scenario_close(&sim->scenario);
+    } else {
+        int counts[2];
+        for (;;) {
+            struct shard_header header;
+            int i;
+            shard_read(sim->shard.coord_fd, &header, sizeof header);
+            if (header.n_records == 0) {
+                break;
+            }
+            sim->shard.records = shard_reserve(sim->shard.records, &sim->shard.records_cap,
+                    header.n_records, sizeof *sim->shard.records);
+            shard_read(sim->shard.coord_fd, sim->shard.records,
+                    header.n_records * sizeof *sim->shard.records);
+            for (i = 0; i < header.n_records; i++) {
+                struct shard_record record = sim->shard.records[i];
+                if (record.idx == IDX_OBSTACLE) {
+                    grid_set(record.x, record.y, IDX_OBSTACLE);
+                } else {
+                    shard_adopt(&record, 1);
+                }
+            }
+        }
+        /* Kinds are known once the counts have come */
+        shard_read(sim->shard.coord_fd, counts, sizeof counts);
+        sim->n_hunters = counts[0];
+        sim->n_preys = counts[1];
+        for (slot = 2; slot < sim->shard.n_slots; slot++) {
+            sim->agents.kind[slot] = sim->shard.gid[slot] < sim->n_hunters ?
+                KIND_HUNTER : KIND_PREY;
+        }
+    }
+    /* Slots were handed out in scenario order, a later agent on the same
+     * cell wins like in init_agents()
+     */
+    for (slot = 2; slot < sim->shard.n_slots; slot++) {
+        if (sim->shard.owned[slot]) {
+            grid_set(sim->agents.x[slot], sim->agents.y[slot], slot);
+        }
+    }
+    /* Reports carry what changed, the coordinator keeps the totals of a
+     * restored snapshot
+     */
+    sim->bench.moves = 0;
+    sim->bench.preys_caught = 0;
+    sim->bench.hunters_exhausted = 0;
+    sim->deaths.events = malloc(2 * sizeof *sim->deaths.events);
+    sim->deaths.count = 0;
+    for (slot = 2; slot < sim->shard.n_slots; slot++) {
+        struct death_event event = { DEATH_EXHAUSTION, slot };
+        if (sim->shard.owned[slot] && sim->agents.kind[slot] == KIND_HUNTER &&
+                sim->agents.energy[slot] == 0 && settle_death(&event)) {
+            sim->bench.hunters_exhausted++;
+            shard_drop(slot);
+        }
+    }
+}
+
+/* A process for each agent we start with, its socket follows the agent
+ * from shard to shard
+ */
+static void shard_spawn(void)
+{
+    char *const mode[2] = { "-t", "socket" };
+    long long start = now_ns();
+    int slot;
+    for (slot = 2; slot < sim->shard.n_slots; slot++) {
+        if (sim->shard.owned[slot]) {
+            const char *path = sim->agents.kind[slot] == KIND_HUNTER ? "./hunter" : "./prey";
+            int child_fds[2];
+            socket_open(slot, child_fds);
+            sim->agents.pid[slot] = agent_exec(path, mode,
+                    sim->seed + sim->shard.gid[slot], child_fds);
+            close(child_fds[0]);
+            sim->bench.spawned++;
+        }
+    }
+    sim->bench.startup = now_ns() - start;
+}
+
+/* Fills the halo rows from the neighbours. Everyone writes up and then
+ * reads from below, then the other way around, so the shards at the ends
+ * are never both writing.
+ */
+static void shard_swap_halos(void)
+{
+    if (sim->shard.up_fd != -1) {
+        shard_write_halo(sim->shard.up_fd, sim->shard.lo);
+    }
+    if (sim->shard.down_fd != -1) {
+        shard_read_halo(sim->shard.down_fd, sim->shard.hi);
+        shard_write_halo(sim->shard.down_fd, sim->shard.hi - 1);
+    }
+    if (sim->shard.up_fd != -1) {
+        shard_read_halo(sim->shard.up_fd, sim->shard.lo - 1);
+    }
+}
+
+static int compare_gid(const void *a, const void *b)
+{
+    int x = sim->shard.gid[*(const int *)a], y = sim->shard.gid[*(const int *)b];
+    return (x > y) - (x < y);
+}
+
+/* Sorts our agents into scenario order and finds each one's closest
+ * adversary among them. reach[kind] is how far past our rows an agent of
+ * that kind may still find a closer one: its distance to the one found
+ * here, further than the map without one, -1 if we have no such agents.
+ */
+static void shard_index(int reach[2])
+{
+    int i, k, slot;
+    sim->shard.n_order = 0;
+    for (slot = 2; slot < sim->shard.n_slots; slot++) {
+        if (sim->shard.owned[slot]) {
+            sim->shard.order[sim->shard.n_order++] = slot;
+        }
+    }
+    qsort(sim->shard.order, sim->shard.n_order, sizeof *sim->shard.order, compare_gid);
+    sim->shard.n_own[0] = 0;
+    sim->shard.n_own[1] = 0;
+    for (i = 0; i < sim->shard.n_order; i++) {
+        slot = sim->shard.order[i];
+        k = sim->agents.kind[slot];
+        sim->shard.own_x[k][sim->shard.n_own[k]] = sim->agents.x[slot];
+        sim->shard.own_y[k][sim->shard.n_own[k]] = sim->agents.y[slot];
+        sim->shard.own_slot[k][sim->shard.n_own[k]++] = slot;
+    }
+    for (k = 0; k < 2; k++) {
+        int a = !k;
+        reach[k] = sim->shard.n_own[k] > 0 ? 0 : -1;
+        if (sim->shard.n_own[k] > 0 && sim->shard.n_own[a] > 0) {
+            nearest_batch(sim->shard.own_x[a], sim->shard.own_y[a], sim->shard.n_own[a],
+                    sim->shard.own_x[k], sim->shard.own_y[k], sim->shard.n_own[k],
+                    sim->shard.near);
+        }
+        for (i = 0; i < sim->shard.n_own[k]; i++) {
+            slot = sim->shard.own_slot[k][i];
+            if (sim->shard.n_own[a] == 0) {
+                sim->shard.adv_dist[slot] = -1;
+                reach[k] = sim->height + sim->width;
+            } else {
+                int j = sim->shard.near[i];
+                struct coordinate adv = { sim->shard.own_x[a][j], sim->shard.own_y[a][j] };
+                sim->shard.adv[slot] = adv;
+                sim->shard.adv_gid[slot] = sim->shard.gid[sim->shard.own_slot[a][j]];
+                sim->shard.adv_dist[slot] = abs(adv.x - sim->agents.x[slot]) +
+                    abs(adv.y - sim->agents.y[slot]);
+                if (sim->shard.adv_dist[slot] > reach[k]) {
+                    reach[k] = sim->shard.adv_dist[slot];
+                }
+            }
+        }
+    }
+}
+
+/* Tallies of the tick for the coordinator, and the reach of our agents */
+static void shard_send_report(void)
+{
+    struct shard_report report = { sim->bench.moves, sim->bench.preys_caught,
+        sim->bench.hunters_exhausted, { 0, 0 }, { -1, -1 }, 0, tiles_bytes(&sim->grid),
+        sim->bench.spawned, sim->bench.startup };
+    shard_index(report.reach);
+    report.alive[KIND_HUNTER] = sim->shard.n_own[KIND_HUNTER];
+    report.alive[KIND_PREY] = sim->shard.n_own[KIND_PREY];
+    report.held = sim->shard.held;
+    shard_write(sim->shard.coord_fd, &report, sizeof report);
+    sim->bench.spawned = 0;
+    sim->bench.moves = 0;
+    sim->bench.preys_caught = 0;
+    sim->bench.hunters_exhausted = 0;
+}
+
+/* Whether the coordinator goes on, with every shard's reach. Returns 0
+ * when the run is over.
+ */
+static int shard_receive_world(void)
+{
+    int stop;
+    shard_read(sim->shard.coord_fd, &stop, sizeof stop);
+    if (stop) {
+        return 0;
+    }
+    shard_read(sim->shard.coord_fd, sim->shard.reach,
+            sim->shard.n_shards * sizeof *sim->shard.reach);
+    return 1;
+}
+
+static int compare_record(const void *a, const void *b)
+{
+    int x = ((const struct shard_record *)a)->idx, y = ((const struct shard_record *)b)->idx;
+    return (x > y) - (x < y);
+}
+
+/* Our agents that are within reach of another shard's agents go to that
+ * shard through the coordinator, and theirs within reach of ours come
+ * back. A closer adversary found among them wins, on a tie the lower
+ * index wins like in closest_adversary().
+ */
+static void shard_trade_candidates(void)
+{
+    struct shard_header header;
+    int i, k, n_cand[2] = { 0, 0 };
+    sim->shard.records = shard_reserve(sim->shard.records, &sim->shard.records_cap,
+            sim->shard.n_order, sizeof *sim->shard.records);
+    for (k = 0; k < sim->shard.n_shards; k++) {
+        int lo, hi;
+        if (k == sim->shard.id) {
+            continue;
+        }
+        shard_rows(k, &lo, &hi);
+        header.n_records = 0;
+        header.n_moves = 0;
+        for (i = 0; i < sim->shard.n_order; i++) {
+            int slot = sim->shard.order[i], x = sim->agents.x[slot];
+            int reach = sim->shard.reach[k][!sim->agents.kind[slot]];
+            int gap = x < lo ? lo - x : x >= hi ? x - hi + 1 : 0;
+            if (reach >= 0 && gap <= reach) {
+                struct shard_record record = { sim->shard.gid[slot], x, sim->agents.y[slot],
+                    sim->agents.energy[slot] };
+                sim->shard.records[header.n_records++] = record;
+            }
+        }
+        shard_write(sim->shard.coord_fd, &header, sizeof header);
+        shard_write(sim->shard.coord_fd, sim->shard.records,
+                header.n_records * sizeof *sim->shard.records);
+    }
+    shard_read(sim->shard.coord_fd, &header, sizeof header);
+    sim->shard.records = shard_reserve(sim->shard.records, &sim->shard.records_cap,
+            header.n_records, sizeof *sim->shard.records);
+    shard_read(sim->shard.coord_fd, sim->shard.records,
+            header.n_records * sizeof *sim->shard.records);
+    qsort(sim->shard.records, header.n_records, sizeof *sim->shard.records, compare_record);
+    for (k = 0; k < 2; k++) {
+        sim->shard.cand_x[k] = shard_reserve(sim->shard.cand_x[k], &sim->shard.cand_cap[k],
+                header.n_records, sizeof *sim->shard.cand_x[k]);
+        /* Same capacity as cand_x[k] */
+        sim->shard.cand_y[k] = realloc(sim->shard.cand_y[k],
+                sim->shard.cand_cap[k] * sizeof *sim->shard.cand_y[k]);
+        sim->shard.cand_gid[k] = realloc(sim->shard.cand_gid[k],
+                sim->shard.cand_cap[k] * sizeof *sim->shard.cand_gid[k]);
+    }
+    for (i = 0; i < header.n_records; i++) {
+        struct shard_record record = sim->shard.records[i];
+        k = record.idx < sim->n_hunters ? KIND_HUNTER : KIND_PREY;
+        sim->shard.cand_x[k][n_cand[k]] = record.x;
+        sim->shard.cand_y[k][n_cand[k]] = record.y;
+        sim->shard.cand_gid[k][n_cand[k]++] = record.idx;
+    }
+    for (k = 0; k < 2; k++) {
+        int a = !k;
+        if (sim->shard.n_own[k] == 0 || n_cand[a] == 0) {
+            continue;
+        }
+        nearest_batch(sim->shard.cand_x[a], sim->shard.cand_y[a], n_cand[a],
+                sim->shard.own_x[k], sim->shard.own_y[k], sim->shard.n_own[k], sim->shard.near);
+        for (i = 0; i < sim->shard.n_own[k]; i++) {
+            int slot = sim->shard.own_slot[k][i], j = sim->shard.near[i];
+            struct coordinate adv = { sim->shard.cand_x[a][j], sim->shard.cand_y[a][j] };
+            int dist = abs(adv.x - sim->agents.x[slot]) + abs(adv.y - sim->agents.y[slot]);
+            if (sim->shard.adv_dist[slot] == -1 || dist < sim->shard.adv_dist[slot] ||
+                    (dist == sim->shard.adv_dist[slot] &&
+                     sim->shard.cand_gid[a][j] < sim->shard.adv_gid[slot])) {
+                sim->shard.adv[slot] = adv;
+                sim->shard.adv_gid[slot] = sim->shard.cand_gid[a][j];
+                sim->shard.adv_dist[slot] = dist;
+            }
+        }
+    }
+}
+
+/* Every agent decides on the map as the tick starts, in process or in its
+ * own process. All states go out before any move is read, so the agents
+ * of a shard think at the same time.
+ */
+static void shard_decide(void)
+{
+    int i;
+    for (i = 0; i < sim->shard.n_order; i++) {
+        int slot = sim->shard.order[i];
+        struct server_message state;
+        /* The game would be over */
+        assert(sim->shard.adv_dist[slot] != -1);
+        build_state_at(slot, sim->shard.adv[slot], &state);
+        if (sim->in_process) {
+            agent_decide_fn decide = sim->agents.kind[slot] == KIND_HUNTER ?
+                hunter_decide : prey_decide;
+            sim->shard.decided[slot] = decide(&state, sim->width, sim->height);
+        } else {
+            socket_send(slot, &state);
+        }
+    }
+    if (!sim->in_process) {
+        for (i = 0; i < sim->shard.n_order; i++) {
+            int slot = sim->shard.order[i];
+            struct agent_move move;
+            socket_receive(slot, &move, 1);
+            sim->shard.decided[slot] = move.message.move_request;
+        }
+    }
+}
+
+/* A step to a neighbouring cell or staying put, anything else is dropped */
+static int shard_step_valid(int slot, struct coordinate to)
+{
+    return to.x >= 0 && to.x < sim->height && to.y >= 0 && to.y < sim->width &&
+        abs(to.x - sim->agents.x[slot]) + abs(to.y - sim->agents.y[slot]) <= 1;
+}
+
+/* Moves that stay within the owned rows, in index order. Moves across an
+ * edge wait for the boundary.
+ */
+static void shard_local(void)
+{
+    int i;
+    for (i = 0; i < sim->shard.n_order; i++) {
+        int slot = sim->shard.order[i];
+        struct coordinate to = sim->shard.decided[slot];
+        if (sim->shard.owned[slot] && to.x >= sim->shard.lo && to.x < sim->shard.hi &&
+                shard_step_valid(slot, to)) {
+            shard_apply(slot, to.x, to.y);
+        }
+    }
+}
+
+/* Lends the top row and the agents on it to the shard above, which
+ * resolves the edge. The agents stay ours until the answer comes.
+ */
+static void shard_send_up(void)
+{
+    struct shard_header header = { 0, 0 };
+    int i, lo = sim->shard.lo;
+    sim->shard.records = shard_reserve(sim->shard.records, &sim->shard.records_cap,
+            sim->shard.n_order, sizeof *sim->shard.records);
+    sim->shard.moves = shard_reserve(sim->shard.moves, &sim->shard.moves_cap,
+            sim->shard.n_order, sizeof *sim->shard.moves);
+    sim->shard.lent = shard_reserve(sim->shard.lent, &sim->shard.lent_cap,
+            sim->shard.n_order, sizeof *sim->shard.lent);
+    for (i = 0; i < sim->shard.n_order; i++) {
+        int slot = sim->shard.order[i];
+        if (sim->shard.owned[slot] && sim->agents.x[slot] == lo) {
+            struct shard_record record = { sim->shard.gid[slot], lo, sim->agents.y[slot],
+                sim->agents.energy[slot] };
+            sim->shard.rec_of[slot] = header.n_records;
+            sim->shard.lent[header.n_records] = slot;
+            sim->shard.records[header.n_records++] = record;
+        }
+    }
+    sim->shard.n_lent = header.n_records;
+    for (i = 0; i < sim->shard.n_lent; i++) {
+        int slot = sim->shard.lent[i];
+        struct coordinate to = sim->shard.decided[slot];
+        if (to.x == lo - 1 && shard_step_valid(slot, to)) {
+            struct shard_move move = { i, to.x, to.y };
+            sim->shard.moves[header.n_moves++] = move;
+        }
+    }
+    shard_write(sim->shard.up_fd, &header, sizeof header);
+    shard_write(sim->shard.up_fd, sim->shard.records, header.n_records * sizeof *sim->shard.records);
+    shard_write(sim->shard.up_fd, sim->shard.moves, header.n_moves * sizeof *sim->shard.moves);
+    shard_write_row(sim->shard.up_fd, lo);
+}
+
+static int compare_move(const void *a, const void *b)
+{
+    int x = sim->shard.gid[((const struct shard_move *)a)->idx];
+    int y = sim->shard.gid[((const struct shard_move *)b)->idx];
+    return (x > y) - (x < y);
+}
+
+/* Resolves every move across the edge with the shard below, theirs and
+ * ours, in index order like everywhere else. The lent agents come back
+ * with where they ended up, followed by ours that went down, and the
+ * agents that came up stay here.
+ */
+static void shard_resolve_down(void)
+{
+    struct shard_header header;
+    int i, n_moves, n_lent, n_records, n_up = 0, hi = sim->shard.hi;
+    shard_read(sim->shard.down_fd, &header, sizeof header);
+    n_lent = header.n_records;
+    sim->shard.records = shard_reserve(sim->shard.records, &sim->shard.records_cap,
+            n_lent + sim->shard.n_order, sizeof *sim->shard.records);
+    sim->shard.moves = shard_reserve(sim->shard.moves, &sim->shard.moves_cap,
+            header.n_moves + sim->shard.n_order, sizeof *sim->shard.moves);
+    sim->shard.slot_of = shard_reserve(sim->shard.slot_of, &sim->shard.slot_of_cap,
+            n_lent, sizeof *sim->shard.slot_of);
+    sim->shard.handoff = shard_reserve(sim->shard.handoff, &sim->shard.handoff_cap,
+            n_lent + sim->shard.n_order, sizeof *sim->shard.handoff);
+    shard_read(sim->shard.down_fd, sim->shard.records, n_lent * sizeof *sim->shard.records);
+    shard_read(sim->shard.down_fd, sim->shard.moves, header.n_moves * sizeof *sim->shard.moves);
+    for (i = 0; i < n_lent; i++) {
+        sim->shard.slot_of[i] = shard_adopt(&sim->shard.records[i], 0);
+    }
+    shard_read_row(sim->shard.down_fd, hi);
+
+    n_moves = header.n_moves;
+    for (i = 0; i < n_moves; i++) {
+        sim->shard.moves[i].idx = sim->shard.slot_of[sim->shard.moves[i].idx];
+    }
+    for (i = 0; i < sim->shard.n_order; i++) {
+        int slot = sim->shard.order[i];
+        struct coordinate to = sim->shard.decided[slot];
+        if (sim->shard.owned[slot] && sim->agents.x[slot] == hi - 1 && to.x == hi &&
+                shard_step_valid(slot, to)) {
+            struct shard_move move = { slot, to.x, to.y };
+            sim->shard.moves[n_moves++] = move;
+        }
+    }
+    qsort(sim->shard.moves, n_moves, sizeof *sim->shard.moves, compare_move);
+    for (i = 0; i < n_moves; i++) {
+        struct shard_move move = sim->shard.moves[i];
+        if (sim->agents.alive[move.idx]) {
+            shard_apply(move.idx, move.x, move.y);
+        }
+    }
+
+    for (i = 0; i < n_lent; i++) {
+        int slot = sim->shard.slot_of[i];
+        struct shard_record record = { sim->shard.gid[slot], NEAREST_FAR, NEAREST_FAR,
+            sim->agents.energy[slot] };
+        if (sim->agents.alive[slot]) {
+            record.x = sim->agents.x[slot];
+            record.y = sim->agents.y[slot];
+        }
+        sim->shard.rec_of[slot] = i;
+        sim->shard.records[i] = record;
+    }
+    n_records = n_lent;
+    for (i = 0; i < sim->shard.n_order; i++) {
+        int slot = sim->shard.order[i];
+        if (sim->shard.owned[slot] && sim->agents.x[slot] == hi) {
+            struct shard_record record = { sim->shard.gid[slot], hi, sim->agents.y[slot],
+                sim->agents.energy[slot] };
+            sim->shard.handoff[n_records - n_lent] = sim->agents.fd[slot];
+            sim->shard.rec_of[slot] = n_records;
+            sim->shard.records[n_records++] = record;
+        }
+    }
+    header.n_records = n_records;
+    header.n_moves = 0;
+    shard_write(sim->shard.down_fd, &header, sizeof header);
+    shard_write(sim->shard.down_fd, sim->shard.records, n_records * sizeof *sim->shard.records);
+    shard_write_row(sim->shard.down_fd, hi);
+    shard_write_halo(sim->shard.down_fd, hi - 1);
+    if (!sim->in_process) {
+        shard_send_fds(sim->shard.down_fd, sim->shard.handoff, n_records - n_lent);
+    }
+
+    /* Row hi goes back to being a halo */
+    for (i = 0; i < sim->width; i++) {
+        int idx = grid_get_idx(hi, i);
+        if (idx >= 2) {
+            grid_set(hi, i, sim->agents.kind[idx]);
+        }
+    }
+    for (i = 0; i < sim->shard.n_order; i++) {
+        int slot = sim->shard.order[i];
+        if (sim->shard.owned[slot] && sim->agents.x[slot] == hi) {
+            shard_drop(slot);
+        }
+    }
+    for (i = 0; i < n_lent; i++) {
+        int slot = sim->shard.slot_of[i];
+        if (sim->agents.alive[slot] && sim->agents.x[slot] == hi - 1) {
+            sim->shard.owned[slot] = 1;
+            sim->shard.held++;
+            sim->shard.slot_of[n_up++] = slot;
+        } else {
+            shard_release(slot);
+        }
+    }
+    if (!sim->in_process) {
+        shard_receive_fds(sim->shard.down_fd, sim->shard.handoff, n_up);
+        for (i = 0; i < n_up; i++) {
+            sim->agents.fd[sim->shard.slot_of[i]] = sim->shard.handoff[i];
+        }
+    }
+}
+
+/* Takes back the top row, the halo row above it and the lent agents from
+ * the shard above, with the agents that came down. The sockets of the
+ * agents that went up follow them.
+ */
+static void shard_receive_up(void)
+{
+    struct shard_header header;
+    int i, n_up = 0, lo = sim->shard.lo, n_lent = sim->shard.n_lent;
+    shard_read(sim->shard.up_fd, &header, sizeof header);
+    sim->shard.records = shard_reserve(sim->shard.records, &sim->shard.records_cap,
+            header.n_records, sizeof *sim->shard.records);
+    sim->shard.slot_of = shard_reserve(sim->shard.slot_of, &sim->shard.slot_of_cap,
+            header.n_records, sizeof *sim->shard.slot_of);
+    sim->shard.handoff = shard_reserve(sim->shard.handoff, &sim->shard.handoff_cap,
+            header.n_records, sizeof *sim->shard.handoff);
+    shard_read(sim->shard.up_fd, sim->shard.records, header.n_records * sizeof *sim->shard.records);
+    for (i = 0; i < n_lent; i++) {
+        int slot = sim->shard.lent[i];
+        struct shard_record record = sim->shard.records[i];
+        if (record.x == lo) {
+            sim->agents.y[slot] = record.y;
+            sim->agents.energy[slot] = record.energy;
+            sim->shard.slot_of[i] = slot;
+        } else if (record.x == NEAREST_FAR) {
+            /* Counted by the shard above */
+            shard_drop(slot);
+        } else {
+            sim->shard.handoff[n_up++] = sim->agents.fd[slot];
+            sim->agents.fd[slot] = -1;
+            shard_release(slot);
+        }
+    }
+    for (i = n_lent; i < header.n_records; i++) {
+        sim->shard.slot_of[i] = shard_adopt(&sim->shard.records[i], 1);
+    }
+    shard_read_row(sim->shard.up_fd, lo);
+    shard_read_halo(sim->shard.up_fd, lo - 1);
+    if (!sim->in_process) {
+        int n_down = header.n_records - n_lent;
+        /* After the ones going up, n_up never reaches them */
+        int *down_fds = sim->shard.handoff + n_up;
+        shard_receive_fds(sim->shard.up_fd, down_fds, n_down);
+        for (i = 0; i < n_down; i++) {
+            sim->agents.fd[sim->shard.slot_of[n_lent + i]] = down_fds[i];
+        }
+        shard_send_fds(sim->shard.up_fd, sim->shard.handoff, n_up);
+        for (i = 0; i < n_up; i++) {
+            close(sim->shard.handoff[i]);
+        }
+    }
+}
+
+/* A shard plays lockstep ticks on its rows. Moves inside the rows go
+ * first, then each edge is resolved by the shard above it. The edges of a
+ * shard are different rows, so all of them are resolved at once.
+ */
+static void shard_main(void)
+{
+    int slot;
+    sim->shard.reach = malloc(sim->shard.n_shards * sizeof *sim->shard.reach);
+    shard_load();
+    if (!sim->in_process) {
+        shard_spawn();
+    }
+    shard_swap_halos();
+    shard_send_report();
+    while (shard_receive_world()) {
+        shard_trade_candidates();
+        shard_decide();
+        shard_local();
+        if (sim->shard.up_fd != -1) {
+            shard_send_up();
+        }
+        if (sim->shard.down_fd != -1) {
+            shard_resolve_down();
+        }
+        if (sim->shard.up_fd != -1) {
+            shard_receive_up();
+        }
+        /* Agents that died saw their socket close */
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        }
+        shard_send_report();
+    }
+    for (slot = 2; slot < sim->shard.n_slots; slot++) {
+        if (sim->shard.owned[slot]) {
+            shard_drop(slot);
+        }
+    }
+    close(sim->shard.coord_fd);
+    if (sim->shard.up_fd != -1) {
+        close(sim->shard.up_fd);
+    }
+    if (sim->shard.down_fd != -1) {
+        close(sim->shard.down_fd);
+    }
+    while (waitpid(-1, NULL, 0) > 0) {
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/* Records for shard k go out a chunk at a time while loading */
+#define SHARD_CHUNK 4096
+
+static void coordinator_flush(int k)
+{
+    struct shard_header header = { sim->shard.n_relay[k], 0 };
+    shard_write(sim->shard.fds[k], &header, sizeof header);
+    shard_write(sim->shard.fds[k], sim->shard.relay[k],
+            header.n_records * sizeof *sim->shard.relay[k]);
+    sim->shard.n_relay[k] = 0;
+}
+
+static void coordinator_queue(int k, const struct shard_record *record)
+{
+    if (sim->shard.n_relay[k] == SHARD_CHUNK) {
+        coordinator_flush(k);
+    }
+    sim->shard.relay[k][sim->shard.n_relay[k]++] = *record;
+}
+
+static void coordinator_load_agents(int first, int n)
+{
+    int i;
+    for (i = first; i < first + n; i++) {
+        struct shard_record record = { i, 0, 0, 0 };
+        if (fscanf(sim->input, "%d %d %d", &record.x, &record.y, &record.energy) != 3 ||
+                record.x < 0 || record.x >= sim->height || record.y < 0 ||
+                record.y >= sim->width || record.energy < 0) {
+            die(ERR_INPUT);
+        }
+        coordinator_queue(shard_owner(record.x), &record);
+    }
+}
+
+/* Reads the text scenario on behalf of the shards, each one gets the
+ * obstacles of the rows it holds and the agents of the rows it owns.
+ * Nothing is kept here.
+ */
+static void coordinator_load_text(void)
+{
+    int i, k, n_obstacles, counts[2];
+    struct shard_header end = { 0, 0 };
+    for (k = 0; k < sim->shard.n_shards; k++) {
+        sim->shard.relay[k] = shard_reserve(sim->shard.relay[k], &sim->shard.relay_cap[k],
+                SHARD_CHUNK, sizeof *sim->shard.relay[k]);
+    }
+    if (fscanf(sim->input, "%d", &n_obstacles) != 1) {
+        die(ERR_INPUT);
+    }
+    for (i = 0; i < n_obstacles; i++) {
+        struct shard_record record = { IDX_OBSTACLE, 0, 0, 0 };
+        if (fscanf(sim->input, "%d %d", &record.x, &record.y) != 2 ||
+                record.x < 0 || record.x >= sim->height || record.y < 0 ||
+                record.y >= sim->width) {
+            die(ERR_INPUT);
+        }
+        /* Its own shard, and a neighbour with it in a halo row */
+        k = shard_owner(record.x);
+        coordinator_queue(k, &record);
+        if (k > 0 && shard_owner(record.x - 1) == k - 1) {
+            coordinator_queue(k - 1, &record);
+        }
+        if (k + 1 < sim->shard.n_shards && shard_owner(record.x + 1) == k + 1) {
+            coordinator_queue(k + 1, &record);
+        }
+    }
+    if (fscanf(sim->input, "%d", &sim->n_hunters) != 1) {
+        die(ERR_INPUT);
+    }
+    coordinator_load_agents(0, sim->n_hunters);
+    if (fscanf(sim->input, "%d", &sim->n_preys) != 1) {
+        die(ERR_INPUT);
+    }
+    coordinator_load_agents(sim->n_hunters, sim->n_preys);
+    counts[0] = sim->n_hunters;
+    counts[1] = sim->n_preys;
+    for (k = 0; k < sim->shard.n_shards; k++) {
+        if (sim->shard.n_relay[k] > 0) {
+            coordinator_flush(k);
+        }
+        shard_write(sim->shard.fds[k], &end, sizeof end);
+        shard_write(sim->shard.fds[k], counts, sizeof counts);
+    }
+}
+
+/* Merges the shards' tallies and reach, returns whether to go on */
+static int coordinator_gather(void)
+{
+    int k;
+    sim->hunters_alive = 0;
+    sim->preys_alive = 0;
+    for (k = 0; k < sim->shard.n_shards; k++) {
+        struct shard_report report;
+        shard_read(sim->shard.fds[k], &report, sizeof report);
+        sim->shard.reach[k][KIND_HUNTER] = report.reach[KIND_HUNTER];
+        sim->shard.reach[k][KIND_PREY] = report.reach[KIND_PREY];
+        sim->hunters_alive += report.alive[KIND_HUNTER];
+        sim->preys_alive += report.alive[KIND_PREY];
+        sim->bench.moves += report.moves;
+        sim->bench.preys_caught += report.preys_caught;
+        sim->bench.hunters_exhausted += report.hunters_exhausted;
+        if (report.held > sim->shard.max_held) {
+            sim->shard.max_held = report.held;
+        }
+        if (report.grid_bytes > sim->shard.max_grid_bytes) {
+            sim->shard.max_grid_bytes = report.grid_bytes;
+        }
+        /* Shards start their agents side by side */
+        sim->bench.spawned += report.spawned;
+        if (report.startup > sim->bench.startup) {
+            sim->bench.startup = report.startup;
+        }
+    }
+    return !game_over() && !move_limit_reached() && !deadline_reached();
+}
+
+static void coordinator_broadcast(int stop)
+{
+    int k;
+    for (k = 0; k < sim->shard.n_shards; k++) {
+        shard_write(sim->shard.fds[k], &stop, sizeof stop);
+        if (!stop) {
+            shard_write(sim->shard.fds[k], sim->shard.reach,
+                    sim->shard.n_shards * sizeof *sim->shard.reach);
+        }
+    }
+}
+
+/* Passes the candidates from every shard on to the shards they are for */
+static void coordinator_relay(void)
+{
+    int j, k;
+    for (j = 0; j < sim->shard.n_shards; j++) {
+        for (k = 0; k < sim->shard.n_shards; k++) {
+            struct shard_header header;
+            if (k == j) {
+                continue;
+            }
+            shard_read(sim->shard.fds[j], &header, sizeof header);
+            sim->shard.relay[k] = shard_reserve(sim->shard.relay[k], &sim->shard.relay_cap[k],
+                    sim->shard.n_relay[k] + header.n_records, sizeof *sim->shard.relay[k]);
+            shard_read(sim->shard.fds[j], sim->shard.relay[k] + sim->shard.n_relay[k],
+                    header.n_records * sizeof *sim->shard.relay[k]);
+            sim->shard.n_relay[k] += header.n_records;
+        }
+    }
+    for (k = 0; k < sim->shard.n_shards; k++) {
+        coordinator_flush(k);
+    }
+}
+
+/* Sharded world. The coordinator forks one process per slice of rows,
+ * neighbours are linked by a socket pair for their edge rows and the
+ * agents crossing them. A shard holds its rows, a halo row on either
+ * side, and the agents on its rows along with their sockets, which move
+ * with an agent from shard to shard.
+ *
+ * The coordinator holds neither grid nor agents. After each tick it sums
+ * up the shards' tallies and decides whether the game goes on. Each shard
+ * also reports how far its agents of each kind are from the closest
+ * adversary it holds, and every shard sends the agents within that reach
+ * of another shard's rows to it, so the closest adversary is the same as
+ * in one process. Only a shard with no adversary of its own, late in a
+ * game, gets all of them.
+ */
+static void run_sharded(void)
+{
+    int k, n_shards = sim->shard.n_shards;
+    int (*links)[2];
+    int c = getc(sim->input);
+    ungetc(c, sim->input);
+    if (c == SCENARIO_MAGIC[0]) {
+        /* The shards take their rows from the mapping */
+        if (scenario_load(sim->input, &sim->scenario) == -1) {
+            die(ERR_INPUT);
+        }
+        sim->width = sim->scenario.header->width;
+        sim->height = sim->scenario.header->height;
+        sim->n_hunters = sim->scenario.header->n_hunters;
+        sim->n_preys = sim->scenario.header->n_preys;
+        if (sim->scenario.state) {
+            sim->bench.moves = sim->scenario.state->moves;
+            sim->bench.preys_caught = sim->scenario.state->preys_caught;
+            sim->bench.hunters_exhausted = sim->scenario.state->hunters_exhausted;
+            sim->lockstep.ticks = sim->scenario.state->ticks;
+        }
+    } else if (fscanf(sim->input, "%d %d", &sim->width, &sim->height) != 2 ||
+            sim->width < 1 || sim->height < 1) {
+        die(ERR_INPUT);
+    }
+    if (sim->height / n_shards < 2) {
+        /* Edges of a shard must be different rows */
+        die(ERR_USAGE);
+    }
+    sim->shard.fds = malloc(n_shards * sizeof *sim->shard.fds);
+    sim->shard.pids = malloc(n_shards * sizeof *sim->shard.pids);
+    sim->shard.reach = malloc(n_shards * sizeof *sim->shard.reach);
+    sim->shard.relay = calloc(n_shards, sizeof *sim->shard.relay);
+    sim->shard.n_relay = calloc(n_shards, sizeof *sim->shard.n_relay);
+    sim->shard.relay_cap = calloc(n_shards, sizeof *sim->shard.relay_cap);
+    links = malloc(n_shards * sizeof *links);
+    for (k = 0; k + 1 < n_shards; k++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, links[k]) == -1) {
+            perror("run_sharded()");
+            die(ERR_SOCKET);
+        }
+    }
+    for (k = 0; k < n_shards; k++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+            perror("run_sharded()");
+            die(ERR_SOCKET);
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("run_sharded()");
+            die(ERR_FORK);
+        }
+        if (pid == 0) {
+            int j;
+            for (j = 0; j < k; j++) {
+                close(sim->shard.fds[j]);
+            }
+            sim->shard.up_fd = k > 0 ? links[k - 1][1] : -1;
+            sim->shard.down_fd = k + 1 < n_shards ? links[k][0] : -1;
+            for (j = 0; j + 1 < n_shards; j++) {
+                if (j != k - 1) {
+                    close(links[j][1]);
+                }
+                if (j != k) {
+                    close(links[j][0]);
+                }
+            }
+            free(links);
+            free(sim->shard.fds);
+            free(sim->shard.pids);
+            free(sim->shard.reach);
+            free(sim->shard.relay);
+            free(sim->shard.n_relay);
+            free(sim->shard.relay_cap);
+            sim->shard.fds = NULL;
+            close(sv[0]);
+            sim->shard.id = k;
+            shard_rows(k, &sim->shard.lo, &sim->shard.hi);
+            sim->shard.coord_fd = sv[1];
+            shard_main();
+        }
+        close(sv[1]);
+        sim->shard.fds[k] = sv[0];
+        sim->shard.pids[k] = pid;
+    }
+    for (k = 0; k + 1 < n_shards; k++) {
+        close(links[k][0]);
+        close(links[k][1]);
+    }
+    free(links);
+    if (sim->scenario.header) {
+        scenario_close(&sim->scenario);
+    } else {
+        coordinator_load_text();
+    }
+
+    sim->bench.start = now_ns();
+    while (coordinator_gather()) {
+        coordinator_broadcast(0);
+        coordinator_relay();
+        sim->lockstep.ticks++;
+    }
+    coordinator_broadcast(1);
+    for (k = 0; k < n_shards; k++) {
+        if (waitpid(sim->shard.pids[k], NULL, 0) == -1) {
+            perror("run_sharded()");
+            die(ERR_WAIT);
+        }
+        close(sim->shard.fds[k]);
+    }
+    printf("shards: %d, at most %d agents and %zu KiB of grid in one\n", n_shards,
+            sim->shard.max_held, sim->shard.max_grid_bytes / 1024);
+    print_bench_summary();
+    for (k = 0; k < n_shards; k++) {
+        free(sim->shard.relay[k]);
+    }
+    free(sim->shard.relay);
+    free(sim->shard.n_relay);
+    free(sim->shard.relay_cap);
+    free(sim->shard.reach);
+    free(sim->shard.fds);
+    free(sim->shard.pids);
+}
+
+/* Batch mode, -R jobs. Every line of jobs names a scenario file and
+ * optionally a seed, each is played out with agents decided in process,
+ * and workers take jobs until none are left. Runs use the virtual clock,
+ * where the seed picks the agents' think times. Under -L they play
+ * lockstep ticks, which only depend on the map, and a job is rejected if
+ * it names a seed.
+ */
+enum winner {
+    WINNER_NONE,
+    WINNER_HUNTERS,
+    WINNER_PREYS,
+};
+
+struct batch_job {
+    char *path;
+    unsigned seed;
+    enum winner winner;
+    /* Virtual milliseconds, or lockstep ticks under -L */
+    long ticks;
+    int captures;
+    int exhausted;
+    long energy;
+};
+
+static struct {
+    /* Every job starts from a copy of these */
+    const struct sim *options;
+    struct batch_job *jobs;
+    int n_jobs;
+    _Atomic int next;
+} batch;
+
+static void batch_read(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    int cap_jobs = 0;
+    if (!in) {
+        perror(path);
+        die(ERR_INPUT);
+    }
+    while (getline(&line, &cap, in) != -1) {
+        struct batch_job job = { .seed = batch.options->seed };
+        char *name = malloc(strlen(line) + 1);
+        int n = sscanf(line, "%s %u", name, &job.seed);
+        if (n < 1 || name[0] == '#') {
+            /* Blank or a comment */
+            free(name);
+            continue;
+        }
+        if (n == 2 && batch.options->lockstep.enabled) {
+            /* Every seed would give the same run */
+            fprintf(stderr, "%s: seed given for a lockstep job\n", name);
+            die(ERR_INPUT);
+        }
+        job.path = name;
+        if (batch.n_jobs == cap_jobs) {
+            cap_jobs = cap_jobs ? 2 * cap_jobs : 16;
+            batch.jobs = realloc(batch.jobs, cap_jobs * sizeof *batch.jobs);
+        }
+        batch.jobs[batch.n_jobs++] = job;
+    }
+    free(line);
+    fclose(in);
+}
+
+/* A job stops when one side is gone, at -m or -d, or when it stalls. A
+ * lockstep job stalls when its map comes back to one seen before, a
+ * virtual one when every agent stays put. Preys can also keep dodging
+ * hunters that never get closer, a virtual run then goes on until the
+ * limit because its think times never repeat.
+ */
+static void batch_run(struct batch_job *job)
+{
+    struct sim *run = malloc(sizeof *run);
+    int i;
+    *run = *batch.options;
+    sim = run;
+    sim->input = fopen(job->path, "r");
+    if (!sim->input) {
+        perror(job->path);
+        die(ERR_INPUT);
+    }
+    sim->seed = job->seed;
+    sim->seeded = 1;
+    rng_seed(&sim->clock.rng, sim->seed);
+    init_map();
+    fclose(sim->input);
+    run_simulation();
+
+    job->winner = sim->preys_alive == 0 ? WINNER_HUNTERS :
+        sim->hunters_alive == 0 ? WINNER_PREYS : WINNER_NONE;
+    job->ticks = sim->clock.enabled ? sim->clock.now / 1000000 : sim->lockstep.ticks;
+    job->captures = sim->bench.preys_caught;
+    job->exhausted = sim->bench.hunters_exhausted;
+    job->energy = 0;
+    for (i = 0; i < sim->n_hunters; i++) {
+        job->energy += sim->agents.alive[i] ? sim->agents.energy[i] : 0;
+    }
+    clean_map();
+    free(run);
+    sim = NULL;
+}
+
+static void *batch_worker(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        int i = atomic_fetch_add(&batch.next, 1);
+        if (i >= batch.n_jobs) {
+            return NULL;
+        }
+        batch_run(&batch.jobs[i]);
+    }
+}
+
+static void batch_report(int n_workers, double elapsed)
+{
+    static const char *names[] = { "none", "hunters", "preys" };
+    const char *unit = batch.options->clock.enabled ? "ms" : "ticks";
+    int i, wins[3] = { 0, 0, 0 };
+    long min_ticks = 0, max_ticks = 0;
+    double ticks = 0, captures = 0, energy = 0;
+    printf("scenario seed winner %s captures exhausted energy\n", unit);
+    for (i = 0; i < batch.n_jobs; i++) {
+        const struct batch_job *job = &batch.jobs[i];
+        printf("%s %u %s %ld %d %d %ld\n", job->path, job->seed, names[job->winner],
+                job->ticks, job->captures, job->exhausted, job->energy);
+        wins[job->winner]++;
+        ticks += job->ticks;
+        captures += job->captures;
+        energy += job->energy;
+        if (i == 0 || job->ticks < min_ticks) {
+            min_ticks = job->ticks;
+        }
+        if (i == 0 || job->ticks > max_ticks) {
+            max_ticks = job->ticks;
+        }
+    }
+    if (batch.n_jobs == 0) {
+        return;
+    }
+    printf("runs: %d in %.3f s on %d workers, won by hunters %d, preys %d, none %d\n",
+            batch.n_jobs, elapsed, n_workers, wins[WINNER_HUNTERS], wins[WINNER_PREYS],
+            wins[WINNER_NONE]);
+    printf("%s: mean %.1f, min %ld, max %ld\n", unit, ticks / batch.n_jobs, min_ticks, max_ticks);
+    printf("captures: mean %.1f\n", captures / batch.n_jobs);
+    printf("hunter energy left: mean %.1f\n", energy / batch.n_jobs);
+}
+
+static void run_batch(const char *path, int n_workers)
+{
+    pthread_t *threads;
+    int i;
+    long long start = now_ns();
+    batch.options = sim;
+    batch_read(path);
+    if (n_workers > batch.n_jobs) {
+        n_workers = batch.n_jobs > 0 ? batch.n_jobs : 1;
+    }
+    threads = malloc(n_workers * sizeof *threads);
+    for (i = 0; i < n_workers; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, NULL) != 0) {
+            die(ERR_THREAD);
+        }
+    }
+    for (i = 0; i < n_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    batch_report(n_workers, (now_ns() - start) / 1e9);
+    for (i = 0; i < batch.n_jobs; i++) {
+        free(batch.jobs[i].path);
+    }
+    free(batch.jobs);
+    free(threads);
+}
+
+int main(int argc, char **argv)
+{
+    /* Options, and the simulation itself unless this is a batch */
+    static struct sim options;
+    const char *batch_path = NULL;
+    int opt, batch_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    sim = &options;
+    sim->input = stdin;
+    sim->backend = &poll_backend;
+    sim->transport = &socket_transport;
+    sim->paced = 1;
+    sim->index.enabled = 1;
+    sim->pool.n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    sim->log.fd = -1;
+    while ((opt = getopt(argc, argv, "b:t:a:w:i:cgs:Bm:d:r:f:VLP:S:k:l:M:A:R:j:")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (strcmp(optarg, "poll") == 0) {
+                    sim->backend = &poll_backend;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    sim->backend = &epoll_backend;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    sim->backend = &uring_backend;
+                } else {
+                    die(ERR_USAGE);
+                }
+                break;
+            case 't':
+                if (strcmp(optarg, "socket") == 0) {
+                    sim->transport = &socket_transport;
+                } else if (strcmp(optarg, "shm") == 0) {
+                    sim->transport = &shm_transport;
+                } else {
+                    die(ERR_USAGE);
+                }
+                break;
+            case 'a':
+                if (strcmp(optarg, "process") == 0) {
+                    sim->in_process = 0;
+                } else if (strcmp(optarg, "thread") == 0) {
+                    sim->in_process = 1;
+                } else {
+                    die(ERR_USAGE);
+                }
+                break;
+            case 'w':
+                if (sscanf(optarg, "%d", &sim->pool.n_workers) != 1 ||
+                        sim->pool.n_workers < 1) {
+                    die(ERR_USAGE);
+                }
+                break;
+            case 'i':
+                sim->index.simd = 0;
+                if (strcmp(optarg, "scan") == 0) {
+                    sim->index.enabled = 0;
+                } else if (strcmp(optarg, "grid") == 0) {
+                    sim->index.enabled = 1;
+                } else if (strcmp(optarg, "simd") == 0) {
+                    sim->index.enabled = 0;
+                    sim->index.simd = 1;
+                } else {
+                    die(ERR_USAGE);
+                }
+                break;
+            case 'c':
+                sim->index.check = 1;
+                break;
+            case 'g':
+                sim->field.enabled = 1;
+                break;
+            case 's':
+                if (sscanf(optarg, "%u", &sim->seed) != 1) {
+                    die(ERR_USAGE);
+                }
+                sim->seeded = 1;
+                break;
+            case 'B':
+                sim->bench.enabled = 1;
+                sim->quiet = 1;
+                sim->paced = 0;
+                break;
+            case 'V':
+                /* The server keeps time, agents answer at once */
+                sim->clock.enabled = 1;
+                sim->paced = 0;
+                break;
+            case 'L':
+                sim->lockstep.enabled = 1;
+                break;
+            case 'S':
+                /* Shards play lockstep ticks as fast as their agents answer */
+                if (sscanf(optarg, "%d", &sim->shard.n_shards) != 1 ||
+                        sim->shard.n_shards < 1) {
+                    die(ERR_USAGE);
+                }
+                sim->lockstep.enabled = 1;
+                sim->paced = 0;
+                sim->bench.enabled = 1;
+                sim->quiet = 1;
+                break;
+            case 'P':
+                /* Banded workers only run lockstep ticks */
+                if (sscanf(optarg, "%d", &sim->bands.n_workers) != 1 ||
+                        sim->bands.n_workers < 1) {
+                    die(ERR_USAGE);
+                }
+                sim->lockstep.enabled = 1;
+                break;
+            case 'm':
+                if (sscanf(optarg, "%ld", &sim->bench.max_moves) != 1 ||
+                        sim->bench.max_moves < 0) {
+                    die(ERR_USAGE);
+                }
+                break;
+            case 'd':
+                if (sscanf(optarg, "%lf", &sim->bench.deadline) != 1) {
+                    die(ERR_USAGE);
+                }
+                break;
+            case 'r':
+                if (strcmp(optarg, "full") == 0) {
+                    sim->render.delta = 0;
+                } else if (strcmp(optarg, "delta") == 0) {
+                    sim->render.delta = 1;
+                } else {
+                    die(ERR_USAGE);
+                }
+                break;
+            case 'f':
+                if (sscanf(optarg, "%d", &sim->render.fps) != 1 || sim->render.fps < 0) {
+                    die(ERR_USAGE);
+                }
+                break;
+            case 'k':
+                sim->snapshot.path = optarg;
+                break;
+            case 'l':
+                sim->log.path = optarg;
+                break;
+            case 'M':
+                if (sscanf(optarg, "%d", &sim->host.per_host) != 1 ||
+                        sim->host.per_host < 1 || sim->host.per_host > HOST_MAX_AGENTS) {
+                    die(ERR_USAGE);
+                }
+                break;
+            case 'A':
+                sim->agentd.path = optarg;
+                break;
+            case 'R':
+                batch_path = optarg;
+                break;
+            case 'j':
+                if (sscanf(optarg, "%d", &batch_workers) != 1 || batch_workers < 1) {
+                    die(ERR_USAGE);
+                }
+                break;
+            default:
+                die(ERR_USAGE);
+        }
+    }
+    if (optind != argc || (sim->clock.enabled && sim->lockstep.enabled)) {
+        die(ERR_USAGE);
+    }
+    if (sim->in_process) {
+        sim->backend = &pool_backend;
+    }
+    if (sim->host.per_host) {
+        /* Hosts keep one socket each, agents have no process of their own */
+        if (sim->in_process || sim->transport != &socket_transport) {
+            die(ERR_USAGE);
+        }
+        sim->backend = &host_backend;
+    }
+    if (sim->backend == &uring_backend && sim->transport != &socket_transport) {
+        /* Shared memory agents are woken through eventfds, not messages */
+        die(ERR_USAGE);
+    }
+    if (sim->agentd.path && (sim->in_process || sim->host.per_host ||
+                sim->transport != &socket_transport)) {
+        /* Pooled agents are plain socket agents */
+        die(ERR_USAGE);
+    }
+    rng_seed(&sim->clock.rng, sim->seeded ? sim->seed : (unsigned)time(NULL));
+    if (batch_path) {
+        if (sim->bands.n_workers || sim->shard.n_shards || sim->snapshot.path ||
+                sim->log.path || sim->host.per_host || sim->agentd.path) {
+            die(ERR_USAGE);
+        }
+        if (!sim->lockstep.enabled && !sim->bench.max_moves && sim->bench.deadline <= 0) {
+            /* Only lockstep runs are sure to stop, see batch_run() */
+            die(ERR_USAGE);
+        }
+        /* Virtual time unless -L, no agent processes and nothing drawn */
+        sim->clock.enabled = !sim->lockstep.enabled;
+        sim->paced = 0;
+        sim->in_process = 1;
+        sim->backend = &direct_backend;
+        sim->quiet = 1;
+        sim->bench.enabled = 0;
+        run_batch(batch_path, batch_workers);
+        return 0;
+    }
+    if (sim->shard.n_shards) {
+        if (sim->clock.enabled || sim->bands.n_workers || sim->field.enabled ||
+                sim->snapshot.path || sim->log.path || sim->host.per_host || sim->agentd.path ||
+                sim->transport != &socket_transport) {
+            /* Agent sockets move between shards with their agents */
+            die(ERR_USAGE);
+        }
+        /* Shards find adversaries on their own, see shard_index() */
+        sim->index.enabled = 0;
+        run_sharded();
+        return 0;
+    }
+
+    if (sim->snapshot.path) {
+        snapshot_init();
+    }
     init_map();
     run_simulation();
     clean_map();
@@ -0,0 +1,111 @@
+#include "tiles.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WORDS (TILES_SIDE * TILES_SIDE / 64)
+/* Spans of TILES_SIDE bits in a word, tile rows in the tiles' words and
+ * tile columns in a bitmap's
+ */
+#define SPANS (64 / TILES_SIDE)
+
+_Static_assert(64 % TILES_SIDE == 0, "a word must hold whole tile rows");
+
+void tiles_init(struct tiles *tiles, int rows, int width)
+{
+    size_t n_tiles;
+    tiles->rows = rows;
+    tiles->width = width;
+    tiles->per_row = (width + TILES_SIDE - 1) / TILES_SIDE;
+    n_tiles = (size_t)(rows + TILES_SIDE - 1) / TILES_SIDE * tiles->per_row;
+    tiles->tiles = calloc(n_tiles, sizeof *tiles->tiles);
+}
+
+void tiles_free(struct tiles *tiles)
+{
+    size_t i, n_tiles = (size_t)(tiles->rows + TILES_SIDE - 1) / TILES_SIDE * tiles->per_row;
+    for (i = 0; i < n_tiles; i++) {
+        free(tiles->tiles[i].agents);
+    }
+    free(tiles->tiles);
+}
+
+void tiles_load_obstacles(struct tiles *tiles, const uint64_t *bitmap, size_t row_words)
+{
+    const uint64_t row_mask = (1ULL << TILES_SIDE) - 1;
+    int x, column;
+    for (x = 0; x < tiles->rows; x++) {
+        const uint64_t *row = bitmap + x * row_words;
+        int shift = x % SPANS * TILES_SIDE;
+        for (column = 0; column < tiles->per_row; column++) {
+            uint64_t bits = row[column / SPANS] >>
+                (column % SPANS * TILES_SIDE) & row_mask;
+            struct tile *tile = &tiles->tiles[(size_t)(x / TILES_SIDE) * tiles->per_row + column];
+            tile->obstacle[x % TILES_SIDE / SPANS] |= bits << shift;
+        }
+    }
+}
+
+void tiles_store_obstacles(const struct tiles *tiles, int x, uint64_t *row, size_t row_words)
+{
+    const uint64_t row_mask = (1ULL << TILES_SIDE) - 1;
+    int shift = x % SPANS * TILES_SIDE, column;
+    memset(row, 0, row_words * sizeof *row);
+    for (column = 0; column < tiles->per_row; column++) {
+        const struct tile *tile = &tiles->tiles[(size_t)(x / TILES_SIDE) * tiles->per_row + column];
+        uint64_t bits = tile->obstacle[x % TILES_SIDE / SPANS] >> shift & row_mask;
+        row[column / SPANS] |= bits << (column % SPANS * TILES_SIDE);
+    }
+}
+
+static int tile_count(const struct tile *tile)
+{
+    int i, n = 0;
+    for (i = 0; i < WORDS; i++) {
+        n += __builtin_popcountll(tile->occupied[i]);
+    }
+    return n;
+}
+
+void tiles_set(struct tiles *tiles, int x, int y, int idx)
+{
+    struct tile *tile = tiles_tile(tiles, x, y);
+    int bit = x % TILES_SIDE * TILES_SIDE + y % TILES_SIDE, word = bit / 64;
+    uint64_t mask = 1ULL << (bit % 64);
+    int rank = tiles_rank(tile, word, mask);
+    if (tile->occupied[word] & mask) {
+        if (idx >= 0) {
+            tile->agents[rank] = idx;
+            return;
+        }
+        memmove(tile->agents + rank, tile->agents + rank + 1,
+                (tile_count(tile) - rank - 1) * sizeof *tile->agents);
+        tile->occupied[word] &= ~mask;
+    }
+    if (idx == TILES_OBSTACLE) {
+        tile->obstacle[word] |= mask;
+        return;
+    }
+    tile->obstacle[word] &= ~mask;
+    if (idx == TILES_EMPTY) {
+        return;
+    }
+    int n = tile_count(tile);
+    if (n == tile->capacity) {
+        tile->capacity = tile->capacity ? 2 * tile->capacity : 4;
+        tile->agents = realloc(tile->agents, tile->capacity * sizeof *tile->agents);
+    }
+    memmove(tile->agents + rank + 1, tile->agents + rank, (n - rank) * sizeof *tile->agents);
+    tile->agents[rank] = idx;
+    tile->occupied[word] |= mask;
+}
+
+size_t tiles_bytes(const struct tiles *tiles)
+{
+    size_t i, n_tiles = (size_t)(tiles->rows + TILES_SIDE - 1) / TILES_SIDE * tiles->per_row;
+    size_t bytes = n_tiles * sizeof *tiles->tiles;
+    for (i = 0; i < n_tiles; i++) {
+        bytes += tiles->tiles[i].capacity * sizeof *tiles->tiles[i].agents;
+    }
+    return bytes;
+}
@@ -0,0 +1,82 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Occupancy grid packed into TILES_SIDE x TILES_SIDE tiles. Each tile has an
+ * obstacle bitmap, an occupied bitmap and the agents on its occupied cells
+ * in bit order, so a cell costs 2 bits plus 4 bytes per agent instead of an
+ * int. A tile is 80 bytes, so a cell and its 4 neighbours usually sit in a
+ * cache line or two.
+ */
+
+#define TILES_SIDE 16
+#define TILES_OBSTACLE -1
+#define TILES_EMPTY -2
+
+struct tile {
+    uint64_t obstacle[TILES_SIDE * TILES_SIDE / 64];
+    uint64_t occupied[TILES_SIDE * TILES_SIDE / 64];
+    /* One per bit set in occupied, grows by doubling */
+    int *agents;
+    int capacity;
+};
+
+struct tiles {
+    int rows;
+    int width;
+    int per_row;
+    struct tile *tiles;
+};
+
+/* All cells empty */
+void tiles_init(struct tiles *tiles, int rows, int width);
+void tiles_free(struct tiles *tiles);
+
+/* Sets the obstacles of a row-major bitmap on a grid with no agents yet.
+ * Row x starts at word x * row_words, bit y % 64 of word y / 64 is (x, y).
+ */
+void tiles_load_obstacles(struct tiles *tiles, const uint64_t *bitmap, size_t row_words);
+
+/* Writes the obstacles of row x in the same bitmap layout, row_words
+ * words
+ */
+void tiles_store_obstacles(const struct tiles *tiles, int x, uint64_t *row, size_t row_words);
+
+/* idx is an agent, TILES_OBSTACLE or TILES_EMPTY */
+void tiles_set(struct tiles *tiles, int x, int y, int idx);
+
+/* Bytes held, for reporting */
+size_t tiles_bytes(const struct tiles *tiles);
+
+static inline struct tile *tiles_tile(const struct tiles *tiles, int x, int y)
+{
+    return &tiles->tiles[(size_t)(x / TILES_SIDE) * tiles->per_row + y / TILES_SIDE];
+}
+
+/* Occupied cells of tile before bit word*64 + log2(mask) */
+static inline int tiles_rank(const struct tile *tile, int word, uint64_t mask)
+{
+    int i, rank = __builtin_popcountll(tile->occupied[word] & (mask - 1));
+    for (i = 0; i < word; i++) {
+        rank += __builtin_popcountll(tile->occupied[i]);
+    }
+    return rank;
+}
+
+static inline int tiles_get(const struct tiles *tiles, int x, int y)
+{
+    const struct tile *tile = tiles_tile(tiles, x, y);
+    int bit = x % TILES_SIDE * TILES_SIDE + y % TILES_SIDE;
+    uint64_t mask = 1ULL << (bit % 64);
+    if (tile->obstacle[bit / 64] & mask) {
+        return TILES_OBSTACLE;
+    }
+    if (!(tile->occupied[bit / 64] & mask)) {
+        return TILES_EMPTY;
+    }
+    return tile->agents[tiles_rank(tile, bit / 64, mask)];
+}
+
+#endif